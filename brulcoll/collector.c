@@ -112,6 +112,7 @@ extern argtable_t argtable[];
 extern TAILQ_HEAD(, _device_t) alldevs;
 extern int collector_instance;
 extern struct bufferevent *gnhastd_bev;
+extern int gn_want_handles;
 
 /** The event base */
 struct event_base *base;
@@ -730,6 +731,8 @@ void calc_devices(void)
 	int64_t wdiff;
 	double watts;
 	device_t *dev;
+	device_t *updates[48*2 + 8 + 4 + 2]; /* wsec+watts, temp, pulse, v+sec */
+	int nrofupd = 0;
 	char uid[64];
 
 	/* wattsec counters */
@@ -741,7 +744,7 @@ void calc_devices(void)
 			continue;
 		}
 		store_data_dev(dev, DATALOC_DATA, &cur->channel[i]);
-		gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+		updates[nrofupd++] = dev;
 	}
 
 	/* temp sensors */
@@ -754,7 +757,7 @@ void calc_devices(void)
 				continue;
 			}
 			store_data_dev(dev, DATALOC_DATA, &cur->temp[i]);
-			gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+			updates[nrofupd++] = dev;
 		}
 
 	/* pulse counters */
@@ -767,7 +770,7 @@ void calc_devices(void)
 				continue;
 			}
 			store_data_dev(dev, DATALOC_DATA, &cur->pulse[i]);
-			gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+			updates[nrofupd++] = dev;
 		}
 
 	/* voltage */
@@ -775,18 +778,22 @@ void calc_devices(void)
 	dev = find_device_byuid(uid);
 	if (dev != NULL) {
 		store_data_dev(dev, DATALOC_DATA, &cur->voltage);
-		gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+		updates[nrofupd++] = dev;
 	}
 
 	sprintf(uid, "%0.8d-sec", brulconf.serial);
 	dev = find_device_byuid(uid);
 	if (dev != NULL) {
 		store_data_dev(dev, DATALOC_DATA, &cur->seconds);
-		gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+		updates[nrofupd++] = dev;
 	}
 
-	if (prev->seconds == 0)
-		return; /* wait for the next pass */
+	if (prev->seconds == 0) {
+		/* wait for the next pass */
+		gn_update_devices(updates, nrofupd, GNC_NOSCALE,
+		    gnhastd_conn->bev);
+		return;
+	}
 
 	/* watts/period */
 
@@ -810,8 +817,9 @@ void calc_devices(void)
 			wdiff = cur->channel[i] - prev->channel[i];
 		watts = (float)wdiff/(float)sdelta;
 		store_data_dev(dev, DATALOC_DATA, &watts);
-		gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+		updates[nrofupd++] = dev;
 	}
+	gn_update_devices(updates, nrofupd, GNC_NOSCALE, gnhastd_conn->bev);
 }
 
 /**
@@ -1071,6 +1079,9 @@ void connect_server_cb(int nada, short what, void *arg)
 		LOG(LOG_NOTICE, "Attempting to connect to %s @ %s:%d",
 		    conntype[conn->type], conn->host, conn->port);
 		if (need_rereg) {
+			/* forget the old server's apiv before registering,
+			   cmd_apiv asks for handles once the answer is in */
+			gn_get_apiv(gnhastd_conn->bev);
 			TAILQ_FOREACH(dev, &alldevs, next_all)
 				if (dumpconf == NULL && dev->name != NULL)
 					gn_register_device(dev, conn->bev);
@@ -1519,11 +1530,14 @@ int main(int argc, char **argv)
 	gnhastd_conn->port = cfg_getint(gnhastd_c, "port");
 	gnhastd_conn->type = CONN_TYPE_GNHASTD;
 	gnhastd_conn->host = cfg_getstr(gnhastd_c, "hostname");
+	/* we update often, let the server skip the uid lookups */
+	gn_want_handles = 1;
 	/* cheat, and directly call the timer callback
 	   This sets up a connection to the server. */
 	connect_server_cb(0, 0, gnhastd_conn);
 	collector_instance = cfg_getint(brultech_c, "instance");
 	gn_client_name(gnhastd_conn->bev, COLLECTOR_NAME);
+	gn_get_apiv(gnhastd_conn->bev);
 	
 	brulnet_conn = smalloc(connection_t);
 	switch (cfg_getint(brulcoll_c, "tscale")) {
@@ -37,6 +37,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/queue.h>
 #ifdef HAVE_SYS_RBTREE_H
  #include <sys/rbtree.h>
@@ -52,6 +53,20 @@ extern void coll_alarm_cb(alarm_t *alarm, char *aluid, void *arg);
 
 TAILQ_HEAD(, _alarm_t) alarms = TAILQ_HEAD_INITIALIZER(alarms);
 
+/** \brief alarms by aluid, chained through hnext */
+static alarm_t **alarmhash;
+/** \brief number of buckets in alarmhash, power of 2 */
+static uint32_t alarmhash_size;
+/** \brief number of alarms in alarmhash */
+static uint32_t nrofalarms;
+
+/** \brief ring of recent alarm changes, oldest is overwritten */
+static alarm_hist_t *alarmhist;
+/** \brief number of slots in alarmhist */
+static int alarmhist_size;
+/** \brief total changes recorded, alarmhist_next % size is the next slot */
+static uint64_t alarmhist_next;
+
 /* STUB */
 
 /**
@@ -66,23 +81,136 @@ void __attribute__((weak)) coll_alarm_cb(alarm_t *alarm, char *aluid,
 	return;
 }
 
+/**
+   \brief Add an alarm to the alarm hash, growing it if it is full
+   \param alarm alarm, with aluidhash filled in
+*/
+
+static void alarmhash_insert(alarm_t *alarm)
+{
+	alarm_t **old, *a, *nexta;
+	uint32_t i, oldsize;
+
+	if (nrofalarms >= alarmhash_size) {
+		old = alarmhash;
+		oldsize = alarmhash_size;
+		alarmhash_size = (oldsize) ? oldsize * 2 : 64;
+		alarmhash = calloc(alarmhash_size, sizeof(alarm_t *));
+		if (alarmhash == NULL)
+			bailout();
+		for (i = 0; i < oldsize; i++)
+			for (a = old[i]; a != NULL; a = nexta) {
+				nexta = a->hnext;
+				a->hnext = alarmhash[a->aluidhash &
+						     (alarmhash_size - 1)];
+				alarmhash[a->aluidhash &
+					  (alarmhash_size - 1)] = a;
+			}
+		if (old != NULL)
+			free(old);
+	}
+	i = alarm->aluidhash & (alarmhash_size - 1);
+	alarm->hnext = alarmhash[i];
+	alarmhash[i] = alarm;
+	nrofalarms++;
+}
+
+/**
+   \brief Take an alarm out of the alarm hash
+   \param alarm alarm to remove
+*/
+
+static void alarmhash_remove(alarm_t *alarm)
+{
+	alarm_t **ap;
+
+	for (ap = &alarmhash[alarm->aluidhash & (alarmhash_size - 1)];
+	     *ap != NULL; ap = &(*ap)->hnext)
+		if (*ap == alarm) {
+			*ap = alarm->hnext;
+			nrofalarms--;
+			return;
+		}
+}
+
 /**
    \brief Search the alarmtable for an alarm maching aluid
    \param aluid alarm uid to look for
    \return alarm_t * if found, NULL if not
-   \note  Slow, for now, don't see this as being a big deal
 */
 
 alarm_t *find_alarm_by_aluid(char *aluid)
 {
 	alarm_t *alarm;
+	uint32_t hash;
 
-	TAILQ_FOREACH(alarm, &alarms, next)
-		if (strcmp(aluid, alarm->aluid) == 0)
+	if (alarmhash == NULL || aluid == NULL)
+		return NULL;
+	hash = hash_uid(aluid);
+	for (alarm = alarmhash[hash & (alarmhash_size - 1)]; alarm != NULL;
+	     alarm = alarm->hnext)
+		if (alarm->aluidhash == hash && strcmp(aluid, alarm->aluid) == 0)
 			return alarm;
 	return NULL;
 }
 
+/**
+   \brief Start keeping a history of alarm changes
+   \param size number of changes to remember, 0 for none
+*/
+
+void init_alarm_history(int size)
+{
+	if (alarmhist != NULL || size < 1)
+		return;
+	alarmhist = calloc(size, sizeof(alarm_hist_t));
+	if (alarmhist == NULL)
+		bailout();
+	alarmhist_size = size;
+}
+
+/**
+   \brief Record a change to an alarm in the history
+   \param aluid alarm uid
+   \param altext alarm text, NULL if cleared
+   \param alsev new severity, 0 if cleared
+   \param alchan alarm channels
+*/
+
+static void alarm_history_add(char *aluid, char *altext, int alsev,
+			      uint32_t alchan)
+{
+	alarm_hist_t *hist;
+
+	if (alarmhist == NULL)
+		return;
+	hist = &alarmhist[alarmhist_next % alarmhist_size];
+	if (hist->aluid != NULL)
+		free(hist->aluid);
+	if (hist->altext != NULL)
+		free(hist->altext);
+	hist->aluid = strdup(aluid);
+	hist->altext = (altext != NULL) ? strdup(altext) : NULL;
+	hist->alsev = alsev;
+	hist->alchan = alchan;
+	hist->when = time(NULL);
+	alarmhist_next++;
+}
+
+/**
+   \brief Get an entry from the alarm history
+   \param n how far back to look, 0 is the most recent change
+   \return the change, or NULL if we don't remember that far back
+*/
+
+alarm_hist_t *alarm_history(int n)
+{
+	if (alarmhist == NULL || n < 0 || n >= alarmhist_size ||
+	    (uint64_t)n >= alarmhist_next)
+		return NULL;
+	return &alarmhist[(alarmhist_next - 1 - n) % alarmhist_size];
+}
+
 /**
    \brief Fully update an alarm
    \param aluid UID of alarm to update
@@ -97,6 +225,7 @@ alarm_t *find_alarm_by_aluid(char *aluid)
 alarm_t *update_alarm(char *aluid, char *altext, int alsev, uint32_t alchan)
 {
 	alarm_t *alarm;
+	int changed;
 
 	alarm = find_alarm_by_aluid(aluid);
 
@@ -115,13 +244,18 @@ alarm_t *update_alarm(char *aluid, char *altext, int alsev, uint32_t alchan)
 		alarm->alsev = alsev;
 		alarm->altext = strdup(altext);
 		alarm->alchan = alchan;
+		alarm->aluidhash = hash_uid(aluid);
 		TAILQ_INSERT_TAIL(&alarms, alarm, next);
+		alarmhash_insert(alarm);
+		alarm_history_add(aluid, altext, alsev, alchan);
 
 		return alarm;
 	}
 	/* ok, we have an alarm.  do we nuke? */
 	if (alsev == 0) {
+		alarm_history_add(aluid, NULL, 0, alarm->alchan);
 		TAILQ_REMOVE(&alarms, alarm, next);
+		alarmhash_remove(alarm);
 		if (alarm->aluid != NULL)
 			free(alarm->aluid);
 		if (alarm->altext != NULL)
@@ -131,15 +265,22 @@ alarm_t *update_alarm(char *aluid, char *altext, int alsev, uint32_t alchan)
 		return NULL;
 	}
 	/* guess not, let's update the text and sev */
+	if (alchan < 1)
+		SET_FLAG(alchan, ACHAN_GENERIC);
+	changed = (alsev != -1 && alsev != alarm->alsev) ||
+	    alchan != alarm->alchan || (altext != NULL &&
+	    (alarm->altext == NULL || strcmp(altext, alarm->altext) != 0));
 	if (alarm->altext != NULL && altext != NULL) {
 		free(alarm->altext);
 		alarm->altext = strdup(altext);
 	}
 	if (alsev != -1)
 		alarm->alsev = alsev;
-	if (alchan < 1)
-		SET_FLAG(alchan, ACHAN_GENERIC);
 	alarm->alchan = alchan;
+	/* collectors repeat alarms every cycle, only keep real changes */
+	if (changed)
+		alarm_history_add(aluid, alarm->altext, alarm->alsev,
+				  alarm->alchan);
 
 	return alarm;
 }
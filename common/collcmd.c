@@ -77,6 +77,9 @@ extern void coll_chg_number_cb(device_t *dev, int64_t num, void *arg);
 extern char *conffile;
 extern cfg_t *cfg;
 extern struct bufferevent *gnhastd_bev;
+extern int gnhastd_apiv;
+extern int gn_want_handles;
+extern TAILQ_HEAD(, _device_t) alldevs;
 
 int min_proto_version = 0; /**< \brief the minimum protocol version we will accept */
 
@@ -85,6 +88,9 @@ int min_proto_version = 0; /**< \brief the minimum protocol version we will acce
    \capi endlgrps - Sent to client when a lgrps command finishes sending all listed groups.
    \capi die - Tell the client to shutdown and die.
    \capi ping - Ping the client to see if it's alive still
+   \capi hdl - Sent in reply to a reg with a hdl argument, gives the handle the server knows the device by.
+   \capi snap - One device's value in reply to a snapshot command, handled like an upd.
+   \capi endsnap - Sent to client when a snapshot command finishes.
 */
 
 /** \brief The command table */
@@ -101,6 +107,9 @@ commands_t commands[] = {
 	{"mod", cmd_modify, 0},
 	{"setalarm", cmd_alarm, 0},
 	{"apiv", cmd_apiv, 0},
+	{"hdl", cmd_handle, 0},
+	{"snap", cmd_update, 0},
+	{"endsnap", cmd_endsnap, 0},
 };
 
 /** The size of the command table */
@@ -251,12 +260,16 @@ int __attribute__((weak)) cmd_alarm(pargs_t *args, void *arg)
    \brief Handle an apiv command
    \param args The list of arguments
    \param arg void pointer to client_t of provider
+   \note Devices registered before the answer came back went out without
+   hdl:0, since the server might not have known it.  If it does, they are
+   registered again to ask for their handles.
 */
 
 int cmd_apiv(pargs_t *args, void *arg)
 {
-	int i;
+	int i, oldapiv = gnhastd_apiv;
 	int64_t version = 0;
+	device_t *dev;
 
 	for (i=0; args[i].cword != -1; i++) {
 		switch (args[i].cword) {
@@ -268,13 +281,68 @@ int cmd_apiv(pargs_t *args, void *arg)
 
 	LOG(LOG_DEBUG, "Gnhastd APIV: %d My min APIV: %d", version,
 	    min_proto_version);
+	gnhastd_apiv = (int)version;
 
 	if (version < min_proto_version)
 		LOG(LOG_FATAL, "This collector needs protocol API %d, but the"
 		    " server is %d.", min_proto_version, version);
+
+	if (gn_want_handles && gnhastd_bev != NULL &&
+	    oldapiv < GNHASTD_HANDLE_VERS && version >= GNHASTD_HANDLE_VERS)
+		TAILQ_FOREACH(dev, &alldevs, next_all)
+			if (QUERY_FLAG(dev->flags, DEVFLAG_REGISTERED) &&
+			    dev->srvhandle == 0)
+				gn_register_device(dev, gnhastd_bev);
 	return(0);
 }
 
+/**
+   \brief Handle a hdl command
+   \param args The list of arguments
+   \param arg void pointer to client_t of provider
+   \note From now on, updates for the device are sent with the handle
+   instead of the uid.
+*/
+
+int cmd_handle(pargs_t *args, void *arg)
+{
+	int i;
+	char *uid = NULL;
+	uint32_t handle = 0;
+	device_t *dev;
+
+	for (i=0; args[i].cword != -1; i++) {
+		switch (args[i].cword) {
+		case SC_UID:
+			uid = args[i].arg.c;
+			break;
+		case SC_HANDLE:
+			handle = args[i].arg.u;
+			break;
+		}
+	}
+	if (uid == NULL || (dev = find_device_byuid(uid)) == NULL) {
+		LOG(LOG_ERROR, "Got handle for unknown device");
+		return -1;
+	}
+	LOG(LOG_DEBUG, "Device uid:%s has handle %u", uid, handle);
+	dev->srvhandle = handle;
+	return 0;
+}
+
+/**
+	\brief Handle an endsnap command
+	\param args The list of arguments
+	\param arg void pointer to client_t of provider
+	\note The snap lines have already been applied as updates.
+*/
+
+int cmd_endsnap(pargs_t *args, void *arg)
+{
+	LOG(LOG_DEBUG, "Snapshot complete");
+	return 0;
+}
+
 /**
 	\brief Handle a register device command
 	\param args The list of arguments
@@ -330,7 +398,7 @@ int cmd_register(pargs_t *args, void *arg)
 			return(-1);
 		}
 		if (rrdname == NULL)
-			rrdname = strndup(name, 19);
+			rrdname = name;
 		dev = smalloc(device_t);
 		dev->uid = strdup(uid);
 		new = 1;
@@ -372,16 +440,16 @@ int cmd_register_group(pargs_t *args, void *arg)
 	for (i=0; args[i].cword != -1; i++) {
 		switch (args[i].cword) {
 		case SC_UID:
-			uid = strdup(args[i].arg.c);
+			uid = args[i].arg.c;
 			break;
 		case SC_NAME:
-			name = strdup(args[i].arg.c);
+			name = args[i].arg.c;
 			break;
 		case SC_GROUPLIST:
-			grouplist = strdup(args[i].arg.c);
+			grouplist = args[i].arg.c;
 			break;
 		case SC_DEVLIST:
-			devlist = strdup(args[i].arg.c);
+			devlist = args[i].arg.c;
 			break;
 		}
 	}
@@ -404,11 +472,13 @@ int cmd_register_group(pargs_t *args, void *arg)
 			return(-1);
 		}
 		devgrp = new_devgroup(uid);
-		devgrp->uid = uid;
 	} else
 		LOG(LOG_DEBUG, "Updating existing device group uid:%s", uid);
 
-	devgrp->name = name;
+	if (name != NULL) {
+		free(devgrp->name);
+		devgrp->name = strdup(name);
+	}
 
 	if (grouplist != NULL) {
 		tmpbuf = grouplist;
@@ -424,7 +494,6 @@ int cmd_register_group(pargs_t *args, void *arg)
 				    "group %s", cgrp->uid, uid);
 			}
 		}
-		free(grouplist);
 	}
 
 	if (devlist != NULL) {
@@ -441,7 +510,6 @@ int cmd_register_group(pargs_t *args, void *arg)
 				    "group %s", dev->uid, uid);
 			}
 		}
-		free(devlist);
 	}
 
 	return(0);
@@ -456,9 +524,10 @@ int cmd_register_group(pargs_t *args, void *arg)
 int cmd_update(pargs_t *args, void *arg)
 {
   int i, j, k;
+	time_t lupd = 0;
 	device_t *dev;
 	char *uid=NULL;
-	char *p, *hold, *fhold;
+	char *p, *hold;
 	client_t *client = (client_t *)arg;
 
 	/* loop through the args and find the UID */
@@ -483,55 +552,13 @@ int cmd_update(pargs_t *args, void *arg)
 
 	for (i=0; args[i].cword != -1; i++) {
 		switch (args[i].cword) {
-		case SC_SWITCH:
-		case SC_WEATHER:
-		case SC_ALARMSTATUS:
-		case SC_THMODE:
-		case SC_THSTATE:
-		case SC_SMNUMBER:
-		case SC_COLLECTOR:
-		case SC_BLIND:
-		case SC_DAYLIGHT:
-		case SC_MOONPH:
-		case SC_TRISTATE:
-			store_data_dev(dev, DATALOC_DATA, &args[i].arg.i);
-			break;
-		case SC_LUX:
-		case SC_HUMID:
-		case SC_TEMP:
-		case SC_DIMMER:
-		case SC_PRESSURE:
-		case SC_SPEED:
-		case SC_DIR:
-		case SC_PH:
-		case SC_WETNESS:
-		case SC_VOLTAGE:
-		case SC_WATT:
-		case SC_AMPS:
-		case SC_PERCENTAGE:
-		case SC_FLOWRATE:
-		case SC_VOLUME:
-		case SC_DISTANCE:
-		case SC_ORP:
-		case SC_SALINITY:
-			store_data_dev(dev, DATALOC_DATA, &args[i].arg.d);
-			break;
-		case SC_TIMER:
-		case SC_COUNT:
-		case SC_TRIGGER:
-			store_data_dev(dev, DATALOC_DATA, &args[i].arg.u);
-			break;
-		case SC_WATTSEC:
-		case SC_NUMBER:
-			store_data_dev(dev, DATALOC_DATA, &args[i].arg.ll);
-			break;
 		case SC_HANDLER:
 			if (dev->handler != NULL)
 				free(dev->handler);
 			dev->handler = strdup(args[i].arg.c);
 			break;
 		case SC_HARGS:
-			fhold = hold = strdup(args[i].arg.c);
+			hold = netparse_strdup(args[i].arg.c);
 			/* free the old hargs */
 			for (j = 0; j < dev->nrofhargs; j++)
 				free(dev->hargs[j]);
@@ -543,20 +570,18 @@ int cmd_update(pargs_t *args, void *arg)
 			dev->nrofhargs = j;
 			dev->hargs = safer_malloc(sizeof(char *) *
 						  dev->nrofhargs);
-			free(fhold);
-			fhold = hold = strdup(args[i].arg.c);
+			strcpy(hold, args[i].arg.c);
 			for ((p = strtok(hold, ",")), j=0;
 			     p && j < dev->nrofhargs;
 			     (p = strtok(NULL, ",")), j++) {
 				dev->hargs[j] = strdup(p);
 			}
-			free(fhold);
 			LOG(LOG_NOTICE, "Handler args uid:%s changed to %s,"
 			    " %d arguments", dev->uid, args[i].arg.c,
 			    dev->nrofhargs);
 			break;
 		case SC_TAGS:
-			fhold = hold = strdup(args[i].arg.c);
+			hold = netparse_strdup(args[i].arg.c);
 			/* free the old tags */
 			for (j = 0; j < dev->nroftags; j++)
 				free(dev->tags[j]);
@@ -570,25 +595,34 @@ int cmd_update(pargs_t *args, void *arg)
 				dev->nroftags += 1;
 			dev->tags = safer_malloc(sizeof(char *) *
 						  dev->nroftags);
-			free(fhold);
-			fhold = hold = strdup(args[i].arg.c);
+			strcpy(hold, args[i].arg.c);
 			for ((p = strtok(hold, ",")), k=0;
 			     p && k < j;
 			     (p = strtok(NULL, ",")), k++) {
 				dev->tags[k] = strdup(p);
 			}
-			free(fhold);
 			if (j % 2 == 1)
 				dev->tags[k+1] = "";
 			LOG(LOG_NOTICE, "Handler args uid:%s changed to %s,"
 			    " %d arguments", dev->uid, args[i].arg.c,
 			    dev->nroftags);
 			break;
-
+		case SC_LASTUPD:
+			lupd = (time_t)args[i].arg.ll;
+			break;
+		default:
+			if (arg_is_data(args[i].cword))
+				store_data_dev(dev, DATALOC_DATA,
+					       &args[i].arg);
+			break;
 		}
 	}
 
-	(void)time(&dev->last_upd);
+	/* a snap tells us when the server last heard of it */
+	if (lupd > 0)
+		dev->last_upd = lupd;
+	else
+		(void)time(&dev->last_upd);
 	coll_upd_cb(dev, arg);
 	return(0);
 }
@@ -602,8 +636,6 @@ int cmd_update(pargs_t *args, void *arg)
 int cmd_change(pargs_t *args, void *arg)
 {
 	int i, state;
-	uint32_t tstate;
-	int64_t num;
 	device_t *dev;
 	char *uid=NULL;
 	client_t *client = (client_t *)arg;
@@ -658,52 +690,14 @@ int cmd_change(pargs_t *args, void *arg)
 			}
 			store_data_dev(dev, DATALOC_CHANGE, &level);
 			break;
-		case SC_WEATHER:
-		case SC_THMODE:
-		case SC_THSTATE:
-		case SC_SMNUMBER:
-		case SC_ALARMSTATUS:
-		case SC_COLLECTOR:
-		case SC_BLIND:
-		case SC_DAYLIGHT:
-		case SC_MOONPH:
-		case SC_TRISTATE:
-			store_data_dev(dev, DATALOC_CHANGE, &args[i].arg.i);
-			state = args[i].arg.i; /* XXX */
-			break;
-		case SC_LUX:
-                case SC_HUMID:
-                case SC_TEMP:
-                case SC_PRESSURE:
-                case SC_SPEED:
-                case SC_DIR:
-                case SC_PH:
-                case SC_WETNESS:
-                case SC_VOLTAGE:
-                case SC_WATT:
-                case SC_AMPS:
-                case SC_PERCENTAGE:
-                case SC_FLOWRATE:
-                case SC_DISTANCE:
-                case SC_VOLUME:
-		case SC_ORP:
-		case SC_SALINITY:
-			store_data_dev(dev, DATALOC_CHANGE, &args[i].arg.d);
-			break;
-		case SC_COUNT:
-		case SC_TIMER:
-		case SC_TRIGGER:
-			store_data_dev(dev, DATALOC_CHANGE, &args[i].arg.u);
-			tstate = args[i].arg.u; /* XXX */
-			break;
-		case SC_WATTSEC:
-		case SC_NUMBER:
-			store_data_dev(dev, DATALOC_CHANGE, &args[i].arg.ll);
-			num = args[i].arg.ll; /* XXX */
-			break;
 		case SC_UID:
 			break;
 		default:
+			if (arg_is_data(args[i].cword)) {
+				store_data_dev(dev, DATALOC_CHANGE,
+					       &args[i].arg);
+				break;
+			}
 			LOG(LOG_WARNING, "Got an unhandled device type/subtype"
 			    " in cmd_change() for device %s", dev->uid);
 			return(-1);
@@ -777,50 +771,24 @@ int cmd_modify(pargs_t *args, void *arg)
 
 void gnhastd_read_cb(struct bufferevent *in, void *arg)
 {
-	char *data;
-	char **words, *cmdword;
-	int numwords, i;
-	pargs_t *args=NULL;
+	static netparse_t np;
+	char *data, *cmdword;
+	pargs_t *args;
 	struct evbuffer *evbuf;
 	size_t len;
 
-	/* loop as long as we have data to read */
-	while (1) {
-		evbuf = bufferevent_get_input(in);
-		data = evbuffer_readln(evbuf, &len, EVBUFFER_EOL_CRLF);
+	evbuf = bufferevent_get_input(in);
 
-		if (data == NULL || len < 1)
-			return;
+	/* loop as long as we have data to read */
+	while ((data = netparse_readln(&np, evbuf, &len)) != NULL) {
+		if (len < 1)
+			continue;
 
 		LOG(LOG_DEBUG, "Got data %s", data);
 
-		words = parse_netcommand(data, &numwords);
-
-		if (words == NULL || words[0] == NULL) {
-			free(data);
-			goto out;
-		}
-
-		cmdword = strdup(words[0]);
-		args = parse_command(words, numwords);
+		args = parse_netline(&np, data, &cmdword);
+		if (args == NULL)
+			continue;
 		parsed_command(cmdword, args, arg);
-		free(cmdword);
-		free(data);
-		if (args) {
-			for (i=0; args[i].cword != -1; i++)
-				if (args[i].type == PTCHAR)
-					free(args[i].arg.c);
-			free(args);
-			args=NULL;
-		}
-	}
-
-out:
-	if (args) {
-		for (i=0; args[i].cword != -1; i++)
-			if (args[i].type == PTCHAR)
-				free(args[i].arg.c);
-		free(args);
-		args=NULL;
 	}
 }
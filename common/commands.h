@@ -25,6 +25,26 @@ typedef struct _pargs_t {
 	} arg;			/**< \brief argument data */
 } pargs_t;
 
+/** \brief initial size of a parser line buffer */
+#define NETPARSE_LINESIZE	256
+/** \brief initial number of parser argument slots */
+#define NETPARSE_ARGS		16
+/** \brief initial size of a parser's scratch arena */
+#define NETPARSE_ARENA		1024
+
+/** \brief Per-connection parser state, reused for every line */
+typedef struct _netparse_t {
+	char *line;		/**< \brief line buffer, tokenized in place */
+	size_t linesize;	/**< \brief allocated size of line */
+	pargs_t *args;		/**< \brief parsed args, cword -1 terminated */
+	int argsize;		/**< \brief allocated entries in args */
+	char *arena;		/**< \brief scratch for handling one line */
+	size_t arenasize;	/**< \brief allocated size of arena */
+	size_t arenaused;	/**< \brief bytes of arena handed out */
+	struct _netparse_spill_t *spill; /**< \brief scratch that did not fit */
+	size_t spilled;		/**< \brief bytes in spill */
+} netparse_t;
+
 typedef struct _argtable_t {
 	char *name;	/**< \brief Argument keyword */
 	int num;	/**< \brief argument subcommand number */
@@ -113,13 +133,33 @@ enum SC_COMMANDS {
 	SC_DAYLIGHT,	/**< \brief daylight */
 	SC_MOONPH,	/**< \brief lunar phase */
 	SC_TRISTATE,	/**< \brief tri-state device */
+	SC_HANDLE,	/**< \brief device handle */
+	SC_DEADBAND,	/**< \brief feed deadband, absolute */
+	SC_DBPCT,	/**< \brief feed deadband, percent */
+	SC_HEARTBEAT,	/**< \brief feed heartbeat, seconds */
+	SC_LASTUPD,	/**< \brief time of last update */
+	SC_SINCE,	/**< \brief only history from this time on */
+	SC_MAX,		/**< \brief at most this many */
+	SC_WINDOW,	/**< \brief stats window, seconds */
+	SC_WCOUNT,	/**< \brief values in the stats window */
+	SC_WMIN,	/**< \brief lowest value in the window */
+	SC_WMAX,	/**< \brief highest value in the window */
+	SC_WAVG,	/**< \brief mean of the window */
+	SC_WSDEV,	/**< \brief standard deviation of the window */
+	SC_WRATE,	/**< \brief change per second over the window */
+	NROF_SC_COMMANDS,
 };
 
 void init_argcomm(void);
-pargs_t *parse_command(char **words, int count); 
-char **parse_netcommand(char *buf, int *arg_count);
+char *netparse_readln(netparse_t *np, struct evbuffer *evbuf, size_t *len);
+pargs_t *parse_netline(netparse_t *np, char *line, char **cmdword);
+void netparse_free(netparse_t *np);
+void *netparse_alloc(size_t size);
+char *netparse_strdup(const char *s);
+extern uint64_t netparse_lines;
 int find_arg_by_id(pargs_t *args, int id);
 int find_arg_bydev(device_t *dev);
 int find_arg_byid(int id);
+int arg_is_data(int id);
 
 #endif /*_COMMAND_H_*/
@@ -49,10 +49,16 @@
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <event2/event.h>
 
 #include "common.h"
 #include "confparser.h"
 
+/**
+   \brief allocations made by safer_malloc, and by libevent once counted
+   \note Bumped atomically, the I/O threads allocate too.
+*/
+uint64_t nrof_allocs = 0;
 char *stored_logname = NULL;
 char *stored_pidfile = NULL;
 extern FILE *logfile;
@@ -147,54 +153,7 @@ FILE *openlog(char *logname)
 void closelog(void)
 {
 	LOG(LOG_NOTICE, "Exiting");
-	if (logfile != NULL)
-		fclose(logfile);
-}
-
-/**
-   \brief Log something
-   \param severity Severity of log, see LOG_WARNING etc
-   \param s format string
-   \param ... arguments
-*/
-void LOG(int severity, const char *s, ...)
-{
-	char *t, *timestamp;
-	time_t now;
-	va_list args;
-
-	if (!debugmode && severity == LOG_DEBUG)
-		return;
-	now = time(NULL);
-	t = safer_malloc(sizeof(char)*26);
-	timestamp = safer_malloc(sizeof(char)*26);
-	t = ctime_r(&now, t); /* cut the day off */
-	(void)strncpy(timestamp, t+4, 15); /* cut the year off */
-	free(t);
-
-	if (logfile != NULL) {
-		va_start(args, s);
-		fprintf(logfile, "%s [%s]:", timestamp, loglevels[severity]);
-		free(timestamp);
-		vfprintf(logfile, s, args);
-		fprintf(logfile, "\n");
-		if (severity == LOG_FATAL) {
-			vfprintf(stderr, s, args);
-			fprintf(stderr, "\n");
-		}
-		fflush(logfile);
-		va_end(args);
-	} else {
-		va_start(args, s);
-		fprintf(stderr, "%s [%s]:", timestamp, loglevels[severity]);
-		free(timestamp);
-		vfprintf(stderr, s, args);
-		fprintf(stderr, "\n");
-		fflush(stderr);
-		va_end(args);
-	}
-	if (severity == LOG_FATAL)
-		exit(EXIT_FAILURE);
+	log_closefile();
 }
 
 /**
@@ -234,9 +193,34 @@ void *_safer_malloc(size_t size, char *file, int line)
 	if (stuff == NULL)
 		_bailout(file, line);
 	memset(stuff, 0, size);
+	__atomic_add_fetch(&nrof_allocs, 1, __ATOMIC_RELAXED);
 	return(stuff);
 }
 
+/** \brief malloc for libevent, counted */
+static void *counted_malloc(size_t size)
+{
+	__atomic_add_fetch(&nrof_allocs, 1, __ATOMIC_RELAXED);
+	return(malloc(size));
+}
+
+/** \brief realloc for libevent, counted */
+static void *counted_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&nrof_allocs, 1, __ATOMIC_RELAXED);
+	return(realloc(ptr, size));
+}
+
+/**
+   \brief Count libevent's allocations in nrof_allocs too
+   \note Must be called before anything else touches libevent.
+*/
+
+void count_event_allocs(void)
+{
+	event_set_mem_functions(counted_malloc, counted_realloc, free);
+}
+
 /**
 	\brief Take a string, and turn it into a valid rrdname
 	\param orig The original string
@@ -403,8 +387,7 @@ void cb_sighup(int fd, short what, void *arg)
 	LOG(LOG_NOTICE, "Got sighup, re-reading conf file and re-opening log");
 
 	cfg = parse_conf(conffile);
-	closelog();
-	openlog(stored_logname);
+	log_reopen(stored_logname);
 	LOG(LOG_NOTICE, "Logfile re-opened");
 }
 
@@ -27,6 +27,21 @@
 #define LOG_ERROR	4
 #define LOG_FATAL	5
 
+/** \brief lines below this severity are compiled out */
+#ifndef LOG_MINLEVEL
+#define LOG_MINLEVEL	LOG_DEBUG
+#endif
+
+/** \brief would a line of this severity be logged right now */
+#define LOG_ENABLED(sev) \
+	((sev) >= LOG_MINLEVEL && ((sev) != LOG_DEBUG || debugmode))
+
+/** \brief log a line, the arguments are not evaluated unless it is logged */
+#define LOG(sev, ...) \
+	((void)(LOG_ENABLED(sev) ? _LOG(sev, __VA_ARGS__) : (void)0))
+
+extern int debugmode;
+
 #define LITTLE_E (*(char *)(void *)&indian)
 
 #define LETOH32(x)	((LITTLE_E) ? x : bswap32(x))
@@ -93,9 +108,10 @@
 /* from common.c */
 FILE *openlog(char *logf);
 void closelog(void);
-void LOG(int severity, const char * s, ...);
 void _bailout(char *file, int line);
 void *_safer_malloc(size_t size, char *file, int line);
+extern uint64_t nrof_allocs;
+void count_event_allocs(void);
 char *mk_rrdname(char *orig);
 int lcm(int a,int b);
 int gcd(int a, int b);
@@ -105,14 +121,23 @@ void delete_pidfile(void);
 void cb_sighup(int fd, short what, void *arg);
 void cb_sigusr1(int fd, short what, void *arg);
 
+/* from logger.c */
+void _LOG(int severity, const char *s, ...);
+void log_flush(void);
+void log_closefile(void);
+void log_reopen(char *logname);
+
 /* from netparser.c */
 int compare_command(const void *a, const void *b);
 
 /* from devices.c */
+uint32_t hash_uid(const char *uid);
 device_t *find_device_byuid(char *uid);
+device_t *find_device_byhandle(uint32_t handle);
 device_group_t *find_devgroup_byuid(char *uid);
-void add_wrapped_device(device_t *dev, client_t *client, int rate, int scale);
-void add_wrapped_client(client_t *client, device_t *dev);
+wrap_device_t *add_wrapped_device(device_t *dev, client_t *client, int rate, int scale);
+wrap_client_t *add_wrapped_client(client_t *client, device_t *dev);
+void remove_wrapped_client(client_t *client);
 void insert_device(device_t *dev);
 device_group_t *new_devgroup(char *uid);
 void add_dev_group(device_t *dev, device_group_t *devgrp);
@@ -123,13 +148,20 @@ int dev_in_group(device_t *dev, device_group_t *devgrp);
 int group_in_group(device_group_t *grp, device_group_t *devgrp);
 void init_devtable(cfg_t *cfg, int readconf);
 void get_data_dev(device_t *dev, int where, void *data);
+void get_data_store(device_t *dev, data_t *store, void *data);
+double get_double_store(device_t *dev, data_t *store);
 void store_data_dev(device_t *dev, int where, void *data);
+extern void (*dev_data_stored)(device_t *dev);
+extern void (*timerdev_expired)(device_t *dev);
 char *print_data_dev(device_t *dev, int where);
 void parse_hargs(device_t *dev, char *data);
 void parse_tags(device_t *dev, char *data);
 int datatype_dev(device_t *dev);
+int datastore_dev(device_t *dev);
+extern const subtype_info_t subtype_info[];
 int device_watermark(device_t *dev);
-void cb_timerdev_update(int fd, short what, void *arg);
+int deadband_check(device_t *dev, deadband_t *db);
+void init_timerdevs(struct event_base *base);
 
 /* From serial_common.c */
 #include <termios.h>
@@ -139,5 +171,7 @@ void serial_eventcb(struct bufferevent *bev, short events, void *arg);
 /* From alarms.c */
 alarm_t *find_alarm_by_aluid(char *aluid);
 alarm_t *update_alarm(char *aluid, char *altext, int alsev, uint32_t alchan);
+void init_alarm_history(int size);
+alarm_hist_t *alarm_history(int n);
 
 #endif /* _COMMON_H_ */
@@ -0,0 +1,647 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file confcache.c
+   \brief Compiled cache of a parsed config file
+   \author Tim Rightnour
+
+   After a config file has been parsed, every value in it is written out to
+   <file>.cache as a flat binary image: a header, the files it was read
+   from, a stream of fixed size records and a string table.  The next
+   parse_conf() of the same file maps the image and rebuilds the cfg_t from
+   it without running the lexer.  The cache is only used if the config and
+   everything it included still have the size, mtime and hash recorded in
+   it, and the program's option table is the one that wrote it; otherwise
+   the file is parsed as usual and the cache written again.
+
+   A program opts in by having a confcache option in its option table;
+   the cache is only written when the config sets it true.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "confuse.h"
+#include "config.h"
+#include "common.h"
+#include "gnhast.h"
+#include "confparser.h"
+
+extern cfg_opt_t options[];
+
+#define CONFCACHE_MAGIC		0x47434346	/* GCCF */
+#define CONFCACHE_VERSION	2
+#define CONFCACHE_NOSTR		0xFFFFFFFFU
+#define CONFCACHE_MAXDEPTH	16
+
+/* record kinds */
+#define CC_SEC		1	/**< start of a section, v is the title */
+#define CC_END		2	/**< end of the current section */
+#define CC_OPT		3	/**< option, v is the number of values */
+#define CC_VAL		4	/**< one value of the option before it */
+
+/** \brief header of a cache image */
+typedef struct _cc_header_t {
+	uint32_t magic;		/**< \brief CONFCACHE_MAGIC */
+	uint32_t version;	/**< \brief CONFCACHE_VERSION */
+	uint32_t opthash;	/**< \brief hash of the option table */
+	uint32_t nrofsrcs;	/**< \brief number of source files */
+	uint32_t nrofrecs;	/**< \brief number of records */
+	uint32_t strsize;	/**< \brief bytes in the string table */
+} cc_header_t;
+
+/** \brief a file the config was read from */
+typedef struct _cc_src_t {
+	int64_t mtime;		/**< \brief modification time */
+	int64_t size;		/**< \brief size in bytes */
+	uint32_t hash;		/**< \brief hash of the contents */
+	uint32_t path;		/**< \brief string offset of the path */
+} cc_src_t;
+
+/** \brief one record of the image */
+typedef struct _cc_rec_t {
+	uint16_t kind;		/**< \brief CC_* */
+	uint16_t type;		/**< \brief CFGT_* of the option */
+	uint32_t name;		/**< \brief string offset of the name */
+	uint64_t v;		/**< \brief value, see the kind */
+} cc_rec_t;
+
+/** \brief option names already in the string table of an image */
+typedef struct _cc_names_t {
+	const char **name;	/**< \brief the names */
+	uint32_t *off;		/**< \brief their string offsets */
+	int n;			/**< \brief number of names */
+} cc_names_t;
+
+/** \brief files included by the parse in progress */
+static char **cc_includes;
+static int cc_nrofincludes;
+
+/**
+   \brief Hash the names and types of an option table
+   \param opts option table
+   \param hash hash so far
+   \return new hash
+*/
+
+static uint32_t confcache_opthash(cfg_opt_t *opts, uint32_t hash)
+{
+	const char *p;
+	int i;
+
+	for (i = 0; opts[i].name != NULL; i++) {
+		for (p = opts[i].name; *p != '\0'; p++) {
+			hash ^= (uint8_t)*p;
+			hash *= 16777619U;
+		}
+		hash ^= (opts[i].type << 16) | (opts[i].flags & 0xFFFF);
+		hash *= 16777619U;
+		if (opts[i].type == CFGT_SEC && opts[i].subopts != NULL)
+			hash = confcache_opthash(opts[i].subopts, hash);
+	}
+	return hash;
+}
+
+/**
+   \brief Get the size, mtime and hash of a file
+   \param path file
+   \param src filled in
+   \return 0 on success, -1 if the file could not be read
+*/
+
+static int confcache_stat(const char *path, cc_src_t *src)
+{
+	struct stat sb;
+	char buf[8192];
+	uint32_t hash = 2166136261U;
+	ssize_t n, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++) {
+			hash ^= (uint8_t)buf[i];
+			hash *= 16777619U;
+		}
+	close(fd);
+	if (n == -1)
+		return -1;
+	src->mtime = sb.st_mtime;
+	src->size = sb.st_size;
+	src->hash = hash;
+	return 0;
+}
+
+/**
+   \brief Name of the cache for a config file
+   \param filename config file
+   \return allocated name, caller frees
+*/
+
+static char *confcache_name(const char *filename)
+{
+	char *name;
+
+	name = safer_malloc(strlen(filename) + 7);
+	sprintf(name, "%s.cache", filename);
+	return name;
+}
+
+/**
+   \brief Find an option of a section without complaining if it is missing
+   \param cfg section
+   \param name option name
+   \return option, or NULL
+*/
+
+static cfg_opt_t *confcache_getopt(cfg_t *cfg, const char *name)
+{
+	int i;
+
+	for (i = 0; cfg->opts[i].name != NULL; i++)
+		if (strcmp(cfg->opts[i].name, name) == 0)
+			return &cfg->opts[i];
+	return NULL;
+}
+
+/**
+   \brief Does a config ask for its cache to be kept?
+   \param cfg config
+   \return bool, false if the program has no confcache option
+*/
+
+int confcache_wanted(cfg_t *cfg)
+{
+	cfg_opt_t *opt;
+
+	opt = confcache_getopt(cfg, "confcache");
+	return (opt != NULL && opt->type == CFGT_INT &&
+		cfg_getint(cfg, "confcache") != 0);
+}
+
+/**
+   \brief include() for parse_conf, notes the file for the cache
+*/
+
+static int confcache_include(cfg_t *cfg, cfg_opt_t *opt, int argc,
+			     const char **argv)
+{
+	if (argc == 1) {
+		cc_includes = realloc(cc_includes,
+		    sizeof(char *) * (cc_nrofincludes + 1));
+		if (cc_includes == NULL)
+			bailout();
+		cc_includes[cc_nrofincludes++] = cfg_tilde_expand(argv[0]);
+	}
+	return cfg_include(cfg, opt, argc, argv);
+}
+
+/**
+   \brief Start noting the files a parse includes
+   \param cfg config about to be parsed
+*/
+
+void confcache_track(cfg_t *cfg)
+{
+	cfg_opt_t *opt;
+	int i;
+
+	for (i = 0; i < cc_nrofincludes; i++)
+		free(cc_includes[i]);
+	cc_nrofincludes = 0;
+
+	opt = confcache_getopt(cfg, "include");
+	if (opt != NULL && opt->type == CFGT_FUNC && opt->func == cfg_include)
+		opt->func = confcache_include;
+}
+
+/**
+   \brief Add a string to the string table
+   \param strs string table
+   \param s string, may be NULL
+   \return offset of the string
+*/
+
+static uint32_t confcache_addstr(struct evbuffer *strs, const char *s)
+{
+	uint32_t off;
+
+	if (s == NULL)
+		return CONFCACHE_NOSTR;
+	off = evbuffer_get_length(strs);
+	evbuffer_add(strs, s, strlen(s) + 1);
+	return off;
+}
+
+/**
+   \brief Add an option name to the string table, once
+   \param strs string table
+   \param names option names added so far
+   \param name option name
+   \return offset of the name
+   \note Every section repeats the same few names, keep just one copy.
+*/
+
+static uint32_t confcache_addname(struct evbuffer *strs, cc_names_t *names,
+				  const char *name)
+{
+	int i;
+
+	for (i = 0; i < names->n; i++)
+		if (strcmp(names->name[i], name) == 0)
+			return names->off[i];
+	names->name = realloc(names->name, sizeof(char *) * (names->n + 1));
+	names->off = realloc(names->off, sizeof(uint32_t) * (names->n + 1));
+	if (names->name == NULL || names->off == NULL)
+		bailout();
+	names->name[names->n] = name;
+	names->off[names->n] = confcache_addstr(strs, name);
+	return names->off[names->n++];
+}
+
+/**
+   \brief Add a record to the image
+*/
+
+static void confcache_addrec(struct evbuffer *recs, int kind, int type,
+			     uint32_t name, uint64_t v)
+{
+	cc_rec_t rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = kind;
+	rec.type = type;
+	rec.name = name;
+	rec.v = v;
+	evbuffer_add(recs, &rec, sizeof(rec));
+}
+
+/**
+   \brief Write the records for every option of a section
+   \param cfg section
+   \param recs records
+   \param strs string table
+   \param names option names already in the string table
+   \return 0 on success, -1 if the section holds something we can't cache
+*/
+
+static int confcache_dump_sec(cfg_t *cfg, struct evbuffer *recs,
+			      struct evbuffer *strs, cc_names_t *names)
+{
+	cfg_opt_t *opt;
+	cfg_t *sec;
+	uint32_t name;
+	uint64_t v;
+	double f;
+	int i, j, n;
+
+	for (i = 0; cfg->opts[i].name != NULL; i++) {
+		opt = &cfg->opts[i];
+		n = cfg_opt_size(opt);
+		switch (opt->type) {
+		case CFGT_NONE:
+		case CFGT_FUNC:
+			continue;
+		case CFGT_PTR:
+			if (n > 0)
+				return -1;
+			continue;
+		default:
+			break;
+		}
+		name = confcache_addname(strs, names, opt->name);
+		if (opt->type == CFGT_SEC) {
+			for (j = 0; j < n; j++) {
+				sec = cfg_opt_getnsec(opt, j);
+				confcache_addrec(recs, CC_SEC, CFGT_SEC, name,
+				    confcache_addstr(strs, cfg_title(sec)));
+				if (confcache_dump_sec(sec, recs, strs, names) == -1)
+					return -1;
+				confcache_addrec(recs, CC_END, 0, 0, 0);
+			}
+			continue;
+		}
+		confcache_addrec(recs, CC_OPT, opt->type, name, n);
+		for (j = 0; j < n; j++) {
+			switch (opt->type) {
+			case CFGT_INT:
+				v = (uint64_t)(int64_t)cfg_opt_getnint(opt, j);
+				break;
+			case CFGT_FLOAT:
+				f = cfg_opt_getnfloat(opt, j);
+				memcpy(&v, &f, sizeof(v));
+				break;
+			case CFGT_BOOL:
+				v = cfg_opt_getnbool(opt, j);
+				break;
+			case CFGT_STR:
+				v = confcache_addstr(strs,
+				    cfg_opt_getnstr(opt, j));
+				break;
+			default:
+				return -1;
+			}
+			confcache_addrec(recs, CC_VAL, opt->type, 0, v);
+		}
+	}
+	return 0;
+}
+
+/**
+   \brief Write the cache for a config file we just parsed
+   \param cfg the parsed config
+   \param filename the file it was parsed from
+   \note Any failure just leaves us without a cache.
+*/
+
+void confcache_save(cfg_t *cfg, const char *filename)
+{
+	struct evbuffer *out, *recs, *strs;
+	cc_names_t names = { NULL, NULL, 0 };
+	cc_header_t hdr;
+	cc_src_t *srcs;
+	char *name, *tmp;
+	int i, fd, err = 0;
+
+	recs = evbuffer_new();
+	strs = evbuffer_new();
+	out = evbuffer_new();
+	srcs = safer_malloc(sizeof(cc_src_t) * (cc_nrofincludes + 1));
+
+	if (confcache_stat(filename, &srcs[0]) == -1)
+		err++;
+	srcs[0].path = confcache_addstr(strs, filename);
+	for (i = 0; i < cc_nrofincludes && !err; i++) {
+		if (confcache_stat(cc_includes[i], &srcs[i+1]) == -1)
+			err++;
+		srcs[i+1].path = confcache_addstr(strs, cc_includes[i]);
+	}
+	if (!err && confcache_dump_sec(cfg, recs, strs, &names) == -1) {
+		LOG(LOG_DEBUG, "Config %s cannot be cached", filename);
+		err++;
+	}
+	if (err)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CONFCACHE_MAGIC;
+	hdr.version = CONFCACHE_VERSION;
+	hdr.opthash = confcache_opthash(options, 2166136261U);
+	hdr.nrofsrcs = cc_nrofincludes + 1;
+	hdr.nrofrecs = evbuffer_get_length(recs) / sizeof(cc_rec_t);
+	hdr.strsize = evbuffer_get_length(strs);
+	evbuffer_add(out, &hdr, sizeof(hdr));
+	evbuffer_add(out, srcs, sizeof(cc_src_t) * hdr.nrofsrcs);
+	evbuffer_add_buffer(out, recs);
+	evbuffer_add_buffer(out, strs);
+
+	/* same dance as dump_conf(), never leave half a cache behind */
+	name = confcache_name(filename);
+	tmp = safer_malloc(strlen(name) + 5);
+	sprintf(tmp, "%s.tmp", name);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		LOG(LOG_DEBUG, "Cannot write config cache %s: %s", tmp,
+		    strerror(errno));
+	} else {
+		while (evbuffer_get_length(out) > 0 && !err)
+			if (evbuffer_write(out, fd) == -1 && errno != EINTR)
+				err++;
+		if (!err && fsync(fd) == -1)
+			err++;
+		if (close(fd) == -1)
+			err++;
+		if (err || rename(tmp, name) == -1) {
+			LOG(LOG_WARNING, "Cannot write config cache %s: %s",
+			    name, strerror(errno));
+			unlink(tmp);
+		} else
+			LOG(LOG_DEBUG, "Wrote config cache %s", name);
+	}
+	free(tmp);
+	free(name);
+out:
+	free(names.name);
+	free(names.off);
+	free(srcs);
+	evbuffer_free(out);
+	evbuffer_free(recs);
+	evbuffer_free(strs);
+}
+
+/**
+   \brief Rebuild a config from the records of a cache image
+   \param cfg fresh config from cfg_init()
+   \param recs records
+   \param nrofrecs number of records
+   \param strs string table, NUL terminated
+   \param strsize size of the string table
+   \return 0 on success, -1 if the image does not fit the option table
+*/
+
+static int confcache_rebuild(cfg_t *cfg, cc_rec_t *recs, uint32_t nrofrecs,
+			     const char *strs, uint32_t strsize)
+{
+	cfg_t *stack[CONFCACHE_MAXDEPTH], *cur = cfg;
+	cfg_opt_t *opt = NULL;
+	cfg_value_t *val;
+	cfg_flag_t flags;
+	uint32_t i, idx = 0;
+	int depth = 0;
+	double f;
+
+#define CC_STR(off)	(((off) == CONFCACHE_NOSTR) ? NULL : strs + (off))
+
+	for (i = 0; i < nrofrecs; i++) {
+		if ((recs[i].kind == CC_SEC || recs[i].kind == CC_OPT) &&
+		    (recs[i].name >= strsize ||
+		     (opt = confcache_getopt(cur, strs + recs[i].name)) == NULL ||
+		     opt->type != recs[i].type))
+			return -1;
+		if ((recs[i].kind == CC_SEC ||
+		     (recs[i].kind == CC_VAL && recs[i].type == CFGT_STR)) &&
+		    recs[i].v != CONFCACHE_NOSTR && recs[i].v >= strsize)
+			return -1;
+
+		switch (recs[i].kind) {
+		case CC_SEC:
+			if (depth >= CONFCACHE_MAXDEPTH)
+				return -1;
+			/* titles in the image are already unique, so skip the
+			   duplicate search that makes cfg_setopt() quadratic */
+			flags = opt->flags;
+			opt->flags &= ~CFGF_TITLE;
+			val = cfg_setopt(cur, opt, CC_STR(recs[i].v));
+			opt->flags = flags;
+			if (val == NULL || val->section == NULL)
+				return -1;
+			stack[depth++] = cur;
+			cur = val->section;
+			opt = NULL;
+			break;
+		case CC_END:
+			if (depth == 0)
+				return -1;
+			cur = stack[--depth];
+			opt = NULL;
+			break;
+		case CC_OPT:
+			if (opt->simple_value.ptr == NULL)
+				cfg_free_value(opt);
+			opt->flags &= ~CFGF_RESET;
+			idx = 0;
+			break;
+		case CC_VAL:
+			if (opt == NULL || opt->type != recs[i].type)
+				return -1;
+			switch (recs[i].type) {
+			case CFGT_INT:
+				cfg_opt_setnint(opt, (int64_t)recs[i].v, idx);
+				break;
+			case CFGT_FLOAT:
+				memcpy(&f, &recs[i].v, sizeof(f));
+				cfg_opt_setnfloat(opt, f, idx);
+				break;
+			case CFGT_BOOL:
+				cfg_opt_setnbool(opt, recs[i].v ? cfg_true :
+				    cfg_false, idx);
+				break;
+			case CFGT_STR:
+				cfg_opt_setnstr(opt, CC_STR(recs[i].v), idx);
+				break;
+			default:
+				return -1;
+			}
+			idx++;
+			break;
+		default:
+			return -1;
+		}
+	}
+#undef CC_STR
+	return (depth == 0) ? 0 : -1;
+}
+
+/**
+   \brief Load a config from its cache, if the cache is still good
+   \param filename config file
+   \return the config, or NULL if it has to be parsed
+*/
+
+cfg_t *confcache_load(const char *filename)
+{
+	struct stat sb;
+	cc_header_t *hdr;
+	cc_src_t *srcs, cur;
+	cc_rec_t *recs;
+	const char *strs;
+	cfg_t *cfg = NULL;
+	char *name;
+	void *map;
+	size_t maplen, left;
+	uint32_t i;
+	int fd;
+
+	name = confcache_name(filename);
+	fd = open(name, O_RDONLY);
+	free(name);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(cc_header_t)) {
+		close(fd);
+		return NULL;
+	}
+	maplen = sb.st_size;
+	map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (cc_header_t *)map;
+	if (hdr->magic != CONFCACHE_MAGIC ||
+	    hdr->version != CONFCACHE_VERSION ||
+	    hdr->opthash != confcache_opthash(options, 2166136261U))
+		goto out;
+	/* the counts come off the disk, check them piece by piece, so no
+	   product or sum can wrap */
+	left = maplen - sizeof(cc_header_t);
+	if (hdr->nrofsrcs == 0 || hdr->nrofsrcs > left / sizeof(cc_src_t))
+		goto out;
+	left -= sizeof(cc_src_t) * (size_t)hdr->nrofsrcs;
+	if (hdr->nrofrecs > left / sizeof(cc_rec_t))
+		goto out;
+	left -= sizeof(cc_rec_t) * (size_t)hdr->nrofrecs;
+	if (hdr->strsize == 0 || hdr->strsize != left)
+		goto out;
+	srcs = (cc_src_t *)(hdr + 1);
+	recs = (cc_rec_t *)(srcs + hdr->nrofsrcs);
+	strs = (const char *)(recs + hdr->nrofrecs);
+	if (strs[hdr->strsize - 1] != '\0')
+		goto out;
+
+	/* is it still what is on disk? */
+	if (srcs[0].path >= hdr->strsize ||
+	    strcmp(strs + srcs[0].path, filename) != 0)
+		goto out;
+	for (i = 0; i < hdr->nrofsrcs; i++) {
+		if (srcs[i].path >= hdr->strsize ||
+		    stat(strs + srcs[i].path, &sb) == -1 ||
+		    sb.st_mtime != srcs[i].mtime || sb.st_size != srcs[i].size)
+			goto out;
+		if (confcache_stat(strs + srcs[i].path, &cur) == -1 ||
+		    cur.hash != srcs[i].hash)
+			goto out;
+	}
+
+	cfg = cfg_init(options, CFGF_NONE);
+	if (confcache_rebuild(cfg, recs, hdr->nrofrecs, strs,
+			      hdr->strsize) == -1) {
+		LOG(LOG_WARNING, "Config cache for %s is damaged, ignoring it",
+		    filename);
+		cfg_free(cfg);
+		cfg = NULL;
+	}
+out:
+	munmap(map, maplen);
+	return cfg;
+}
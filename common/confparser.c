@@ -62,6 +62,11 @@ static int conf_parse_proto(cfg_t *cfg, cfg_opt_t *opt, const char *value,
 			      void *result);
 static void print_group(device_group_t *devgrp, int devs, int indent);
 
+/** \brief device option holding the scale, by SCALEFAM_ */
+static const char *scalefam_opt[] = {
+	NULL, "tscale", "baroscale", "speedscale", "lengthscale", "lightscale",
+};
+
 cfg_opt_t device_opts[] = {
 	CFG_STR("name", 0, CFGF_NODEFAULT),
 	CFG_STR("loc", 0, CFGF_NODEFAULT),
@@ -718,26 +723,142 @@ void conf_print_salinescale(cfg_opt_t *opt, unsigned int index, FILE *fp)
       General routines
 *****/
 
+/** \brief a slot of a config section index */
+typedef struct _confslot_t {
+	uint32_t hash;		/**< \brief hash_uid() of the section title */
+	unsigned int pos;	/**< \brief section number + 1, 0 if empty */
+} confslot_t;
+
 /**
-	\brief Find the cfg entry for a device by it's UID
-	\param cfg config base
-	\param uid uid char *
-	\return the section we found it in
+   \brief Index of the titled sections of one kind, by title
+   \note Sections are remembered by number rather than by pointer, and the
+   title is compared on every hit, so an index that has gone stale can
+   miss, but never hand back a section that is not there.
 */
+typedef struct _confindex_t {
+	const char *name;	/**< \brief section name, "device" etc */
+	cfg_t *cfg;		/**< \brief config the index was built for */
+	confslot_t *slots;	/**< \brief open addressed table */
+	unsigned int size;	/**< \brief number of slots, power of 2 */
+	unsigned int count;	/**< \brief number of sections indexed */
+} confindex_t;
 
-cfg_t *find_devconf_byuid(cfg_t *cfg, char *uid)
+static confindex_t devconf_index = { "device" };
+static confindex_t devgrpconf_index = { "devgroup" };
+
+/**
+   \brief Add a section to an index
+   \param idx index
+   \param title title of the section
+   \param pos section number
+*/
+
+static void confindex_add(confindex_t *idx, const char *title,
+			  unsigned int pos)
+{
+	uint32_t hash = hash_uid(title);
+	unsigned int i;
+
+	for (i = hash & (idx->size - 1); idx->slots[i].pos != 0;
+	     i = (i + 1) & (idx->size - 1))
+		;
+	idx->slots[i].hash = hash;
+	idx->slots[i].pos = pos + 1;
+	idx->count++;
+}
+
+/**
+   \brief Bring an index up to date with the sections in a config
+   \param idx index
+   \param cfg config base
+   \note libconfuse only ever appends a new section, so when the config is
+   the one we indexed and has only grown, the new sections are added to
+   the index.  Anything else rebuilds it.
+*/
+
+static void confindex_sync(confindex_t *idx, cfg_t *cfg)
+{
+	unsigned int n, i;
+
+	n = cfg_size(cfg, idx->name);
+	if (idx->cfg != cfg || idx->count > n) {
+		idx->cfg = cfg;
+		idx->count = 0;
+		if (idx->slots != NULL)
+			memset(idx->slots, 0, sizeof(confslot_t) * idx->size);
+	}
+	if (idx->count == n)
+		return;
+
+	/* keep it at most half full */
+	if (n * 2 > idx->size) {
+		if (idx->slots != NULL)
+			free(idx->slots);
+		for (idx->size = 64; idx->size < n * 2; idx->size *= 2)
+			;
+		idx->slots = calloc(idx->size, sizeof(confslot_t));
+		if (idx->slots == NULL)
+			bailout();
+		idx->count = 0;
+	}
+	for (i = idx->count; i < n; i++)
+		confindex_add(idx, cfg_title(cfg_getnsec(cfg, idx->name, i)), i);
+}
+
+/**
+   \brief Forget everything an index knows
+   \param idx index
+*/
+
+static void confindex_reset(confindex_t *idx)
+{
+	idx->cfg = NULL;
+	idx->count = 0;
+}
+
+/**
+   \brief Look up a titled section through an index
+   \param idx index
+   \param cfg config base
+   \param uid title to look for
+   \return the section, or NULL
+*/
+
+static cfg_t *confindex_find(confindex_t *idx, cfg_t *cfg, char *uid)
 {
-	int i;
 	cfg_t *section;
+	uint32_t hash;
+	unsigned int i;
 
-	for (i=0; i < cfg_size(cfg, "device"); i++) {
-		section = cfg_getnsec(cfg, "device", i);
-		if (strcmp(uid, cfg_title(section)) == 0)
+	if (cfg == NULL || uid == NULL)
+		return NULL;
+	confindex_sync(idx, cfg);
+	if (idx->count == 0)
+		return NULL;
+	hash = hash_uid(uid);
+	for (i = hash & (idx->size - 1); idx->slots[i].pos != 0;
+	     i = (i + 1) & (idx->size - 1)) {
+		if (idx->slots[i].hash != hash)
+			continue;
+		section = cfg_getnsec(cfg, idx->name, idx->slots[i].pos - 1);
+		if (section != NULL && strcmp(uid, cfg_title(section)) == 0)
 			return section;
 	}
 	return NULL;
 }
 
+/**
+	\brief Find the cfg entry for a device by it's UID
+	\param cfg config base
+	\param uid uid char *
+	\return the section we found it in
+*/
+
+cfg_t *find_devconf_byuid(cfg_t *cfg, char *uid)
+{
+	return confindex_find(&devconf_index, cfg, uid);
+}
+
 /**
 	\brief Find the cfg entry for a device group by it's UID
 	\param cfg config base
@@ -747,15 +868,7 @@ cfg_t *find_devconf_byuid(cfg_t *cfg, char *uid)
 
 cfg_t *find_devgrpconf_byuid(cfg_t *cfg, char *uid)
 {
-	int i;
-	cfg_t *section;
-
-	for (i=0; i < cfg_size(cfg, "devgroup"); i++) {
-		section = cfg_getnsec(cfg, "devgroup", i);
-		if (strcmp(uid, cfg_title(section)) == 0)
-			return section;
-	}
-	return NULL;
+	return confindex_find(&devgrpconf_index, cfg, uid);
 }
 
 /**
@@ -816,23 +929,10 @@ device_t *new_dev_from_conf(cfg_t *cfg, char *uid)
 	dev->proto = cfg_getint(devconf, "proto");
 	dev->type = cfg_getint(devconf, "type");
 	dev->subtype = cfg_getint(devconf, "subtype");
-	switch (dev->subtype) {
-	case SUBTYPE_TEMP:
-		dev->scale = cfg_getint(devconf, "tscale");
-		break;
-	case SUBTYPE_SPEED:
-		dev->scale = cfg_getint(devconf, "speedscale");
-		break;
-	case SUBTYPE_PRESSURE:
-		dev->scale = cfg_getint(devconf, "baroscale");
-		break;
-	case SUBTYPE_RAINRATE:
-		dev->scale = cfg_getint(devconf, "lengthscale");
-		break;
-	case SUBTYPE_LUX:
-		dev->scale = cfg_getint(devconf, "lightscale");
-		break;
-	}
+	if (dev->subtype < NROF_SUBTYPES &&
+	    scalefam_opt[subtype_info[dev->subtype].scalefam] != NULL)
+		dev->scale = cfg_getint(devconf,
+		    scalefam_opt[subtype_info[dev->subtype].scalefam]);
 	if (cfg_getstr(devconf, "multimodel") != NULL &&
 	    (dev->subtype == SUBTYPE_HUMID ||
 	     dev->subtype == SUBTYPE_LUX ||
@@ -954,25 +1054,10 @@ cfg_t *new_conf_from_dev(cfg_t *cfg, device_t *dev)
 			cfg_setnstr(devconf, "tags", dev->tags[i], i);
 	if (dev->subtype)
 		cfg_setint(devconf, "subtype", dev->subtype);
-	if (dev->subtype && dev->scale) {
-		switch (dev->subtype) {
-		case SUBTYPE_TEMP:
-			cfg_setint(devconf, "tscale", dev->scale);
-			break;
-		case SUBTYPE_SPEED:
-			cfg_setint(devconf, "speedscale", dev->scale);
-			break;
-		case SUBTYPE_PRESSURE:
-			cfg_setint(devconf, "baroscale", dev->scale);
-			break;
-		case SUBTYPE_RAINRATE:
-			cfg_setint(devconf, "lengthscale", dev->scale);
-			break;
-		case SUBTYPE_LUX:
-			cfg_setint(devconf, "lightscale", dev->scale);
-			break;
-		}
-	}
+	if (dev->subtype && dev->scale && dev->subtype < NROF_SUBTYPES &&
+	    scalefam_opt[subtype_info[dev->subtype].scalefam] != NULL)
+		cfg_setint(devconf,
+		    scalefam_opt[subtype_info[dev->subtype].scalefam], dev->scale);
 	/* handle spamhandler */
 	if (QUERY_FLAG(dev->flags, DEVFLAG_CHANGEHANDLER))
 	    cfg_setint(devconf, "spamhandler", 2);
@@ -1009,11 +1094,37 @@ cfg_t *new_conf_from_dev(cfg_t *cfg, device_t *dev)
 	return devconf;
 }
 
+/**
+   \brief Regenerate the config entries of devices marked DEVFLAG_DIRTY
+   \param cfg cfg_t base
+   \return number of devices that were dirty
+   \note Collector devices are never written out, so they get no entry.
+*/
+
+int conf_update_dirty(cfg_t *cfg)
+{
+	device_t *dev;
+	int n = 0;
+
+	TAILQ_FOREACH(dev, &alldevs, next_all) {
+		if (!QUERY_FLAG(dev->flags, DEVFLAG_DIRTY))
+			continue;
+		CLEAR_FLAG(dev->flags, DEVFLAG_DIRTY);
+		if (dev->subtype != SUBTYPE_COLLECTOR)
+			(void)new_conf_from_dev(cfg, dev);
+		n++;
+	}
+	return n;
+}
+
 /**
    \brief Dump the current config file out
    \param cfg the config pointer
    \param flags print flags CONF_DUMP_XXX
    \param filename filename to dump to
+   \return cfg, or NULL if the file could not be written
+   \note The file is written under a temporary name and renamed into
+   place, so a crash or full disk never leaves a half written config.
 */
 
 cfg_t *dump_conf(cfg_t *cfg, int flags, const char *filename)
@@ -1021,9 +1132,9 @@ cfg_t *dump_conf(cfg_t *cfg, int flags, const char *filename)
 	FILE *fp;
 	cfg_opt_t *a;
 	cfg_t *section;
-	int i;
+	char *tmp;
+	int i, err;
 	time_t t;
-	device_t *dev;
 
 	if (QUERY_FLAG(flags, CONF_DUMP_DEVONLY))
 		LOG(LOG_NOTICE, "Rewriting device configuration file");
@@ -1033,17 +1144,17 @@ cfg_t *dump_conf(cfg_t *cfg, int flags, const char *filename)
 		LOG(LOG_NOTICE, "Rewriting configuration file");
 
 	t = time(NULL);
-	fp = fopen(filename, "w");
+	tmp = safer_malloc(strlen(filename) + 5);
+	sprintf(tmp, "%s.tmp", filename);
+	fp = fopen(tmp, "w");
 	if (fp == NULL) {
-		LOG(LOG_ERROR, "Could not open %s for writing", filename);
+		LOG(LOG_ERROR, "Could not open %s for writing", tmp);
+		free(tmp);
 		return(NULL);
 	}
 	/* Make sure all changes make it in */
-	TAILQ_FOREACH(dev, &alldevs, next_all) {
-		if (QUERY_FLAG(flags, CONF_DUMP_NOCOLLECTOR) &&
-		    dev->subtype != SUBTYPE_COLLECTOR)
-			(void)new_conf_from_dev(cfg, dev);
-	}
+	if (QUERY_FLAG(flags, CONF_DUMP_NOCOLLECTOR))
+		(void)conf_update_dirty(cfg);
 
 	fprintf(fp, "# Config file for %s\n", getprogname());
 	fprintf(fp, "# Generated on %s", ctime(&t));
@@ -1089,7 +1200,22 @@ cfg_t *dump_conf(cfg_t *cfg, int flags, const char *filename)
 	if (!QUERY_FLAG(flags, CONF_DUMP_DEVONLY) &&
 	    !QUERY_FLAG(flags, CONF_DUMP_GROUPONLY))
 		cfg_print(cfg, fp);
-	fclose(fp);
+	err = (fflush(fp) != 0 || fsync(fileno(fp)) != 0);
+	if (fclose(fp) != 0 || err) {
+		LOG(LOG_ERROR, "Could not write %s: %s", tmp, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return(NULL);
+	}
+	if (rename(tmp, filename) != 0) {
+		LOG(LOG_ERROR, "Could not rename %s to %s: %s", tmp, filename,
+		    strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return(NULL);
+	}
+	free(tmp);
+	return(cfg);
 }
 
 /**
@@ -1103,7 +1229,18 @@ cfg_t *parse_conf(const char *filename)
 {
 	cfg_t *cfg;
 
+	/* a new config may well land where the old one was freed */
+	confindex_reset(&devconf_index);
+	confindex_reset(&devgrpconf_index);
+
+	/* there is only a cache if this config asked for one */
+	if ((cfg = confcache_load(filename)) != NULL) {
+		LOG(LOG_DEBUG, "Read config file %s from cache", filename);
+		return cfg;
+	}
+
 	cfg = cfg_init(options, CFGF_NONE);
+	confcache_track(cfg);
 
 	cfg_set_validate_func(cfg, "device|rrdname", conf_validate_rrdname);
 
@@ -1114,6 +1251,8 @@ cfg_t *parse_conf(const char *filename)
 		return cfg;
 	case CFG_SUCCESS:
 		LOG(LOG_DEBUG, "Read config file %s", filename);
+		if (confcache_wanted(cfg))
+			confcache_save(cfg, filename);
 		break;
 	case CFG_PARSE_ERROR:
 		return NULL;
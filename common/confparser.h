@@ -9,6 +9,7 @@ cfg_t *parse_conf(const char *filename);
 cfg_t *find_devconf_byuid(cfg_t *cfg, char *uid);
 cfg_t *new_conf_from_devgrp(cfg_t *cfg, device_group_t *devgrp);
 cfg_t *new_conf_from_dev(cfg_t *cfg, device_t *dev);
+int conf_update_dirty(cfg_t *cfg);
 device_t *new_dev_from_conf(cfg_t *cfg, char *uid);
 cfg_t *dump_conf(cfg_t *cfg, int flags, const char *filename);
 int conf_validate_port(cfg_t *cfg, cfg_opt_t *opt);
@@ -48,4 +49,10 @@ void conf_print_salinescale(cfg_opt_t *opt, unsigned int index, FILE *fp);
 void parse_devgroups(cfg_t *cfg);
 void print_group_table(int devs);
 
+/* confcache.c */
+cfg_t *confcache_load(const char *filename);
+int confcache_wanted(cfg_t *cfg);
+void confcache_save(cfg_t *cfg, const char *filename);
+void confcache_track(cfg_t *cfg);
+
 #endif /*_CONFPARSER_H_*/
@@ -50,19 +50,30 @@
 
 int notimerupdate = 0;
 int nrofdevs;
-static rb_tree_t devices;
+/** \brief if set, called after every store to a device's current data */
+void (*dev_data_stored)(device_t *dev) = NULL;
+/** \brief if set, called when a timer device counts down to zero */
+void (*timerdev_expired)(device_t *dev) = NULL;
+/** \brief timer devices counting down, all the tick has to look at */
+static device_t **timerdevs;
+static int nroftimerdevs;
+static int timerdevs_size;
+/** \brief the one second tick, only pending while timerdevs is not empty */
+static struct event *timerdev_ev;
 static rb_tree_t devgroups;
 TAILQ_HEAD(, _device_t) alldevs = TAILQ_HEAD_INITIALIZER(alldevs);
 TAILQ_HEAD(, _device_group_t) allgroups = TAILQ_HEAD_INITIALIZER(allgroups);
 
-static int compare_device_byuid(void *ctx, const void *a, const void *b);
-static int compare_device_uidtokey(void *ctx, const void *a, const void *key);
-static const rb_tree_ops_t device__alltree_ops = {
-	.rbto_compare_nodes = compare_device_byuid,
-	.rbto_compare_key = compare_device_uidtokey,
-	.rbto_node_offset = offsetof(struct _device_t, rbn),
-	.rbto_context = NULL
-};
+/** \brief open addressed uid hash, devhash_size is a power of two */
+static device_t **devhash;
+/** \brief number of slots in devhash */
+static uint32_t devhash_size;
+/** \brief handle to device map, handle 0 is never handed out */
+static device_t **devhandles;
+/** \brief number of handles handed out */
+static uint32_t nrofhandles;
+/** \brief allocated size of devhandles */
+static uint32_t devhandles_size;
 
 static int compare_devgroup_byuid(void *ctx, const void *a, const void *b);
 static int compare_devgroup_uidtokey(void *ctx, const void *a,
@@ -141,60 +152,77 @@ name_map_t devproto_map[] = {
 	{PROTO_BLIND, "blind"},
 };
 
+#define SUBTYPE_MAP(id, name, store, arg, scale)	{SUBTYPE_##id, name},
 name_map_t devsubtype_map[] = {
-	{SUBTYPE_NONE, "NONE"},
-	{SUBTYPE_SWITCH, "switch"},
-	{SUBTYPE_OUTLET, "outlet"},
-	{SUBTYPE_TEMP, "temp"},
-	{SUBTYPE_HUMID, "humid"},
-	{SUBTYPE_COUNTER, "counter"},
-	{SUBTYPE_PRESSURE, "pressure"},
-	{SUBTYPE_SPEED, "windspeed"},
-	{SUBTYPE_DIR, "winddir"},
-	{SUBTYPE_PH, "ph"},
-	{SUBTYPE_WETNESS, "wetness"},
-	{SUBTYPE_HUB, "hub"},
-	{SUBTYPE_LUX, "lux"},
-	{SUBTYPE_VOLTAGE, "voltage"},
-	{SUBTYPE_WATTSEC, "wattsec"},
-	{SUBTYPE_WATT, "watt"},
-	{SUBTYPE_AMPS, "amps"},
-	{SUBTYPE_RAINRATE, "rainrate"},
-	{SUBTYPE_WEATHER, "weather"},
-	{SUBTYPE_ALARMSTATUS, "alarmstatus"},
-	{SUBTYPE_NUMBER, "number"},
-	{SUBTYPE_PERCENTAGE, "percentage"},
-	{SUBTYPE_FLOWRATE, "flowrate"},
-	{SUBTYPE_DISTANCE, "distance"},
-	{SUBTYPE_VOLUME, "volume"},
-	{SUBTYPE_TIMER, "timer"},
-	{SUBTYPE_THMODE, "thmode"},
-	{SUBTYPE_THSTATE, "thstate"},
-	{SUBTYPE_SMNUMBER, "smnumber"},
-	{SUBTYPE_BLIND, "blind"},
-	{SUBTYPE_COLLECTOR, "collector"},
-	{SUBTYPE_TRIGGER, "trigger"},
-	{SUBTYPE_ORP, "orp"},
-	{SUBTYPE_SALINITY, "salinity"},
-	{SUBTYPE_DAYLIGHT, "daylight"},
-	{SUBTYPE_MOONPH, "moonph"},
-	{SUBTYPE_TRISTATE, "tristate"},
-	{SUBTYPE_BOOL, "bool"},
+	SUBTYPE_TABLE(SUBTYPE_MAP)
+};
+#undef SUBTYPE_MAP
+
+#define STORE_DATATYPE_NONE	DATATYPE_DOUBLE
+#define STORE_DATATYPE_STATE	DATATYPE_UINT
+#define STORE_DATATYPE_UINT	DATATYPE_UINT
+#define STORE_DATATYPE_LL	DATATYPE_LL
+#define STORE_DATATYPE_DOUBLE	DATATYPE_DOUBLE
+#define SUBTYPE_INFO(id, name, store, arg, scale) \
+	{name, DATASTORE_##store, STORE_DATATYPE_##store, SCALEFAM_##scale, arg},
+/** \brief What each subtype is, indexed by SUBTYPE_* */
+const subtype_info_t subtype_info[NROF_SUBTYPES] = {
+	SUBTYPE_TABLE(SUBTYPE_INFO)
 };
+#undef SUBTYPE_INFO
 
 
-/** \brief Compare two devices by uid */
+/**
+   \brief Hash a uid string (FNV-1a)
+   \param uid uid to hash
+   \return hash value
+*/
 
-static int compare_device_byuid(void *ctx, const void *a, const void *b) 
+uint32_t hash_uid(const char *uid)
 {
-	return strcmp(((device_t *)a)->uid, ((device_t *)b)->uid);
+	uint32_t hash = 2166136261U;
+
+	while (*uid != '\0') {
+		hash ^= (uint8_t)*uid++;
+		hash *= 16777619U;
+	}
+	return hash;
 }
 
-/** \brief Compare device uid to string */
+/**
+   \brief Drop a device into the first free slot of a uid hash
+   \param table hash table to place it in
+   \param size number of slots in table
+   \param dev device, with uidhash filled in
+*/
 
-static int compare_device_uidtokey(void *ctx, const void *a, const void *key)
+static void devhash_place(device_t **table, uint32_t size, device_t *dev)
 {
-	return strcmp(((device_t *)a)->uid, key);
+	uint32_t i;
+
+	for (i = dev->uidhash & (size - 1); table[i] != NULL;
+	     i = (i + 1) & (size - 1))
+		;
+	table[i] = dev;
+}
+
+/**
+   \brief Double the size of the uid hash and rehash everything in it
+*/
+
+static void devhash_grow(void)
+{
+	device_t **old = devhash;
+	uint32_t i, oldsize = devhash_size;
+
+	devhash_size = (oldsize) ? oldsize * 2 : 256;
+	devhash = calloc(devhash_size, sizeof(device_t *));
+	if (devhash == NULL)
+		bailout();
+	for (i=0; i < oldsize; i++)
+		if (old[i] != NULL)
+			devhash_place(devhash, devhash_size, old[i]);
+	free(old);
 }
 
 /** \brief Compare two device groups by uid */
@@ -219,7 +247,30 @@ static int compare_devgroup_uidtokey(void *ctx, const void *a, const void *key)
 
 device_t *find_device_byuid(char *uid)
 {
-	return rb_tree_find_node(&devices, uid);
+	device_t *dev;
+	uint32_t hash, i;
+
+	if (devhash == NULL || uid == NULL)
+		return NULL;
+	hash = hash_uid(uid);
+	for (i = hash & (devhash_size - 1); (dev = devhash[i]) != NULL;
+	     i = (i + 1) & (devhash_size - 1))
+		if (dev->uidhash == hash && strcmp(dev->uid, uid) == 0)
+			return dev;
+	return NULL;
+}
+
+/**
+   \brief Look up a device by the handle insert_device() gave it
+   \param handle handle to look for
+   \return device_t * if found, NULL if not
+*/
+
+device_t *find_device_byhandle(uint32_t handle)
+{
+	if (handle == 0 || handle > nrofhandles)
+		return NULL;
+	return devhandles[handle];
 }
 
 /**
@@ -239,8 +290,10 @@ device_group_t *find_devgroup_byuid(char *uid)
    \param client client_t to add to
    \param rate rate of feed, if used
    \param scale (temp) scale, if used
+   \return the new wrap_device_t
 */
-void add_wrapped_device(device_t *dev, client_t *client, int rate, int scale)
+wrap_device_t *add_wrapped_device(device_t *dev, client_t *client, int rate,
+				  int scale)
 {
 	wrap_device_t *wrap = smalloc(wrap_device_t);
 
@@ -253,36 +306,82 @@ void add_wrapped_device(device_t *dev, client_t *client, int rate, int scale)
 		TAILQ_INSERT_TAIL(&client->wdevices, wrap, next);
 		wrap->onq |= DEVONQ_CLIENT;
 	}
+	return wrap;
 }
 
 /**
    \brief Add a wrapped client to this device
    \param client client_t to add
    \param dev device_t to add to
+   \return the new watcher entry
 */
-void add_wrapped_client(client_t *client, device_t *dev)
+wrap_client_t *add_wrapped_client(client_t *client, device_t *dev)
 {
 	wrap_client_t *wrap = smalloc(wrap_client_t);
 
 	LOG(LOG_DEBUG, "adding client %s as watcher of dev %s",
 	    (client->name) ? client->name : "generic", dev->uid);
 	wrap->client = client;
+	wrap->dev = dev;
 	if (TAILQ_EMPTY(&dev->watchers))
 		TAILQ_INIT(&dev->watchers);
 	TAILQ_INSERT_TAIL(&dev->watchers, wrap, next);
+	if (TAILQ_EMPTY(&client->watching))
+		TAILQ_INIT(&client->watching);
+	TAILQ_INSERT_TAIL(&client->watching, wrap, next_client);
 	client->watched++;
+	return wrap;
 }
 
 /**
-   \brief Insert a device into the TAILQ
-   \note keeps the table sorted
-   \return pointer to new device
+   \brief Remove a client from every device it is watching
+   \param client client_t to unwatch
+*/
+void remove_wrapped_client(client_t *client)
+{
+	wrap_client_t *wrap;
+
+	if (TAILQ_EMPTY(&client->watching))
+		return;
+	while ((wrap = TAILQ_FIRST(&client->watching)) != NULL) {
+		TAILQ_REMOVE(&client->watching, wrap, next_client);
+		TAILQ_REMOVE(&wrap->dev->watchers, wrap, next);
+		if (wrap->pending)
+			TAILQ_REMOVE(&client->pending, wrap, next_pending);
+		LOG(LOG_DEBUG, "Unwatching device %s", wrap->dev->uid);
+		free(wrap);
+		client->watched--;
+	}
+}
+
+/**
+   \brief Insert a device into the device table
+   \param dev device to insert
+   \note The device is hashed by uid, and handed a small integer handle
+   that find_device_byhandle() can use to find it again.  A uid that is
+   already in the table keeps its existing device.
 */
 
 void insert_device(device_t *dev)
 {
-	/* put it in the rb tree */
-	rb_tree_insert_node(&devices, dev);
+	/* put it in the uid hash, keep it at most half full */
+	if (find_device_byuid(dev->uid) == NULL) {
+		if ((nrofhandles + 1) * 2 > devhash_size)
+			devhash_grow();
+		dev->uidhash = hash_uid(dev->uid);
+		devhash_place(devhash, devhash_size, dev);
+
+		if (nrofhandles + 1 >= devhandles_size) {
+			devhandles_size = (devhandles_size) ?
+			    devhandles_size * 2 : 256;
+			devhandles = realloc(devhandles,
+			    sizeof(device_t *) * devhandles_size);
+			if (devhandles == NULL)
+				bailout();
+		}
+		dev->handle = ++nrofhandles;
+		devhandles[dev->handle] = dev;
+	}
 
 	/* incr nrofdevs */
 	nrofdevs++;
@@ -437,7 +536,6 @@ void init_devtable(cfg_t *cfg, int readconf)
 	int i;
 
 	nrofdevs = 0;
-	rb_tree_init(&devices, &device__alltree_ops);
 	rb_tree_init(&devgroups, &devgroup__alltree_ops);
 
 	if (readconf == 0)
@@ -479,101 +577,56 @@ void get_data_dev(device_t *dev, int where, void *data)
 	case DATALOC_CHANGE:
 		store = &dev->change;
 	}
+	get_data_store(dev, store, data);
+}
 
-	switch (dev->type) {
-	case DEVICE_SWITCH:
+/**
+   \brief get data out of a data_t, as a device of this type holds it
+   \param dev what device
+   \param store data_t to read, one of dev's, or a copy of one
+   \param pointer to data to be stored
+*/
+
+void get_data_store(device_t *dev, data_t *store, void *data)
+{
+	switch (datastore_dev(dev)) {
+	case DATASTORE_STATE:
 		*((uint8_t *)data) = store->state;
 		break;
-	case DEVICE_DIMMER:
-		*((double *)data) = store->level;
+	case DATASTORE_UINT:
+		*((uint32_t *)data) = store->ui;
 		break;
-	case DEVICE_SENSOR:
-	case DEVICE_TIMER:
-	{
-		switch (dev->subtype) {
-		/* placing the new generics here at the top for
-		   eventual conversion */
-		case SUBTYPE_TRIGGER:
-			*((uint32_t *)data) = store->ui;
-			break;
-		case SUBTYPE_ORP:
-		case SUBTYPE_SALINITY:
-		case SUBTYPE_MOONPH:
-			*((double *)data) = store->d;
-			break;
-		/* old style follows */
-		case SUBTYPE_TEMP:
-			*((double *)data) = store->temp;
-			break;
-		case SUBTYPE_HUMID:
-		case SUBTYPE_PERCENTAGE:
-			*((double *)data) = store->humid;
-			break;
-		case SUBTYPE_TIMER:
-		case SUBTYPE_COUNTER:
-			*((uint32_t *)data) = store->count;
-			break;
-		case SUBTYPE_PRESSURE:
-			*((double *)data) = store->pressure;
-			break;
-		case SUBTYPE_SPEED:
-			*((double *)data) = store->speed;
-			break;
-		case SUBTYPE_DIR:
-			*((double *)data) = store->dir;
-			break;
-		case SUBTYPE_PH:
-			*((double *)data) = store->ph;
-			break;
-		case SUBTYPE_WETNESS:
-			*((double *)data) = store->wetness;
-			break;
-		case SUBTYPE_LUX:
-			*((double *)data) = store->lux;
-			break;
-		case SUBTYPE_WATTSEC:
-			*((int64_t *)data) = store->wattsec;
-			break;
-		case SUBTYPE_VOLTAGE:
-			*((double *)data) = store->volts;
-			break;
-		case SUBTYPE_WATT:
-			*((double *)data) = store->watts;
-			break;
-		case SUBTYPE_AMPS:
-			*((double *)data) = store->amps;
-			break;
-		case SUBTYPE_RAINRATE:
-			*((double *)data) = store->rainrate;
-			break;
-		case SUBTYPE_SWITCH:
-		case SUBTYPE_WEATHER:
-		case SUBTYPE_ALARMSTATUS:
-		case SUBTYPE_THMODE:
-		case SUBTYPE_THSTATE:
-		case SUBTYPE_SMNUMBER:
-		case SUBTYPE_COLLECTOR:
-		case SUBTYPE_BLIND:
-		case SUBTYPE_DAYLIGHT:
-		case SUBTYPE_TRISTATE:
-			*((uint8_t *)data) = store->state;
-			break;
-		case SUBTYPE_NUMBER:
-			*((int64_t *)data) = store->number;
-			break;
-		case SUBTYPE_FLOWRATE:
-			*((double *)data) = store->flow;
-			break;
-		case SUBTYPE_DISTANCE:
-			*((double *)data) = store->distance;
-			break;
-		case SUBTYPE_VOLUME:
-			*((double *)data) = store->volume;
-			break;
-		}
+	case DATASTORE_LL:
+		*((int64_t *)data) = store->ll;
+		break;
+	case DATASTORE_DOUBLE:
+		*((double *)data) = store->d;
 		break;
 	}
+}
+
+/**
+   \brief Put a timer device on the countdown list
+   \param dev timer device
+*/
+
+static void timerdev_start(device_t *dev)
+{
+	struct timeval secs = { 1, 0 };
+
+	if (QUERY_FLAG(dev->flags, DEVFLAG_COUNTING))
+		return;
+	if (nroftimerdevs == timerdevs_size) {
+		timerdevs_size = (timerdevs_size) ? timerdevs_size * 2 : 16;
+		timerdevs = realloc(timerdevs,
+				    sizeof(device_t *) * timerdevs_size);
+		if (timerdevs == NULL)
+			bailout();
 	}
+	timerdevs[nroftimerdevs++] = dev;
+	SET_FLAG(dev->flags, DEVFLAG_COUNTING);
+	if (nroftimerdevs == 1 && timerdev_ev != NULL)
+		event_add(timerdev_ev, &secs);
 }
 
 /**
@@ -581,6 +634,8 @@ void get_data_dev(device_t *dev, int where, void *data)
    \param dev what device
    \param where where to store, see DATALOC_*
    \param pointer to data
+   \note gnhastd hooks DATALOC_DATA stores through dev_data_stored to
+   journal them.
 */
 
 void store_data_dev(device_t *dev, int where, void *data)
@@ -607,100 +662,26 @@ void store_data_dev(device_t *dev, int where, void *data)
 		store = &dev->change;
 	}
 
-	switch (dev->type) {
-	case DEVICE_SWITCH:
+	switch (datastore_dev(dev)) {
+	case DATASTORE_STATE:
 		store->state = *((uint8_t *)data);
 		break;
-	case DEVICE_DIMMER:
-		store->level = *((double *)data);
+	case DATASTORE_UINT:
+		store->ui = *((uint32_t *)data);
 		break;
-	case DEVICE_SENSOR:
-	case DEVICE_TIMER:
-	case DEVICE_BLIND:
-	{
-		switch (dev->subtype) {
-		/* new style at the top for eventual conversion */
-		case SUBTYPE_TRIGGER:
-			store->ui = *((uint32_t *)data);
-			break;
-		case SUBTYPE_ORP:
-		case SUBTYPE_SALINITY:
-		case SUBTYPE_MOONPH:
-			store->d = *((double *)data);
-			break;
-		/* old style */
-		case SUBTYPE_TEMP:
-			store->temp = *((double *)data);
-			break;
-		case SUBTYPE_HUMID:
-		case SUBTYPE_PERCENTAGE:
-			store->humid = *((double *)data);
-			break;
-		case SUBTYPE_TIMER:
-		case SUBTYPE_COUNTER:
-			store->count = *((uint32_t *)data);
-			break;
-		case SUBTYPE_PRESSURE:
-			store->pressure = *((double *)data);
-			break;
-		case SUBTYPE_SPEED:
-			store->speed = *((double *)data);
-			break;
-		case SUBTYPE_DIR:
-			store->dir = *((double *)data);
-			break;
-		case SUBTYPE_PH:
-			store->ph = *((double *)data);
-			break;
-		case SUBTYPE_WETNESS:
-			store->wetness = *((double *)data);
-			break;
-		case SUBTYPE_LUX:
-			store->lux = *((double *)data);
-			break;
-		case SUBTYPE_VOLTAGE:
-			store->volts = *((double *)data);
-			break;
-		case SUBTYPE_WATTSEC:
-			store->wattsec = *((int64_t *)data);
-			break;
-		case SUBTYPE_WATT:
-			store->watts = *((double *)data);
-			break;
-		case SUBTYPE_AMPS:
-			store->amps = *((double *)data);
-			break;
-		case SUBTYPE_RAINRATE:
-			store->rainrate = *((double *)data);
-			break;
-		case SUBTYPE_SWITCH:
-		case SUBTYPE_WEATHER:
-		case SUBTYPE_ALARMSTATUS:
-		case SUBTYPE_THMODE:
-		case SUBTYPE_THSTATE:
-		case SUBTYPE_SMNUMBER:
-		case SUBTYPE_COLLECTOR:
-		case SUBTYPE_BLIND:
-		case SUBTYPE_DAYLIGHT:
-		case SUBTYPE_TRISTATE:
-			store->state = *((uint8_t *)data);
-			break;
-		case SUBTYPE_NUMBER:
-			store->number = *((int64_t *)data);
-			break;
-		case SUBTYPE_VOLUME:
-			store->volume = *((double *)data);
-			break;
-		case SUBTYPE_DISTANCE:
-			store->distance = *((double *)data);
-			break;
-		case SUBTYPE_FLOWRATE:
-			store->flow = *((double *)data);
-			break;
-		}
+	case DATASTORE_LL:
+		store->ll = *((int64_t *)data);
+		break;
+	case DATASTORE_DOUBLE:
+		store->d = *((double *)data);
 		break;
 	}
-	}
+
+	if (where == DATALOC_DATA && dev->type == DEVICE_TIMER &&
+	    dev->subtype == SUBTYPE_TIMER && dev->data.count > 0)
+		timerdev_start(dev);
+	if (where == DATALOC_DATA && dev_data_stored != NULL)
+		dev_data_stored(dev);
 }
 
 /**
@@ -852,29 +833,90 @@ int datatype_dev(device_t *dev)
 {
 	if (dev->type == DEVICE_DIMMER)
 		return DATATYPE_DOUBLE;
-	switch (dev->subtype) {
-	case SUBTYPE_SWITCH:
-	case SUBTYPE_TIMER:
-	case SUBTYPE_COUNTER:
-	case SUBTYPE_OUTLET:
-	case SUBTYPE_WEATHER:
-	case SUBTYPE_ALARMSTATUS:
-	case SUBTYPE_THMODE:
-	case SUBTYPE_THSTATE:
-	case SUBTYPE_SMNUMBER:
-	case SUBTYPE_COLLECTOR:
-	case SUBTYPE_BLIND:
-	case SUBTYPE_DAYLIGHT:
-	case SUBTYPE_TRIGGER:
-	case SUBTYPE_TRISTATE:
-		return DATATYPE_UINT;
-		break;
-	case SUBTYPE_WATTSEC:
-	case SUBTYPE_NUMBER:
-		return DATATYPE_LL;
-		break;
+	if (dev->subtype >= NROF_SUBTYPES)
+		return DATATYPE_DOUBLE;
+	return subtype_info[dev->subtype].datatype;
+}
+
+/**
+   \brief Return how a device's value is kept in a data_t
+   \param dev device
+   \return DATASTORE_*
+   \note Switches always keep a state, and dimmers a level, whatever
+   their subtype.
+*/
+
+int datastore_dev(device_t *dev)
+{
+	if (dev->type == DEVICE_SWITCH)
+		return DATASTORE_STATE;
+	if (dev->type == DEVICE_DIMMER)
+		return DATASTORE_DOUBLE;
+	if (dev->subtype >= NROF_SUBTYPES)
+		return DATASTORE_NONE;
+	return subtype_info[dev->subtype].store;
+}
+
+/**
+   \brief Read a data_t of a device as a double, whatever its type
+   \param dev what device
+   \param store data_t to read
+   \return value
+   \note Deadbands, stats and rules all compare values this way.
+*/
+
+double get_double_store(device_t *dev, data_t *store)
+{
+	switch (datastore_dev(dev)) {
+	case DATASTORE_STATE:
+		return (double)store->state;
+	case DATASTORE_UINT:
+		return (double)store->ui;
+	case DATASTORE_LL:
+		return (double)store->ll;
+	case DATASTORE_DOUBLE:
+		return store->d;
+	}
+	return 0.0;
+}
+
+/**
+   \brief Has a device moved far enough from what a watcher last saw?
+   \param dev device, dev->data is the value about to be sent
+   \param db the watcher's deadband
+   \return 1 if the value should be sent, 0 if it is inside the deadband
+   \note The comparison is against the value last sent to this watcher,
+   not dev->last, so a slow drift still gets through once it adds up.
+   When this returns 1 the value is taken as sent.
+*/
+
+int deadband_check(device_t *dev, deadband_t *db)
+{
+	double diff, ref;
+	time_t now;
+
+	if (!db->on)
+		return 1;
+	now = time(NULL);
+	if (db->primed &&
+	    (db->heartbeat == 0 || now - db->sent_at < db->heartbeat)) {
+		ref = get_double_store(dev, &db->sent);
+		diff = get_double_store(dev, &dev->data) - ref;
+		if (diff < 0.0)
+			diff = -diff;
+		if (ref < 0.0)
+			ref = -ref;
+		if (diff == 0.0)
+			return 0;
+		if ((db->absband > 0.0 || db->pctband > 0.0) &&
+		    !(db->absband > 0.0 && diff >= db->absband) &&
+		    !(db->pctband > 0.0 && diff >= ref * db->pctband / 100.0))
+			return 0;
 	}
-	return DATATYPE_DOUBLE;
+	memcpy(&db->sent, &dev->data, sizeof(data_t));
+	db->sent_at = now;
+	db->primed = 1;
+	return 1;
 }
 
 /**
@@ -992,24 +1034,54 @@ int device_watermark(device_t *dev)
    \param fd unused
    \param what what happened?
    \param arg unused
+   \note Only the timers on the countdown list are visited.  A timer
+   leaves the list when it reaches zero, and the tick stops when the
+   list is empty.
 */
 
-void cb_timerdev_update(int fd, short what, void *arg)
+static void cb_timerdev_update(int fd, short what, void *arg)
 {
 	uint32_t count;
 	device_t *dev;
+	int i, expired;
 
 	if (notimerupdate == 1)
 		return;
 
-	TAILQ_FOREACH(dev, &alldevs, next_all) {
-		if (dev->type == DEVICE_TIMER &&
-		    dev->subtype == SUBTYPE_TIMER) {
-			get_data_dev(dev, DATALOC_DATA, &count);
-			if (count) {
-				count -= 1;
-				store_data_dev(dev, DATALOC_DATA, &count);
-			}
+	for (i=0; i < nroftimerdevs; ) {
+		dev = timerdevs[i];
+		get_data_dev(dev, DATALOC_DATA, &count);
+		expired = 0;
+		if (count) {
+			count -= 1;
+			store_data_dev(dev, DATALOC_DATA, &count);
+			expired = (count == 0);
 		}
+		if (count) {
+			i++;
+			continue;
+		}
+		/* stopped, or was set to zero from outside */
+		timerdevs[i] = timerdevs[--nroftimerdevs];
+		CLEAR_FLAG(dev->flags, DEVFLAG_COUNTING);
+		if (expired && timerdev_expired != NULL)
+			timerdev_expired(dev);
 	}
+	if (nroftimerdevs == 0)
+		event_del(timerdev_ev);
+}
+
+/**
+   \brief Start counting down timer devices once a second
+   \param base event base to run the tick on
+*/
+
+void init_timerdevs(struct event_base *base)
+{
+	struct timeval secs = { 1, 0 };
+
+	timerdev_ev = event_new(base, -1, EV_PERSIST, cb_timerdev_update,
+				NULL);
+	if (nroftimerdevs > 0)
+		event_add(timerdev_ev, &secs);
 }
@@ -59,6 +59,8 @@ extern char *dumpconf;
 
 int collector_instance = 0;
 struct bufferevent *gnhastd_bev = NULL;
+int gnhastd_apiv = 0; /**< \brief API version reported by the server */
+int gn_want_handles = 0; /**< \brief ask the server for device handles */
 
 /**
    \brief convert a temperature
@@ -209,29 +211,48 @@ double gn_maybe_scale(device_t *dev, int scale, double val)
 		return val;
 		
 	/* is this a device that is scalable? */
-	switch (dev->subtype) {
-	case SUBTYPE_TEMP:
+	if (dev->subtype >= NROF_SUBTYPES)
+		return val;
+	switch (subtype_info[dev->subtype].scalefam) {
+	case SCALEFAM_TEMP:
 		return gn_scale_temp(val, dev->scale, scale);
-		break;
-	case SUBTYPE_PRESSURE:
+	case SCALEFAM_BARO:
 		return gn_scale_pressure(val, dev->scale, scale);
-		break;
-	case SUBTYPE_SPEED:
+	case SCALEFAM_SPEED:
 		return gn_scale_speed(val, dev->scale, scale);
-		break;
-	case SUBTYPE_RAINRATE:
+	case SCALEFAM_LENGTH:
 		return gn_scale_length(val, dev->scale, scale);
-		break;
-	case SUBTYPE_LUX:
+	case SCALEFAM_LIGHT:
 		return gn_scale_light(val, dev->scale, scale);
-		break;
-	default:
-		return val;
-		break;
 	}
 	return val;
 }
 
+/**
+   \brief Start writing lines straight into a connection's output
+   \param out the bufferevent we are scheduling on
+   \return the output buffer to add lines to
+   \note Saves building each reply in an evbuffer of its own.  The
+   bufferevent stays locked until gn_reply_end(), so the lines are not
+   split up by another thread writing to it.
+*/
+
+struct evbuffer *gn_reply_begin(struct bufferevent *out)
+{
+	bufferevent_lock(out);
+	return(bufferevent_get_output(out));
+}
+
+/**
+   \brief Done writing lines started with gn_reply_begin()
+   \param out the bufferevent we are scheduling on
+*/
+
+void gn_reply_end(struct bufferevent *out)
+{
+	bufferevent_unlock(out);
+}
+
 /**
    \brief Modify a device's details
    \param dev The device to modify
@@ -250,7 +271,7 @@ void gn_modify_device(device_t *dev, struct bufferevent *out)
 		LOG(LOG_ERROR, "Attempt to register unnamed device");
 		return;
 	}
-	send = evbuffer_new();
+	send = gn_reply_begin(out);
 	/* Command to modify is "mod", start with that */
 	evbuffer_add_printf(send, "mod ");
 
@@ -322,9 +343,8 @@ void gn_modify_device(device_t *dev, struct bufferevent *out)
 
 	/* schedule the bufferevent write */
 	
-	bufferevent_write_buffer(out, send);
+	gn_reply_end(out);
 	bufferevent_enable(out, EV_READ|EV_WRITE);
-	evbuffer_free(send);
 }
 
 
@@ -349,7 +369,7 @@ void gn_register_device(device_t *dev, struct bufferevent *out)
 		return;
 	}
 
-	send = evbuffer_new();
+	send = gn_reply_begin(out);
 	/* Command to register is "reg", start with that */
 	evbuffer_add_printf(send, "reg ");
 
@@ -364,15 +384,24 @@ void gn_register_device(device_t *dev, struct bufferevent *out)
 	if (dev->scale)
 		evbuffer_add_printf(send, "%s:%d ", ARGNM(SC_SCALE),
 				    dev->scale);
-	evbuffer_add_printf(send, "%s:%d %s:%d %s:%d\n", ARGNM(SC_DEVTYPE),
+	evbuffer_add_printf(send, "%s:%d %s:%d %s:%d", ARGNM(SC_DEVTYPE),
 			    dev->type, ARGNM(SC_PROTO), dev->proto,
 			    ARGNM(SC_SUBTYPE), dev->subtype);
 
+	/* a handle from an old registration may be stale, forget it, the
+	   server answers with a fresh one (see cmd_handle in collcmd.c).
+	   Older servers don't know hdl, so until the apiv answer comes
+	   back the device keeps using its uid. */
+	dev->srvhandle = 0;
+	if (gn_want_handles && gnhastd_apiv >= GNHASTD_HANDLE_VERS)
+		evbuffer_add_printf(send, " %s:0", ARGNM(SC_HANDLE));
+	evbuffer_add_printf(send, "\n");
+	SET_FLAG(dev->flags, DEVFLAG_REGISTERED);
+
 	/* schedule the bufferevent write */
 	
-	bufferevent_write_buffer(out, send);
+	gn_reply_end(out);
 	bufferevent_enable(out, EV_READ|EV_WRITE);
-	evbuffer_free(send);
 }
 
 /**
@@ -392,7 +421,7 @@ void gn_register_devgroup_nameonly(device_group_t *devgrp,
 		return;
 	}
 
-	send = evbuffer_new();
+	send = gn_reply_begin(out);
 	/* Command to register groups is "regg", start with that */
 	evbuffer_add_printf(send, "regg ");
 
@@ -406,9 +435,8 @@ void gn_register_devgroup_nameonly(device_group_t *devgrp,
 
 	/* schedule the bufferevent write */
 	
-	bufferevent_write_buffer(out, send);
+	gn_reply_end(out);
 	bufferevent_enable(out, EV_READ|EV_WRITE);
-	evbuffer_free(send);
 }
 
 /**
@@ -430,7 +458,7 @@ void gn_register_devgroup(device_group_t *devgrp, struct bufferevent *out)
 		return;
 	}
 
-	send = evbuffer_new();
+	send = gn_reply_begin(out);
 	/* Command to register groups is "regg", start with that */
 	evbuffer_add_printf(send, "regg ");
 
@@ -466,40 +494,83 @@ void gn_register_devgroup(device_group_t *devgrp, struct bufferevent *out)
 
 	/* schedule the bufferevent write */
 	
-	bufferevent_write_buffer(out, send);
+	gn_reply_end(out);
 	bufferevent_enable(out, EV_READ|EV_WRITE);
-	evbuffer_free(send);
 }
 
 /**
-   \brief Tell the server a device's current value
-   \param dev The device to inform server about
-   \param out the bufferevent we are scheduling on
+   \brief Sanity check a device before sending an update for it
+   \param dev The device to check
+   \return 1 if it can be sent, 0 if not
 */
-	
-void gn_update_device(device_t *dev, int what, struct bufferevent *out)
-{
-	struct evbuffer *send;
-	double d=0.0;
-	uint32_t u=0;
-	int64_t ll=0;
-	int scale, i;
 
-	/* Verify device sanity first */
+static int gn_update_sane(device_t *dev)
+{
 	if (dev->name == NULL || dev->uid == NULL) {
 		LOG(LOG_ERROR, "Attempt to update unnamed device");
-		return; 
+		return 0;
 	}
 	if (dev->type == 0 || dev->subtype == 0 || dev->proto == 0) {
 		LOG(LOG_ERROR, "Attempt to update device uid=%s without "
 		    "type/subtype/proto", dev->uid);
-		return;
+		return 0;
 	}
+	return 1;
+}
+
+/**
+   \brief Add a device's current value as an argument
+   \param dev The device
+   \param scale scale to send doubles in
+   \param send evbuffer to add to
+*/
+
+static void gn_add_value(device_t *dev, int scale, struct evbuffer *send)
+{
+	double d=0.0;
+	uint32_t u=0;
+	int64_t ll=0;
+
+	switch (datatype_dev(dev)) {
+	case DATATYPE_UINT:
+		get_data_dev(dev, DATALOC_DATA, &u);
+		evbuffer_add_printf(send, "%s:%d", ARGDEV(dev), u);
+		break;
+	case DATATYPE_LL:
+		get_data_dev(dev, DATALOC_DATA, &ll);
+		evbuffer_add_printf(send, "%s:%jd", ARGDEV(dev), ll);
+		break;
+	case DATATYPE_DOUBLE:
+	default:
+		get_data_dev(dev, DATALOC_DATA, &d);
+		evbuffer_add_printf(send, "%s:%f", ARGDEV(dev),
+				    gn_maybe_scale(dev, scale, d));
+		break;
+	}
+}
+
+/**
+   \brief Build an update line for a device
+   \param dev The device to build an update for
+   \param what GNC_UPD_* bits describing what to send
+   \param send evbuffer to add the line to
+   \return 0 on success, -1 if the device is not fit to send
+*/
+
+int gn_build_update(device_t *dev, int what, struct evbuffer *send)
+{
+	double d=0.0;
+	uint32_t u=0;
+	int64_t ll=0;
+	int scale, i;
+
+	/* Verify device sanity first */
+	if (!gn_update_sane(dev))
+		return -1;
 
 	scale = GNC_GET_SCALE(what);
 	if (QUERY_BIT(what, GNC_NOSCALE))
 		scale = dev->scale; /* short circuit gn_maybe scale */
-	send = evbuffer_new();
 
 	/* special handling for cacti updates */
 	if (QUERY_BIT(what, GNC_UPD_CACTI)) {
@@ -515,15 +586,17 @@ void gn_update_device(device_t *dev, int what, struct bufferevent *out)
 			evbuffer_add_printf(send, "%f\n",
 					    gn_maybe_scale(dev, scale, d));
 		}
-		bufferevent_write_buffer(out, send);
-		evbuffer_free(send);
-		return;
+		return 0;
 	}
 	/* The command to update is "upd" */
 	evbuffer_add_printf(send, "upd ");
 
-	/* fill in the details */
-	evbuffer_add_printf(send, "%s:%s ", ARGNM(SC_UID), dev->uid);
+	/* fill in the details, the server's handle saves it a uid lookup */
+	if (dev->srvhandle)
+		evbuffer_add_printf(send, "%s:%u ", ARGNM(SC_HANDLE),
+				    dev->srvhandle);
+	else
+		evbuffer_add_printf(send, "%s:%s ", ARGNM(SC_UID), dev->uid);
 	if ((QUERY_BIT(what, GNC_UPD_NAME) || QUERY_BIT(what, GNC_UPD_FULL))
 	    && dev->name != NULL)
 		evbuffer_add_printf(send, "%s:\"%s\" ",  ARGNM(SC_NAME),
@@ -571,53 +644,134 @@ void gn_update_device(device_t *dev, int what, struct bufferevent *out)
 					    dev->scale);
 	}
 
-	/* switch and do watermarks and values */
-	switch (datatype_dev(dev)) {
-	case DATATYPE_UINT:
-		get_data_dev(dev, DATALOC_DATA, &u);
-		evbuffer_add_printf(send, "%s:%d", ARGDEV(dev), u);
-		if (QUERY_BIT(what, GNC_UPD_WATER) ||
-		    QUERY_BIT(what, GNC_UPD_FULL)) {
+	gn_add_value(dev, scale, send);
+
+	/* switch and do watermarks */
+	if (QUERY_BIT(what, GNC_UPD_WATER) || QUERY_BIT(what, GNC_UPD_FULL)) {
+		switch (datatype_dev(dev)) {
+		case DATATYPE_UINT:
 			get_data_dev(dev, DATALOC_LOWAT, &u);
 			evbuffer_add_printf(send, " %s:%d ",
 					    ARGNM(SC_LOWAT), u);
 			get_data_dev(dev, DATALOC_HIWAT, &u);
 			evbuffer_add_printf(send, "%s:%d ",
 					    ARGNM(SC_HIWAT), u);
-		}
-		break;
-	case DATATYPE_LL:
-		get_data_dev(dev, DATALOC_DATA, &ll);
-		evbuffer_add_printf(send, "%s:%jd", ARGDEV(dev), ll);
-		if (QUERY_BIT(what, GNC_UPD_WATER) ||
-		    QUERY_BIT(what, GNC_UPD_FULL)) {
+			break;
+		case DATATYPE_LL:
 			get_data_dev(dev, DATALOC_LOWAT, &ll);
 			evbuffer_add_printf(send, " %s:%jd ",
 					    ARGNM(SC_LOWAT), ll);
 			get_data_dev(dev, DATALOC_HIWAT, &ll);
 			evbuffer_add_printf(send, "%s:%jd",
 					    ARGNM(SC_HIWAT), ll);
-		}
-		break;
-	case DATATYPE_DOUBLE:
-	default:
-		get_data_dev(dev, DATALOC_DATA, &d);
-		evbuffer_add_printf(send, "%s:%f", ARGDEV(dev),
-				    gn_maybe_scale(dev, scale, d));
-		if (QUERY_BIT(what, GNC_UPD_WATER) ||
-		    QUERY_BIT(what, GNC_UPD_FULL)) {
+			break;
+		case DATATYPE_DOUBLE:
+		default:
 			get_data_dev(dev, DATALOC_LOWAT, &d);
 			evbuffer_add_printf(send, " %s:%f ",
 					    ARGNM(SC_LOWAT), d);
 			get_data_dev(dev, DATALOC_HIWAT, &d);
 			evbuffer_add_printf(send, "%s:%f",
 					    ARGNM(SC_HIWAT), d);
+			break;
 		}
-		break;
 	}
 	evbuffer_add_printf(send, "\n");
-	bufferevent_write_buffer(out, send);
-	evbuffer_free(send);
+	return 0;
+}
+
+/**
+   \brief Tell the server a device's current value
+   \param dev The device to inform server about
+   \param what GNC_UPD_* bits describing what to send
+   \param out the bufferevent we are scheduling on
+*/
+
+void gn_update_device(device_t *dev, int what, struct bufferevent *out)
+{
+	struct evbuffer *send;
+
+	send = gn_reply_begin(out);
+	(void)gn_build_update(dev, what, send);
+	gn_reply_end(out);
+}
+
+/**
+   \brief Build a snapshot line for a device
+   \param dev The device
+   \param scale scale to send doubles in
+   \param send evbuffer to add the line to
+   \return 0 on success, -1 if the device is not fit to send
+   \note Just enough for a client to start from, the uid, type, value and
+   when the value was last updated.
+*/
+
+int gn_build_snap(device_t *dev, int scale, struct evbuffer *send)
+{
+	if (!gn_update_sane(dev))
+		return -1;
+
+	evbuffer_add_printf(send, "snap %s:%s %s:%d %s:%d ", ARGNM(SC_UID),
+			    dev->uid, ARGNM(SC_DEVTYPE), dev->type,
+			    ARGNM(SC_SUBTYPE), dev->subtype);
+	gn_add_value(dev, scale, send);
+	evbuffer_add_printf(send, " %s:%jd\n", ARGNM(SC_LASTUPD),
+			    (intmax_t)dev->last_upd);
+	return 0;
+}
+
+/**
+   \brief Tell the server the current value of many devices at once
+   \param devs array of devices to inform server about
+   \param nrofdevs number of devices in devs
+   \param what GNC_UPD_* bits describing what to send
+   \param out the bufferevent we are scheduling on
+   \note If the server has told us (via apiv) that it understands mupd,
+   the devices are sent GN_MUPD_MAX at a time as mupd lines.  Otherwise
+   we fall back to one upd line per device, written out in one go.
+   Only the values are sent with mupd, so asking for anything beyond
+   scaling falls back to upd as well.
+*/
+
+void gn_update_devices(device_t **devs, int nrofdevs, int what,
+		       struct bufferevent *out)
+{
+	struct evbuffer *send;
+	int i, n, scale;
+
+	send = gn_reply_begin(out);
+	if (gnhastd_apiv < GNHASTD_MUPD_VERS ||
+	    (what & ~(GNC_NOSCALE|0xff00)) != 0) {
+		for (i=0; i < nrofdevs; i++)
+			(void)gn_build_update(devs[i], what, send);
+		gn_reply_end(out);
+		return;
+	}
+
+	n = 0;
+	for (i=0; i < nrofdevs; i++) {
+		if (!gn_update_sane(devs[i]))
+			continue;
+		if (n == 0)
+			evbuffer_add_printf(send, "mupd");
+		scale = GNC_GET_SCALE(what);
+		if (QUERY_BIT(what, GNC_NOSCALE))
+			scale = devs[i]->scale;
+		if (devs[i]->srvhandle)
+			evbuffer_add_printf(send, " %s:%u ",
+			    ARGNM(SC_HANDLE), devs[i]->srvhandle);
+		else
+			evbuffer_add_printf(send, " %s:%s ", ARGNM(SC_UID),
+			    devs[i]->uid);
+		gn_add_value(devs[i], scale, send);
+		if (++n == GN_MUPD_MAX) {
+			evbuffer_add_printf(send, "\n");
+			n = 0;
+		}
+	}
+	if (n > 0)
+		evbuffer_add_printf(send, "\n");
+	gn_reply_end(out);
 }
 
 /**
@@ -630,10 +784,9 @@ void gn_disconnect(struct bufferevent *bev)
 	struct evbuffer *send;
 
 	LOG(LOG_NOTICE, "Requesting disconnect from gnhastd");
-	send = evbuffer_new();
+	send = gn_reply_begin(bev);
 	evbuffer_add_printf(send, "disconnect\n");
-	bufferevent_write_buffer(bev, send);
-	evbuffer_free(send);
+	gn_reply_end(bev);
 }
 
 /**
@@ -650,11 +803,10 @@ void gn_client_name(struct bufferevent *bev, char *name)
 		return;
 	LOG(LOG_NOTICE, "Registering client name %s-%0.3d with gnhastd",
 	    name, collector_instance);
-	send = evbuffer_new();
+	send = gn_reply_begin(bev);
 	evbuffer_add_printf(send, "client client:%s-%0.3d\n", name,
 		collector_instance);
-	bufferevent_write_buffer(bev, send);
-	evbuffer_free(send);
+	gn_reply_end(bev);
 }
 
 /**
@@ -667,10 +819,9 @@ void gn_ping(struct bufferevent *bev)
 {
 	struct evbuffer *send;
 
-	send = evbuffer_new();
+	send = gn_reply_begin(bev);
 	evbuffer_add_printf(send, "ping\n");
-	bufferevent_write_buffer(bev, send);
-	evbuffer_free(send);
+	gn_reply_end(bev);
 }
 
 /**
@@ -682,10 +833,9 @@ void gn_imalive(struct bufferevent *bev)
 {
 	struct evbuffer *send;
 
-	send = evbuffer_new();
+	send = gn_reply_begin(bev);
 	evbuffer_add_printf(send, "imalive\n");
-	bufferevent_write_buffer(bev, send);
-	evbuffer_free(send);
+	gn_reply_end(bev);
 }
 
 /**
@@ -697,10 +847,11 @@ void gn_get_apiv(struct bufferevent *bev)
 {
 	struct evbuffer *send;
 
-	send = evbuffer_new();
+	/* until the server answers, assume the oldest protocol */
+	gnhastd_apiv = 0;
+	send = gn_reply_begin(bev);
 	evbuffer_add_printf(send, "getapiv\n");
-	bufferevent_write_buffer(bev, send);
-	evbuffer_free(send);
+	gn_reply_end(bev);
 }
 
 /* note, we have no client send die command.  There is no feasible scenario
@@ -723,7 +874,7 @@ void gn_setalarm(struct bufferevent *bev, char *aluid, char *altext,
 	struct evbuffer *send;
 
 	LOG(LOG_DEBUG, "got gn_setalarm");
-	send = evbuffer_new();
+	send = gn_reply_begin(bev);
 	if (altext == NULL) {
 		evbuffer_add_printf(send, "setalarm %s:%s %s:%d %s:%u\n",
 				    ARGNM(SC_ALUID), aluid,
@@ -737,8 +888,7 @@ void gn_setalarm(struct bufferevent *bev, char *aluid, char *altext,
 				    ARGNM(SC_ALSEV), alsev,
 				    ARGNM(SC_ALCHAN), alchan);
 	}
-	bufferevent_write_buffer(bev, send);
-	evbuffer_free(send);
+	gn_reply_end(bev);
 }
 
 /**
@@ -17,18 +17,27 @@
 /* reverse out the scale from the bitfield */
 #define GNC_GET_SCALE(x)	(ffs((x & 0xff00)>>9))
 
+/* most devices we will pack into a single mupd line */
+#define GN_MUPD_MAX	64
+
 double gn_scale_temp(double temp, int cur, int new);
 double gn_scale_pressure(double press, int cur, int new);
 double gn_scale_speed(double speed, int cur, int new);
 double gn_scale_length(double length, int cur, int new);
 double gn_scale_light(double light, int cur, int new);
 double gn_maybe_scale(device_t *dev, int scale, double val);
+struct evbuffer *gn_reply_begin(struct bufferevent *out);
+void gn_reply_end(struct bufferevent *out);
 void gn_modify_device(device_t *dev, struct bufferevent *out);
 void gn_register_device(device_t *dev, struct bufferevent *out);
 void gn_register_devgroup_nameonly(device_group_t *devgrp,
 				   struct bufferevent *out);
 void gn_register_devgroup(device_group_t *devgrp, struct bufferevent *out);
+int gn_build_update(device_t *dev, int what, struct evbuffer *send);
 void gn_update_device(device_t *dev, int what, struct bufferevent *out);
+int gn_build_snap(device_t *dev, int scale, struct evbuffer *send);
+void gn_update_devices(device_t **devs, int nrofdevs, int what,
+		       struct bufferevent *out);
 void gn_disconnect(struct bufferevent *bev);
 void gn_client_name(struct bufferevent *bev, char *name);
 void gn_ping(struct bufferevent *bev);
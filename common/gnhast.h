@@ -66,7 +66,21 @@
 
 #define HEALTH_CHECK_RATE	60
 /* Bump this whenever you add a new command, type, subtype, or proto */
-#define GNHASTD_PROTO_VERS	0x12
+#define GNHASTD_PROTO_VERS	0x19
+/* First protocol version that understands the mupd command */
+#define GNHASTD_MUPD_VERS	0x13
+/* First protocol version that hands out device handles */
+#define GNHASTD_HANDLE_VERS	0x14
+/* First protocol version with glist/tags/uid pattern feeds */
+#define GNHASTD_SELECT_VERS	0x15
+/* First protocol version with the snapshot command */
+#define GNHASTD_SNAP_VERS	0x16
+/* First protocol version with the alarmhist command */
+#define GNHASTD_ALARMHIST_VERS	0x17
+/* First protocol version with the hist command */
+#define GNHASTD_HIST_VERS	0x18
+/* First protocol version with rolling stats on ask */
+#define GNHASTD_STATS_VERS	0x19
 
 /** Basic device types */
 /** \note a type blind should always return BLIND_STOP, for consistency */
@@ -155,61 +169,86 @@ enum PROTO_TYPES {
    Subtypes
 
    \note
-    The following files must be updated when adding a subtype:
-    common/netparser.c
-    common/devices.c
-    common/confparser.c (if scaled type, like pressure)
-    common/gncoll.c (if scaled type, like pressure)
-    gnhastd/cmdhandler.c
-    common/commands.h (SC_ instances are here)
-    common/collcmd.c
-    Note, you must also update the SC_ instances.
-    GNHASTD_PROTO_VERS (up above)
-
-   \todo Change how these are stored internally
+    A subtype is added with one line in SUBTYPE_TABLE below, which gives
+    its name in devices.conf, how its value is kept in a data_t, the
+    argument that carries it on the wire, and what family of scales it
+    can be converted between.  A new argument also needs its SC_ in
+    common/commands.h and its entry in the argtable in common/netparser.c.
+    Bump GNHASTD_PROTO_VERS (up above).  Add new subtypes just before
+    BOOL, the numbers are on the wire.
 */
 
+/** \brief how a subtype's value is kept in a data_t */
+enum DATASTORE_TYPES {
+    DATASTORE_NONE,	/**< \brief no value */
+    DATASTORE_STATE,	/**< \brief uint8_t, in state */
+    DATASTORE_UINT,	/**< \brief uint32_t, in count/ui */
+    DATASTORE_LL,	/**< \brief int64_t, in wattsec/number/ll */
+    DATASTORE_DOUBLE,	/**< \brief double, in temp/humid/d etc */
+};
+
+/** \brief which scales a subtype's value can be converted between */
+enum SCALEFAM_TYPES {
+    SCALEFAM_NONE,	/**< \brief not scalable */
+    SCALEFAM_TEMP,	/**< \brief TSCALE_* */
+    SCALEFAM_BARO,	/**< \brief BAROSCALE_* */
+    SCALEFAM_SPEED,	/**< \brief SPEED_* */
+    SCALEFAM_LENGTH,	/**< \brief LENGTH_* */
+    SCALEFAM_LIGHT,	/**< \brief LIGHT_* */
+};
+
+/**
+   \brief Every subtype: X(id, conf name, DATASTORE_, SC_ arg, SCALEFAM_)
+   \note Expanded into enum SUBTYPE_TYPES here, and into subtype_info[]
+   and devsubtype_map[] in common/devices.c.  The SC_ arg is -1 for
+   subtypes that carry no value.
+*/
+#define SUBTYPE_TABLE(X) \
+	X(NONE,		"NONE",		NONE,	-1,		NONE) \
+	X(SWITCH,	"switch",	STATE,	SC_SWITCH,	NONE) \
+	X(OUTLET,	"outlet",	STATE,	SC_SWITCH,	NONE) \
+	X(TEMP,		"temp",		DOUBLE,	SC_TEMP,	TEMP) \
+	X(HUMID,	"humid",	DOUBLE,	SC_HUMID,	NONE) \
+	X(COUNTER,	"counter",	UINT,	SC_COUNT,	NONE) \
+	X(PRESSURE,	"pressure",	DOUBLE,	SC_PRESSURE,	BARO) \
+	X(SPEED,	"windspeed",	DOUBLE,	SC_SPEED,	SPEED) \
+	X(DIR,		"winddir",	DOUBLE,	SC_DIR,		NONE) \
+	X(PH,		"ph",		DOUBLE,	SC_PH,		NONE) \
+	X(WETNESS,	"wetness",	DOUBLE,	SC_WETNESS,	NONE) \
+	X(HUB,		"hub",		NONE,	-1,		NONE) \
+	X(LUX,		"lux",		DOUBLE,	SC_LUX,		LIGHT) \
+	X(VOLTAGE,	"voltage",	DOUBLE,	SC_VOLTAGE,	NONE) \
+	X(WATTSEC,	"wattsec",	LL,	SC_WATTSEC,	NONE) \
+	X(WATT,		"watt",		DOUBLE,	SC_WATT,	NONE) \
+	X(AMPS,		"amps",		DOUBLE,	SC_AMPS,	NONE) \
+	X(RAINRATE,	"rainrate",	DOUBLE,	SC_RAINRATE,	LENGTH) \
+	X(WEATHER,	"weather",	STATE,	SC_WEATHER,	NONE) \
+	X(ALARMSTATUS,	"alarmstatus",	STATE,	SC_ALARMSTATUS,	NONE) \
+	X(NUMBER,	"number",	LL,	SC_NUMBER,	NONE) \
+	X(PERCENTAGE,	"percentage",	DOUBLE,	SC_PERCENTAGE,	NONE) \
+	X(FLOWRATE,	"flowrate",	DOUBLE,	SC_FLOWRATE,	NONE) \
+	X(DISTANCE,	"distance",	DOUBLE,	SC_DISTANCE,	NONE) \
+	X(VOLUME,	"volume",	DOUBLE,	SC_VOLUME,	NONE) \
+	X(TIMER,	"timer",	UINT,	SC_TIMER,	NONE) /* countdown to zero */ \
+	X(THMODE,	"thmode",	STATE,	SC_THMODE,	NONE) \
+	X(THSTATE,	"thstate",	STATE,	SC_THSTATE,	NONE) \
+	X(SMNUMBER,	"smnumber",	STATE,	SC_SMNUMBER,	NONE) /* 8bit number */ \
+	X(BLIND,	"blind",	STATE,	SC_BLIND,	NONE) /* see BLIND_* */ \
+	X(COLLECTOR,	"collector",	STATE,	SC_COLLECTOR,	NONE) \
+	X(TRIGGER,	"trigger",	UINT,	SC_TRIGGER,	NONE) /* momentary switch */ \
+	X(ORP,		"orp",		DOUBLE,	SC_ORP,		NONE) /* Oxidation Redux Potential */ \
+	X(SALINITY,	"salinity",	DOUBLE,	SC_SALINITY,	NONE) /* ppt */ \
+	X(DAYLIGHT,	"daylight",	STATE,	SC_DAYLIGHT,	NONE) /* see DAYLIGHT_* */ \
+	X(MOONPH,	"moonph",	DOUBLE,	SC_MOONPH,	NONE) /* lunar phase */ \
+	X(TRISTATE,	"tristate",	STATE,	SC_TRISTATE,	NONE) /* 0,1,2 */ \
+	X(BOOL,		"bool",		NONE,	-1,		NONE) /* Never actually use this one, just for submax */
+
+#define SUBTYPE_ENUM(id, name, store, arg, scale)	SUBTYPE_##id,
 enum SUBTYPE_TYPES {
-	SUBTYPE_NONE,
-	SUBTYPE_SWITCH,
-	SUBTYPE_OUTLET,
-	SUBTYPE_TEMP,
-	SUBTYPE_HUMID,
-	SUBTYPE_COUNTER,
-	SUBTYPE_PRESSURE,
-	SUBTYPE_SPEED,
-	SUBTYPE_DIR,
-	SUBTYPE_PH, /* stored in ph */
-	SUBTYPE_WETNESS,
-	SUBTYPE_HUB,
-	SUBTYPE_LUX,
-	SUBTYPE_VOLTAGE,
-	SUBTYPE_WATTSEC,
-	SUBTYPE_WATT,
-	SUBTYPE_AMPS,
-	SUBTYPE_RAINRATE,
-	SUBTYPE_WEATHER, /* stored in state */
-	SUBTYPE_ALARMSTATUS, /* stored in state */
-	SUBTYPE_NUMBER,
-	SUBTYPE_PERCENTAGE, /* stored in humid */
-	SUBTYPE_FLOWRATE,
-	SUBTYPE_DISTANCE, 
-	SUBTYPE_VOLUME,
-	SUBTYPE_TIMER, /* stored in count, used as countdown to zero */
-	SUBTYPE_THMODE, /* stored in state */
-	SUBTYPE_THSTATE, /* stored in state */
-	SUBTYPE_SMNUMBER, /* 8bit number stored in state */
-	SUBTYPE_BLIND, /* stored in state, see BLIND_* */
-	SUBTYPE_COLLECTOR, /* stored in state */
-	SUBTYPE_TRIGGER, /* momentary switch (ui) */
-	SUBTYPE_ORP, /* Oxidation Redux Potential (d) */
-	SUBTYPE_SALINITY, /* Salinity (d) */
-	SUBTYPE_DAYLIGHT, /* daylight (8 bit number stored in state) */
-	SUBTYPE_MOONPH, /* lunar phase (d) */
-	SUBTYPE_TRISTATE, /* tri-state device 0,1,2 stored in state) */
-	SUBTYPE_BOOL, /* Never actually use this one, just for submax */
+	SUBTYPE_TABLE(SUBTYPE_ENUM)
 	NROF_SUBTYPES,
 };
+#undef SUBTYPE_ENUM
 #define SUBTYPE_MAX SUBTYPE_BOOL
 /* used in owsrv to limit which sensors we can talk about
    add new sensor types between these */
@@ -326,6 +365,7 @@ enum SALINITY_TYPES {
 
 struct _device_group_t;
 struct _client_t;
+struct _netthread_t;
 struct _device_t;
 struct _wrap_client_t;
 struct _wrap_device_t;
@@ -344,6 +384,15 @@ typedef struct _name_map_t {
     char *name;	/**< \brief The string that is mapped */
 } name_map_t;
 
+/** \brief What a subtype is, see SUBTYPE_TABLE */
+typedef struct _subtype_info_t {
+    char *name;		/**< \brief name in devices.conf */
+    uint8_t store;	/**< \brief DATASTORE_* */
+    uint8_t datatype;	/**< \brief DATATYPE_* */
+    uint8_t scalefam;	/**< \brief SCALEFAM_* */
+    int arg;		/**< \brief SC_* of its value, -1 if none */
+} subtype_info_t;
+
 /** \brief The client type, used to store data for events */
 typedef struct _client_t {
     int fd;		/**< \brief file descriptor */
@@ -351,9 +400,11 @@ typedef struct _client_t {
     pid_t pid;		/**< \brief pid, if handler */
     TAILQ_HEAD(, _device_t) devices;  /**< \brief linked list of devices it provides */
     TAILQ_HEAD(, _wrap_device_t) wdevices; /**< \brief linked list of non-provided devices */
+    TAILQ_HEAD(, _wrap_client_t) watching; /**< \brief our entries on device watcher lists */
+    TAILQ_HEAD(, _wrap_client_t) pending; /**< \brief watched devices owed an update */
+    TAILQ_HEAD(, _selector_t) selectors; /**< \brief cfeed selectors (glist/tags/uid glob) */
+    int resync;		/**< \brief selector updates were held back, resend all */
     struct bufferevent *ev;	/**< \brief the bufferevent */
-    struct event *tev;	/**< \brief a timer event */
-    int timer_gcd;	/**< \brief current gcd of the timer */
     SSL_CTX *srv_ctx;	/**< \brief server context */
     SSL *cli_ctx;	/**< \brief client context */
     int close_on_empty;	/**< \brief close this connection on empty */
@@ -365,10 +416,20 @@ typedef struct _client_t {
     uint32_t feeds;	/**< \brief feeds for this cli */
     uint32_t watched;	/**< \brief watched device count */
     uint32_t sentdata;	/**< \brief data sent to this cli */
+    uint32_t coalesced;	/**< \brief updates folded into a pending one */
+    uint32_t dropped;	/**< \brief feed updates skipped while backed up */
     time_t lastupd;	/**< \brief last time we were talked to */
     int alarmwatch;	/**< \brief min sev of alarms we want, 0 disables */
     uint32_t alchan;	/**< \brief alarm channels we watch */
+    uint32_t alarmgen;	/**< \brief last alarm fan-out that reached us */
     struct _device_t *coll_dev;	/**< \brief the dev for the collector itself */
+    struct _netparse_t *np;	/**< \brief line parser state */
+    struct _netthread_t *thr;	/**< \brief I/O thread, NULL if on the main loop */
+    int closing;	/**< \brief I/O thread has handed us to the main thread to close */
+    int drain_wanted;	/**< \brief I/O thread should report the output draining */
+    struct evbuffer *outbox; /**< \brief watcher updates batched for an I/O thread */
+    int onoutbox;	/**< \brief on the list of clients with a full outbox */
+    TAILQ_ENTRY(_client_t) next_outbox; /**< \brief next client with a full outbox */
     TAILQ_ENTRY(_client_t) next; /**< \brief next client on list */
 } client_t;
 
@@ -394,6 +455,7 @@ enum DATATYPE_TYPES {
 
 #define DEVONQ_CLIENT	(1<<1)	/**< Device is on a client queue*/
 #define DEVONQ_ALL	(1<<2)	/**< Device is on all queues*/
+#define DEVONQ_MUPD	(1<<3)	/**< \brief Device is in the mupd being handled */
 #define WRAPONQ_NEXT	(1<<1)	/**< Next wrapdev */
 #define GROUPONQ_NEXT	(1<<1)	/**< next groupq */
 #define GROUPONQ_ALL	(1<<2)	/**< all group queues*/
@@ -404,6 +466,9 @@ enum DATATYPE_TYPES {
 #define DEVFLAG_SPAMHANDLER	0  /**< \brief do we spam the handler? */
 #define DEVFLAG_NODATA		1  /**< \brief device has no cur data */
 #define DEVFLAG_CHANGEHANDLER	2  /**< \brief fire when device changes */
+#define DEVFLAG_DIRTY		3  /**< \brief conf section is out of date */
+#define DEVFLAG_COUNTING	4  /**< \brief timer on the countdown list */
+#define DEVFLAG_REGISTERED	5  /**< \brief collector has sent a reg for it */
 
 /* Flags (new method) for alarm channels See common.h SET_FLAG macros */
 
@@ -459,41 +524,71 @@ typedef union _data_t {
     int64_t ll;		/**< \brief Generic int64 */
 } data_t;
 
-/** \brief The device structure */
+/** \brief Deadband and heartbeat settings of one feed or cfeed */
+typedef struct _deadband_t {
+    int on;		/**< \brief only send when the value moves */
+    double absband;	/**< \brief absolute deadband, 0 for any change */
+    double pctband;	/**< \brief deadband in percent of the value last sent */
+    int heartbeat;	/**< \brief send anyway after this many seconds, 0 never */
+    int primed;		/**< \brief sent holds a value */
+    data_t sent;	/**< \brief value last sent, copied from dev->data */
+    time_t sent_at;	/**< \brief when it was sent */
+} deadband_t;
+
+/**
+   \brief The device structure
+   \note Ordered hot to cold.  The first 64 bytes are what a scan of
+   alldevs, a uid lookup and an update read; the next 64 what an update
+   goes on to touch.  Names, locators, handler args and tags come last.
+   Devices come from smalloc, which only promises malloc alignment, so
+   each group usually straddles two cache lines; the ordering keeps the
+   hot fields in few lines, not in one.  Keep new fields out of the
+   first two groups unless they are read on every update.
+*/
 typedef struct _device_t {
-    char *uid;		/**< \brief Unique Identifier */
-    char *loc;		/**< \brief Locator */
-    char *name;		/**< \brief Friendly Name */
-    char *rrdname;	/**< \brief Name for rrd */
+    /* scans and lookups */
+    uint32_t uidhash;	/**< \brief hash of dev->uid */
+    uint32_t flags;	/**< \brief DEVFLAG_* */
     uint8_t proto;	/**< \brief protocol */
     uint8_t type;	/**< \brief Type */
     uint8_t subtype;	/**< \brief sub-type */
     uint8_t scale;	/**< \brief scale (temp/baro/etc) */
+    uint32_t handle;	/**< \brief handle in our device table */
+    char *uid;		/**< \brief Unique Identifier */
+    TAILQ_ENTRY(_device_t) next_all;	/**< \brief Next in global devlist */
     data_t data;	/**< \brief current data */
     data_t last;	/**< \brief previous data */
+    time_t last_upd;	/**< \brief time of last update */
+    /* the rest of an update */
     data_t lowat;	/**< \brief low water mark */
     data_t hiwat;	/**< \brief high water mark */
-    data_t change;	/**< \brief data requested to be changed */
-    client_t *collector;/**< \brief The collector that serves this data up */
     char *handler;	/**< \brief our external handler */
+    void *localdata;	/**< \brief pointer to program-specific data */
+    TAILQ_HEAD(, _wrap_client_t) watchers;  /**< \brief linked list of clients watching this device */
+    client_t *collector;/**< \brief The collector that serves this data up */
+    uint32_t srvhandle;	/**< \brief handle the server gave us, 0 if none */
+    uint32_t onq;	/**< \brief I am on a queue */
+    /* metadata */
+    char *loc;		/**< \brief Locator */
+    char *name;		/**< \brief Friendly Name */
+    char *rrdname;	/**< \brief Name for rrd */
+    data_t change;	/**< \brief data requested to be changed */
     char **hargs;	/**< \brief handler arguments */
     int nrofhargs;	/**< \brief number of handler arguments */
-    char **tags;        /**< \brief tags */
     int nroftags;	/**< \brief number of tags */
-    void *localdata;	/**< \brief pointer to program-specific data */
-    time_t last_upd;	/**< \brief time of last update */
-    struct rb_node rbn;	/**< \brief red black node for dev->uid */
-    uint32_t onq;	/**< \brief I am on a queue */
-    uint32_t flags;	/**< \brief DEVFLAG_* */
+    char **tags;        /**< \brief tags */
     TAILQ_ENTRY(_device_t) next_client;	/**< \brief Next device in client */
-    TAILQ_ENTRY(_device_t) next_all;	/**< \brief Next in global devlist */
-    TAILQ_HEAD(, _wrap_client_t) watchers;  /**< \brief linked list of clients watching this device */
 } device_t;
 
 /** \brief A wrapper client structure */
 typedef struct _wrap_client_t {
     client_t *client;	/**< \brief wrapped client */
+    struct _device_t *dev;	/**< \brief device being watched */
     TAILQ_ENTRY(_wrap_client_t) next; /**< \brief next client */
+    TAILQ_ENTRY(_wrap_client_t) next_client; /**< \brief next in client->watching */
+    int pending;	/**< \brief on client->pending */
+    TAILQ_ENTRY(_wrap_client_t) next_pending; /**< \brief next in client->pending */
+    deadband_t db;	/**< \brief only send when the value moves this much */
 } wrap_client_t;
 
 /** \brief A wrapper device structure */
@@ -504,6 +599,11 @@ typedef struct _wrap_device_t {
     struct _device_group_t *group; /**< \brief parent group */
     time_t last_fired;	/**< \brief last time fired */
     uint32_t onq;	/**< \brief I am on a queue */
+    time_t next_fire;	/**< \brief when the feed is next due */
+    int heapidx;	/**< \brief slot in the feed heap, 0 if unscheduled */
+    struct _client_t *client; /**< \brief client the feed is sent to */
+    struct _selector_t *sel;	/**< \brief feed every device matching this, dev is NULL */
+    deadband_t db;	/**< \brief only send when the value moves this much */
     TAILQ_ENTRY(_wrap_device_t) next; /**< \brief next device */
 } wrap_device_t;
 
@@ -533,8 +633,19 @@ typedef struct _alarm_t {
     char *altext;	/**< \brief alarm text */
     int alsev;		/**< \brief alarm sev, 0 clears alarm */
     uint32_t alchan;	/**< \brief alarm channel (BITFLAG) */
+    uint32_t aluidhash;	/**< \brief hash of aluid, for the alarm hash */
+    struct _alarm_t *hnext; /**< \brief next alarm in the same hash bucket */
     TAILQ_ENTRY(_alarm_t) next; /**< \brief next in global alarm list */
 } alarm_t;
 
+/** \brief A change to an alarm, kept in the alarm history */
+typedef struct _alarm_hist_t {
+    char *aluid;	/**< \brief alarm uid */
+    char *altext;	/**< \brief alarm text, NULL if cleared */
+    int alsev;		/**< \brief new severity, 0 if cleared */
+    uint32_t alchan;	/**< \brief alarm channel (BITFLAG) */
+    time_t when;	/**< \brief time of the change */
+} alarm_hist_t;
+
 #endif /* _GN_ARDUINO_ */
 #endif /* _GNHAST_H_ */
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file logger.c
+   \brief The log writer behind LOG()
+   \author Tim Rightnour
+
+   LOG() only calls _LOG() when the line will actually be logged, so a
+   debug line costs a compare when debugging is off.  _LOG() formats the
+   line into a slot of a fixed ring, and a writer thread drains the ring
+   to the logfile (or stderr) in batches, so the caller never waits on the
+   disk.  Any thread may log; claiming a slot is a compare and swap, and
+   no lock is taken.  If the ring is full, debug and notice lines are
+   dropped and counted, anything worse is written straight out.  After a
+   fork the child writes straight out too, as it has no writer thread.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+
+extern FILE *logfile;
+extern const char *loglevels[];
+
+/** \brief number of slots in the ring, power of 2 */
+#define LOG_RING_SIZE	256
+/** \brief longest line we log, longer ones are cut short */
+#define LOG_LINE_MAX	1024
+/** \brief how long the writer sleeps when there is nothing to do (ms) */
+#define LOG_IDLE_MS	100
+
+/** \brief a line waiting in the ring */
+typedef struct _logslot_t {
+	uint32_t seq;		/**< \brief sequence, says who owns the slot */
+	uint32_t len;		/**< \brief length of the line */
+	char buf[LOG_LINE_MAX];	/**< \brief the line, with its newline */
+} logslot_t;
+
+static logslot_t *logring;
+/** \brief next slot to fill */
+static uint32_t log_head;
+/** \brief next slot to write out */
+static uint32_t log_tail;
+/** \brief lines dropped because the ring was full */
+static uint32_t log_dropped;
+/** \brief 1 while the writer thread runs, -1 if we write directly */
+static int log_async;
+/** \brief writer is asleep and wants a signal */
+static int log_idle;
+/** \brief set to make the writer exit */
+static int log_stop;
+
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+
+/**
+   \brief Where log lines go right now
+   \return file descriptor
+*/
+
+static int log_fd(void)
+{
+	return (logfile != NULL) ? fileno(logfile) : STDERR_FILENO;
+}
+
+/**
+   \brief Write all of a buffer to a file descriptor
+   \param fd where to
+   \param buf what
+   \param len how much
+*/
+
+static void log_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+   \brief Format a log line, timestamp and all
+   \param buf where to put it, LOG_LINE_MAX bytes
+   \param severity severity of the line
+   \param s format string
+   \param args arguments
+   \return length of the line
+   \note The timestamp is only rebuilt when the second changes.
+*/
+
+static uint32_t log_format(char *buf, int severity, const char *s,
+			   va_list args)
+{
+	static __thread time_t stamp_sec;
+	static __thread char stamp[16];
+	struct tm tm;
+	time_t now;
+	int n, m;
+
+	now = time(NULL);
+	if (now != stamp_sec) {
+		localtime_r(&now, &tm);
+		strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+		stamp_sec = now;
+	}
+	n = snprintf(buf, LOG_LINE_MAX, "%s [%s]:", stamp, loglevels[severity]);
+	m = vsnprintf(buf + n, LOG_LINE_MAX - n, s, args);
+	if (m < 0)
+		m = 0;
+	n += m;
+	if (n > LOG_LINE_MAX - 2) {
+		n = LOG_LINE_MAX - 5;
+		memcpy(buf + n, "...", 3);
+		n += 3;
+	}
+	buf[n++] = '\n';
+	return n;
+}
+
+/**
+   \brief Write out everything waiting in the ring
+   \return number of lines written
+*/
+
+static int log_drain(void)
+{
+	static char batch[16 * LOG_LINE_MAX];
+	logslot_t *slot;
+	size_t len = 0;
+	uint32_t dropped;
+	int n = 0, fd;
+
+	pthread_mutex_lock(&log_lock);
+	fd = log_fd();
+	for (;;) {
+		slot = &logring[log_tail & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    log_tail + 1)
+			break;
+		if (len + slot->len > sizeof(batch)) {
+			log_write(fd, batch, len);
+			len = 0;
+		}
+		memcpy(batch + len, slot->buf, slot->len);
+		len += slot->len;
+		__atomic_store_n(&slot->seq, log_tail + LOG_RING_SIZE,
+				 __ATOMIC_RELEASE);
+		log_tail++;
+		n++;
+	}
+	if (len > 0)
+		log_write(fd, batch, len);
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		len = snprintf(batch, sizeof(batch),
+		    "Log ring full, dropped %u lines\n", dropped);
+		log_write(fd, batch, len);
+	}
+	pthread_cond_broadcast(&log_drained);
+	pthread_mutex_unlock(&log_lock);
+	return n;
+}
+
+/**
+   \brief The writer thread
+   \param arg unused
+*/
+
+static void *log_writer(void *arg)
+{
+	struct timespec ts;
+
+	for (;;) {
+		if (log_drain() > 0)
+			continue;
+		if (__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE))
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_IDLE_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&log_lock);
+		__atomic_store_n(&log_idle, 1, __ATOMIC_RELEASE);
+		pthread_cond_timedwait(&log_wake, &log_lock, &ts);
+		__atomic_store_n(&log_idle, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&log_lock);
+	}
+	return NULL;
+}
+
+/**
+   \brief Wait until everything logged so far has been written
+*/
+
+void log_flush(void)
+{
+	uint32_t want;
+
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) != 1)
+		return;
+	want = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&log_lock);
+	while ((int32_t)(log_tail - want) < 0) {
+		pthread_cond_signal(&log_wake);
+		pthread_cond_wait(&log_drained, &log_lock);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+/**
+   \brief Write out what is waiting and close the logfile
+*/
+
+void log_closefile(void)
+{
+	log_flush();
+	pthread_mutex_lock(&log_lock);
+	if (logfile != NULL)
+		fclose(logfile);
+	logfile = NULL;
+	pthread_mutex_unlock(&log_lock);
+}
+
+/**
+   \brief Switch to a freshly opened logfile, for log rotation
+   \param logname name to open, as for openlog()
+   \note The swap is done under log_lock, so the writer never sees a
+   closed file.  If the new file won't open, we keep the old one.
+*/
+
+void log_reopen(char *logname)
+{
+	FILE *l, *old;
+
+	l = openlog(logname);
+	if (l == NULL)
+		return;
+	log_flush();
+	pthread_mutex_lock(&log_lock);
+	old = logfile;
+	logfile = l;
+	pthread_mutex_unlock(&log_lock);
+	if (old != NULL)
+		fclose(old);
+}
+
+/**
+   \brief Flush and stop the writer at exit
+*/
+
+static void log_shutdown(void)
+{
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) != 1)
+		return;
+	__atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&log_wake);
+	pthread_join(log_thread, NULL);
+	log_drain();
+	__atomic_store_n(&log_async, -1, __ATOMIC_RELEASE);
+}
+
+/**
+   \brief In a forked child there is no writer, write lines directly
+   \note log_flush() ran before the fork, so the ring is empty here.
+*/
+
+static void log_atfork_child(void)
+{
+	log_async = -1;
+	pthread_mutex_init(&log_lock, NULL);
+}
+
+/**
+   \brief Set up the ring and start the writer, the first time we log
+   \return 1 if lines go through the ring, 0 if they are written directly
+*/
+
+static int log_start(void)
+{
+	int i;
+
+	switch (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+	case 1:
+		return 1;
+	case -1:
+		return 0;
+	}
+	pthread_mutex_lock(&log_lock);
+	if (log_async == 0) {
+		logring = calloc(LOG_RING_SIZE, sizeof(logslot_t));
+		if (logring != NULL) {
+			for (i = 0; i < LOG_RING_SIZE; i++)
+				logring[i].seq = i;
+			if (pthread_create(&log_thread, NULL, log_writer,
+					   NULL) == 0) {
+				pthread_atfork(log_flush, NULL,
+					       log_atfork_child);
+				atexit(log_shutdown);
+				__atomic_store_n(&log_async, 1,
+						 __ATOMIC_RELEASE);
+			}
+		}
+		if (log_async == 0)
+			__atomic_store_n(&log_async, -1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log_lock);
+	return log_async == 1;
+}
+
+/**
+   \brief Claim a free slot in the ring
+   \return the slot, or NULL if the ring is full
+*/
+
+static logslot_t *log_claim(void)
+{
+	logslot_t *slot;
+	uint32_t pos, seq;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &logring[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_head, &pos,
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return slot;
+		} else if ((int32_t)(seq - pos) < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+   \brief Log something
+   \param severity Severity of log, see LOG_WARNING etc
+   \param s format string
+   \param ... arguments
+   \note Call this through LOG(), which checks the severity first.
+*/
+
+void _LOG(int severity, const char *s, ...)
+{
+	char buf[LOG_LINE_MAX];
+	logslot_t *slot;
+	va_list args;
+	uint32_t len, pos;
+
+	if (log_start() && (slot = log_claim()) != NULL) {
+		va_start(args, s);
+		slot->len = log_format(slot->buf, severity, s, args);
+		va_end(args);
+		/* the slot's number was pos, it is ours until we publish */
+		pos = slot->seq;
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+		if (__atomic_load_n(&log_idle, __ATOMIC_ACQUIRE))
+			pthread_cond_signal(&log_wake);
+	} else if (log_async == 1 && severity < LOG_WARNING) {
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		va_start(args, s);
+		len = log_format(buf, severity, s, args);
+		va_end(args);
+		log_write(log_fd(), buf, len);
+	}
+
+	if (severity == LOG_FATAL) {
+		log_flush();
+		if (logfile != NULL) {
+			va_start(args, s);
+			vfprintf(stderr, s, args);
+			fprintf(stderr, "\n");
+			va_end(args);
+		}
+		exit(EXIT_FAILURE);
+	}
+}
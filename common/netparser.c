@@ -109,6 +109,20 @@ argtable_t argtable[] = {
 	{"daylight", SC_DAYLIGHT, PTINT},
 	{"tristate", SC_TRISTATE, PTINT},
 	{"moonph", SC_MOONPH, PTDOUBLE},
+	{"hdl", SC_HANDLE, PTUINT},
+	{"dband", SC_DEADBAND, PTDOUBLE},
+	{"dbpct", SC_DBPCT, PTDOUBLE},
+	{"hbeat", SC_HEARTBEAT, PTINT},
+	{"lupd", SC_LASTUPD, PTLL},
+	{"since", SC_SINCE, PTLL},
+	{"max", SC_MAX, PTLL},
+	{"window", SC_WINDOW, PTINT},
+	{"wcount", SC_WCOUNT, PTUINT},
+	{"wmin", SC_WMIN, PTDOUBLE},
+	{"wmax", SC_WMAX, PTDOUBLE},
+	{"wavg", SC_WAVG, PTDOUBLE},
+	{"wsdev", SC_WSDEV, PTDOUBLE},
+	{"wrate", SC_WRATE, PTDOUBLE},
 };
 
 /** \brief size of the args table */ 
@@ -141,6 +155,34 @@ static int compare_argtable(const void *a, const void *b)
 	return strcmp(((argtable_t *)a)->name, ((argtable_t *)b)->name);
 }
 
+/** \brief argtable entry of each SC_, built by argtable_index() */
+static int argindex[NROF_SC_COMMANDS];
+/** \brief is this SC_ the value of some subtype */
+static uint8_t argdata[NROF_SC_COMMANDS];
+static int argindex_built;
+
+/**
+   \brief Index the argtable by SC_, and mark the value arguments
+   \note Must be redone whenever the argtable is reordered.
+*/
+
+static void argtable_index(void)
+{
+	int i;
+
+	for (i=0; i < NROF_SC_COMMANDS; i++)
+		argindex[i] = -1;
+	for (i=0; i < args_size; i++)
+		if (argtable[i].num >= 0 && argtable[i].num < NROF_SC_COMMANDS)
+			argindex[argtable[i].num] = i;
+	memset(argdata, 0, sizeof(argdata));
+	argdata[SC_DIMMER] = 1;
+	for (i=0; i < NROF_SUBTYPES; i++)
+		if (subtype_info[i].arg >= 0)
+			argdata[subtype_info[i].arg] = 1;
+	argindex_built = 1;
+}
+
 /**
    \brief find an argument by id number
    \param id ID number to find
@@ -149,12 +191,26 @@ static int compare_argtable(const void *a, const void *b)
 
 int find_arg_byid(int id)
 {
-	int i;
+	if (!argindex_built)
+		argtable_index();
+	if (id < 0 || id >= NROF_SC_COMMANDS)
+		return(-1);
+	return(argindex[id]);
+}
 
-	for (i=0; i < args_size; i++)
-		if (argtable[i].num == id)
-			return(i);
-	return(-1);
+/**
+   \brief Does an argument carry a device's value?
+   \param id SC_ of the argument
+   \return bool
+*/
+
+int arg_is_data(int id)
+{
+	if (!argindex_built)
+		argtable_index();
+	if (id < 0 || id >= NROF_SC_COMMANDS)
+		return 0;
+	return argdata[id];
 }
 
 /**
@@ -166,43 +222,8 @@ int find_arg_bydev(device_t *dev)
 {
 	if (dev->type == DEVICE_DIMMER)
 		return find_arg_byid(SC_DIMMER);
-	switch (dev->subtype) {
-	case SUBTYPE_TEMP: return find_arg_byid(SC_TEMP); break;
-	case SUBTYPE_HUMID: return find_arg_byid(SC_HUMID); break;
-	case SUBTYPE_LUX: return find_arg_byid(SC_LUX); break;
-	case SUBTYPE_COUNTER: return find_arg_byid(SC_COUNT); break;
-	case SUBTYPE_PRESSURE: return find_arg_byid(SC_PRESSURE); break;
-	case SUBTYPE_SPEED: return find_arg_byid(SC_SPEED); break;
-	case SUBTYPE_DIR: return find_arg_byid(SC_DIR); break;
-	case SUBTYPE_SWITCH: return find_arg_byid(SC_SWITCH); break;
-	case SUBTYPE_OUTLET: return find_arg_byid(SC_SWITCH); break;
-	case SUBTYPE_WETNESS: return find_arg_byid(SC_WETNESS); break;
-	case SUBTYPE_PH: return find_arg_byid(SC_PH); break;
-	case SUBTYPE_VOLTAGE: return find_arg_byid(SC_VOLTAGE); break;
-	case SUBTYPE_WATTSEC: return find_arg_byid(SC_WATTSEC); break;
-	case SUBTYPE_WATT: return find_arg_byid(SC_WATT); break;
-	case SUBTYPE_AMPS: return find_arg_byid(SC_AMPS); break;
-	case SUBTYPE_RAINRATE: return find_arg_byid(SC_RAINRATE); break;
-	case SUBTYPE_WEATHER: return find_arg_byid(SC_WEATHER); break;
-	case SUBTYPE_ALARMSTATUS: return find_arg_byid(SC_ALARMSTATUS); break;
-	case SUBTYPE_NUMBER: return find_arg_byid(SC_NUMBER); break;
-	case SUBTYPE_PERCENTAGE: return find_arg_byid(SC_PERCENTAGE); break;
-	case SUBTYPE_FLOWRATE: return find_arg_byid(SC_FLOWRATE); break;
-	case SUBTYPE_DISTANCE: return find_arg_byid(SC_DISTANCE); break;
-	case SUBTYPE_VOLUME: return find_arg_byid(SC_VOLUME); break;
-	case SUBTYPE_TIMER: return find_arg_byid(SC_TIMER); break;
-	case SUBTYPE_THMODE: return find_arg_byid(SC_THMODE); break;
-	case SUBTYPE_THSTATE: return find_arg_byid(SC_THSTATE); break;
-	case SUBTYPE_SMNUMBER: return find_arg_byid(SC_SMNUMBER); break;
-	case SUBTYPE_COLLECTOR: return find_arg_byid(SC_COLLECTOR); break;
-	case SUBTYPE_BLIND: return find_arg_byid(SC_BLIND); break;
-	case SUBTYPE_TRIGGER: return find_arg_byid(SC_TRIGGER); break;
-	case SUBTYPE_ORP: return find_arg_byid(SC_ORP); break;
-	case SUBTYPE_SALINITY: return find_arg_byid(SC_SALINITY); break;
-	case SUBTYPE_DAYLIGHT: return find_arg_byid(SC_DAYLIGHT); break;
-	case SUBTYPE_TRISTATE: return find_arg_byid(SC_TRISTATE); break;
-	case SUBTYPE_MOONPH: return find_arg_byid(SC_MOONPH); break;
-	}
+	if (dev->subtype < NROF_SUBTYPES && subtype_info[dev->subtype].arg >= 0)
+		return find_arg_byid(subtype_info[dev->subtype].arg);
 
 	LOG(LOG_ERROR, "find_arg_bydev got subtype/type %d/%d NOT IN TABLE",
 	    dev->subtype, dev->type);
@@ -215,166 +236,303 @@ int find_arg_bydev(device_t *dev)
 void init_argcomm(void)
 {
 	qsort((char *)argtable, args_size, sizeof(argtable_t), compare_argtable);
+	argtable_index();
 }
 
 /**
-   \brief parse a command from the network
-   \param words a list of words to parse
-   \param count how many words
-   \return a pargs_t of arguments
-   \note if this returns NULL, the command was invalid.
-   \note Frees words upon exit
+   \brief Make sure the line buffer can hold len bytes plus a NUL
+   \param np parser state
+   \param len length of line
 */
 
-pargs_t *parse_command(char  **words, int count)
+static void netparse_grow_line(netparse_t *np, size_t len)
 {
-	argtable_t *asp, dummy;
-	char *cp, *tmp, *p;
-	size_t span;
-	int i, numargs, cur;
-	pargs_t *args;
-
-	if (words == NULL || words[0] == NULL) {
-		for (i=0; i < count && words[i] != NULL; i++)
-			free(words[i]);
-		if (words != NULL)
-			free(words);
-		return(NULL);
-	}
+	size_t newsize;
+
+	if (len < np->linesize)
+		return;
+	newsize = (np->linesize) ? np->linesize : NETPARSE_LINESIZE;
+	while (newsize <= len)
+		newsize *= 2;
+	np->line = realloc(np->line, newsize);
+	if (np->line == NULL)
+		bailout();
+	np->linesize = newsize;
+}
+
+/**
+   \brief Make sure the args array can hold n entries plus a terminator
+   \param np parser state
+   \param n number of arguments
+*/
+
+static void netparse_grow_args(netparse_t *np, int n)
+{
+	int newsize;
+
+	if (n < np->argsize)
+		return;
+	newsize = (np->argsize) ? np->argsize : NETPARSE_ARGS;
+	while (newsize <= n)
+		newsize *= 2;
+	np->args = realloc(np->args, sizeof(pargs_t) * newsize);
+	if (np->args == NULL)
+		bailout();
+	np->argsize = newsize;
+}
 
-	/* the command is words[0], ignore it */
+/** \brief A piece of scratch that did not fit in the arena */
+typedef struct _netparse_spill_t {
+	struct _netparse_spill_t *next;	/**< \brief next spilled piece */
+	double align;			/**< \brief keep what follows aligned */
+} netparse_spill_t;
 
-	numargs = count;
+/** \brief round a scratch request up, so every piece stays aligned */
+#define NETPARSE_ALIGN(x)	(((x) + 7) & ~(size_t)7)
 
-	args = safer_malloc(sizeof(pargs_t)*numargs);
-	cur = 0;
-	for (i=1; i < count && words[i] != NULL && *words[i]; i++) {
-		span = strcspn(words[i], ":");
-		tmp = strchr(words[i], ':');
-		if (tmp == NULL)
-			continue;
-		tmp++;
-		cp = words[i];
-		cp[span] = '\0';
-		for (p=cp; *p; p++) {
-			*p = tolower(*p);
-		}
+/** \brief scratch for anything allocated before a line is parsed */
+static netparse_t idle_np;
+/** \brief parser state of the line being handled */
+static netparse_t *cur_np = &idle_np;
+/** \brief lines parsed, by every parser */
+uint64_t netparse_lines;
 
-		dummy.name = cp;
-		asp = (argtable_t *)bsearch((void *)&dummy, (void *)argtable,
-						args_size, sizeof(argtable_t),
-						compare_argtable);
-		if (asp) {
-			args[cur].cword = asp->num;
-			args[cur].type = asp->type;
-			switch (asp->type) {
-			case PTDOUBLE:
-				args[cur].arg.d = strtod(tmp, (char **)NULL);
-				break;
-			case PTFLOAT:
-				args[cur].arg.f = strtof(tmp, (char **)NULL);
-				break;
-			case PTCHAR:
-				args[cur].arg.c = strdup(tmp);
-				break;
-			case PTINT:
-				args[cur].arg.i = atoi(tmp);
-				break;
-			case PTUINT:
-				args[cur].arg.u =
-					strtoul(tmp, (char **)NULL, 10);
-				break;
-			case PTLONG:
-				args[cur].arg.l =
-					strtol(tmp, (char **)NULL, 10);
-			case PTLL:
-				args[cur].arg.ll =
-					strtoll(tmp, (char **)NULL, 10);
-				break;
-			}
-			cur++;
-		} else {
-			LOG(LOG_ERROR, "Invalid command recieved: %s", words[i]);
-		}
+/**
+   \brief Hand back all of a parser's scratch, and make it current
+   \param np parser state
+   \note If the last line spilled, the arena is grown to hold all of it,
+   so a connection settles on an arena big enough for what it sends.
+*/
+
+static void netparse_reset(netparse_t *np)
+{
+	netparse_spill_t *spill;
+	size_t want, newsize;
+
+	cur_np = np;
+	want = np->arenaused + np->spilled;
+	while ((spill = np->spill) != NULL) {
+		np->spill = spill->next;
+		free(spill);
 	}
+	np->arenaused = np->spilled = 0;
+	if (want <= np->arenasize)
+		return;
+	newsize = (np->arenasize) ? np->arenasize : NETPARSE_ARENA;
+	while (newsize < want)
+		newsize *= 2;
+	free(np->arena);
+	np->arena = safer_malloc(newsize);
+	np->arenasize = newsize;
+}
 
-	args[cur].cword = -1;
-	for (i=0; i < count && words[i] != NULL; i++)
-		free(words[i]);
-	free(words);
+/**
+   \brief Get scratch memory for handling the current line
+   \param size bytes wanted
+   \return memory, not zeroed, valid until the next line on the same
+   connection is parsed.  Never free it.
+*/
 
-	return(args);
+void *netparse_alloc(size_t size)
+{
+	netparse_t *np = cur_np;
+	netparse_spill_t *spill;
+	void *p;
+
+	size = NETPARSE_ALIGN(size);
+	if (np->arenaused + size <= np->arenasize) {
+		p = np->arena + np->arenaused;
+		np->arenaused += size;
+		return(p);
+	}
+	spill = safer_malloc(sizeof(netparse_spill_t) + size);
+	spill->next = np->spill;
+	np->spill = spill;
+	np->spilled += size;
+	return(spill + 1);
 }
 
 /**
-   \brief parse a string into a command
-   \param buf string to parse
-   \param arg_count how many words did we find?
-   \return a list of words
+   \brief Copy a string into scratch memory for the current line
+   \param s string to copy
+   \return the copy, see netparse_alloc()
 */
 
-char **parse_netcommand(char *buf, int *arg_count)
+char *netparse_strdup(const char *s)
 {
-	char **ret_str;
-	char *buf2 = 0, *buf2_head = 0;
-	int i = 0;
+	size_t len = strlen(s) + 1;
+
+	return(memcpy(netparse_alloc(len), s, len));
+}
+
+/**
+   \brief Pull one line off an evbuffer into the parser's line buffer
+   \param np parser state
+   \param evbuf buffer to read from
+   \param len filled in with the length of the line
+   \return the line, or NULL if no complete line is waiting
+   \note The line is owned by np, and is reused on the next call
+*/
 
-	if (!*buf)
-		return(0);
+char *netparse_readln(netparse_t *np, struct evbuffer *evbuf, size_t *len)
+{
+	struct evbuffer_ptr eol;
+	size_t eol_len;
 
-	buf2 = (char *)safer_malloc(strlen(buf)+1);
-	buf2_head = buf2;
-	ret_str = (char **)safer_malloc(sizeof(char *) * 2);
+	eol = evbuffer_search_eol(evbuf, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+	if (eol.pos < 0)
+		return(NULL);
 
-	for (;;) {
-		if (*buf == '\"') {
-			buf++;
-
-			while (*buf && *buf != '\"') {
-				if (*buf == '\\') {
-					buf++;
-
-					if (*buf == '\"')
-						*buf2++ = *buf++;
-					else {
-						buf--;
-						*buf2++ = *buf++;
-					}
-				} else
-					*buf2++ = *buf++;
-			}
+	netparse_grow_line(np, eol.pos);
+	if (eol.pos > 0)
+		evbuffer_remove(evbuf, np->line, eol.pos);
+	evbuffer_drain(evbuf, eol_len);
+	np->line[eol.pos] = '\0';
+	*len = eol.pos;
+	return(np->line);
+}
 
-			if (*buf == '\"')
-				buf++;
+/**
+   \brief parse a line from the network into a command and arguments
+   \param np parser state
+   \param line line to parse, this is tokenized in place
+   \param cmdword filled in with the command word
+   \return a cword -1 terminated pargs_t of arguments, NULL if line is empty
+   \note Nothing is allocated per line.  PTCHAR arguments and cmdword point
+   into line, and the returned args belong to np, so all of it is only
+   valid until the next call.  Anything a handler keeps must be strdup'd,
+   scratch it does not keep comes from netparse_alloc().
+*/
+
+pargs_t *parse_netline(netparse_t *np, char *line, char **cmdword)
+{
+	argtable_t *asp, dummy;
+	char *r, *w, *word, *val, *p;
+	int cur, first, done;
+	pargs_t *arg;
+
+	if (line == NULL || !*line)
+		return(NULL);
+
+	netparse_reset(np);
+	netparse_lines++;
+	netparse_grow_args(np, 0);
+	r = w = line;
+	cur = 0;
+	first = 1;
+	*cmdword = line;
+
+	for (;;) {
+		/* collapse the word down onto itself, stripping quotes */
+		word = w;
+		while (*r && *r != ' ') {
+			if (*r == '\"') {
+				r++;
+				while (*r && *r != '\"') {
+					if (*r == '\\' && *(r+1) == '\"')
+						r++;
+					*w++ = *r++;
+				}
+				if (*r == '\"')
+					r++;
+			} else
+				*w++ = *r++;
+		}
+		done = (*r == '\0');
+		*w++ = '\0';
+		if (!done) {
+			r++;
+			/* skip sequential whitespace */
+			while (*r == ' ')
+				r++;
 		}
 
-		if (*buf == ' ' || !*buf) {
-			*buf2 = '\0';
-			buf2 = buf2_head;
-			ret_str = (char **)realloc(ret_str, sizeof(char *) * (i + 1));
-			ret_str[i] = strdup(buf2);
-			buf2 = buf2_head;
-			i++;
-
-			if (!*buf) {
-				/* Free temporary buffer */
-				free(buf2);
-				*arg_count = i;
-				return(ret_str);
+		if (first) {
+			*cmdword = word;
+			first = 0;
+		} else if (*word == '\0') {
+			/* an empty word ends the argument list */
+			break;
+		} else if ((val = strchr(word, ':')) != NULL) {
+			*val++ = '\0';
+			for (p=word; *p; p++)
+				*p = tolower(*p);
+
+			dummy.name = word;
+			asp = (argtable_t *)bsearch((void *)&dummy,
+			    (void *)argtable, args_size, sizeof(argtable_t),
+			    compare_argtable);
+			if (asp) {
+				netparse_grow_args(np, cur + 1);
+				arg = &np->args[cur];
+				arg->cword = asp->num;
+				arg->type = asp->type;
+				arg->arg.ll = 0;
+				switch (asp->type) {
+				case PTDOUBLE:
+					arg->arg.d = strtod(val, (char **)NULL);
+					break;
+				case PTFLOAT:
+					arg->arg.f = strtof(val, (char **)NULL);
+					break;
+				case PTCHAR:
+					arg->arg.c = val;
+					break;
+				case PTINT:
+					arg->arg.i = atoi(val);
+					break;
+				case PTUINT:
+					arg->arg.u =
+					    strtoul(val, (char **)NULL, 10);
+					break;
+				case PTLONG:
+					arg->arg.l =
+					    strtol(val, (char **)NULL, 10);
+					break;
+				case PTLL:
+					arg->arg.ll =
+					    strtoll(val, (char **)NULL, 10);
+					break;
+				}
+				cur++;
 			} else {
-				buf++;
-				/* skip sequential whitespace */
-				while (*buf == ' ' && *buf)
-					*buf++;
+				LOG(LOG_ERROR, "Invalid command recieved: %s",
+				    word);
 			}
-		} else {
-			*buf2++ = *buf++;
 		}
+		if (done)
+			break;
 	}
-	LOG(LOG_ERROR, "Got to end of parse_netcommand without return");
-	return NULL;
+
+	np->args[cur].cword = -1;
+	return(np->args);
 }
 
+/**
+   \brief Free a parser state
+   \param np parser state to free
+*/
+
+void netparse_free(netparse_t *np)
+{
+	netparse_spill_t *spill;
+
+	if (np == NULL)
+		return;
+	if (cur_np == np)
+		cur_np = &idle_np;
+	while ((spill = np->spill) != NULL) {
+		np->spill = spill->next;
+		free(spill);
+	}
+	if (np->arena)
+		free(np->arena);
+	if (np->line)
+		free(np->line);
+	if (np->args)
+		free(np->args);
+	free(np);
+}
 
 /**
    \brief Find an argument in the args by it's ID
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file alarmlisten.c
+   \brief Alarm listeners, indexed by channel
+   \author Tim Rightnour
+
+   Each of the 32 alarm channels keeps the list of clients listening to
+   it, so a setalarm only visits the clients that listen to one of the
+   alarm's channels instead of every client connected.  A client on more
+   than one of those channels is told once, by stamping it with the number
+   of the fan-out that reached it.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "gnhast.h"
+#include "common.h"
+#include "gncoll.h"
+#include "gnhastd.h"
+
+#define ALARM_CHANNELS	32
+
+/** \brief a list of listening clients */
+typedef struct _listeners_t {
+	client_t **client;	/**< \brief the clients */
+	int n;			/**< \brief number of clients */
+	int size;		/**< \brief allocated size */
+} listeners_t;
+
+/** \brief listeners of each channel */
+static listeners_t chanlisteners[ALARM_CHANNELS];
+/** \brief everyone listening to any channel, they all hear clears */
+static listeners_t alllisteners;
+/** \brief number of the current fan-out */
+static uint32_t alarmgen;
+
+/**
+   \brief Add a client to a listener list
+   \param l list
+   \param client client
+*/
+
+static void listeners_add(listeners_t *l, client_t *client)
+{
+	if (l->n == l->size) {
+		l->size = (l->size) ? l->size * 2 : 16;
+		l->client = realloc(l->client, sizeof(client_t *) * l->size);
+		if (l->client == NULL)
+			bailout();
+	}
+	l->client[l->n++] = client;
+}
+
+/**
+   \brief Remove a client from a listener list
+   \param l list
+   \param client client
+*/
+
+static void listeners_remove(listeners_t *l, client_t *client)
+{
+	int i;
+
+	for (i = 0; i < l->n; i++)
+		if (l->client[i] == client) {
+			l->client[i] = l->client[--l->n];
+			return;
+		}
+}
+
+/**
+   \brief Stop a client listening to alarms
+   \param client client
+*/
+
+void alarm_unlisten(client_t *client)
+{
+	int i;
+
+	if (client->alarmwatch == 0)
+		return;
+	for (i = 0; i < ALARM_CHANNELS; i++)
+		if (QUERY_FLAG(client->alchan, i))
+			listeners_remove(&chanlisteners[i], client);
+	listeners_remove(&alllisteners, client);
+	client->alarmwatch = 0;
+}
+
+/**
+   \brief Start a client listening to alarms
+   \param client client
+   \param alsev lowest severity it wants, 0 to stop listening
+   \param alchan channels it wants
+*/
+
+void alarm_listen(client_t *client, int alsev, uint32_t alchan)
+{
+	int i;
+
+	alarm_unlisten(client);
+	client->alarmwatch = alsev;
+	client->alchan = alchan;
+	if (alsev == 0)
+		return;
+	for (i = 0; i < ALARM_CHANNELS; i++)
+		if (QUERY_FLAG(alchan, i))
+			listeners_add(&chanlisteners[i], client);
+	listeners_add(&alllisteners, client);
+}
+
+/**
+   \brief Tell the listeners about a changed alarm
+   \param alarm the alarm, NULL if it was cleared
+   \param aluid uid of the alarm
+*/
+
+void alarm_tell(alarm_t *alarm, char *aluid)
+{
+	client_t *tell;
+	int i, j;
+
+	if (alarm == NULL) { /* the alarm has been unset, tell everyone */
+		for (j = 0; j < alllisteners.n; j++)
+			if (alllisteners.client[j]->alarmwatch > 0)
+				gn_setalarm(alllisteners.client[j]->ev, aluid,
+					    "", 0, ALL_FLAGS_SET);
+		return;
+	}
+
+	alarmgen++;
+	for (i = 0; i < ALARM_CHANNELS; i++) {
+		if (!QUERY_FLAG(alarm->alchan, i))
+			continue;
+		for (j = 0; j < chanlisteners[i].n; j++) {
+			tell = chanlisteners[i].client[j];
+			if (tell->alarmgen == alarmgen)
+				continue;
+			tell->alarmgen = alarmgen;
+			if (tell->alarmwatch <= alarm->alsev &&
+			    tell->alarmwatch != 0)
+				gn_setalarm(tell->ev, alarm->aluid,
+					    alarm->altext, alarm->alsev,
+					    alarm->alchan);
+		}
+	}
+}
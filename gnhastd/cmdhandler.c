@@ -49,6 +49,8 @@ extern TAILQ_HEAD(, _device_t) alldevs;
 extern TAILQ_HEAD(, _device_group_t) allgroups;
 extern TAILQ_HEAD(, _client_t) clients;
 extern TAILQ_HEAD(, _alarm_t) alarms;
+extern int nrofselectors;
+extern int devgroups_dirty;
 /** \endcond */
 
 /**
@@ -71,12 +73,20 @@ extern argtable_t argtable[];
      \arg chg uid:XXX humid:Y
     \sapi reg - Register a device with the server, or, tell the collector about a device
      \arg reg uid:XXX name:"A device" subtype:5 type:1
+     \arg reg uid:XXX name:"A device" subtype:5 type:1 hdl:0 (reply with a handle)
     \sapi regg - Register a group with the server, or, tell the collector about a group
-    \sapi upd - Update the status of a device. Sent to, and by the server
+    \sapi upd - Update the status of a device. Sent to, and by the server. A hdl argument may stand in for the uid.
+     \arg upd hdl:N temp:Y
+    \sapi mupd - Update the status of many devices in one line. Each uid (or hdl) argument starts a new device. Sent to the server.
+     \arg mupd uid:XXX temp:Y hdl:N humid:W
     \sapi mod - Modify a setting of a device. (Currently only name, rrdname, hargs, and handler). Sent to and by the server.
     \sapi feed - Request a continuous stream of updates from the server for a particular device. rate argument sets the update speed in seconds. Updates are sent via the upd comamnd.
     \sapi cfeed - Request a stream of updates whenever the device changes state.
+     \arg cfeed glist:kitchen (also tags:XXX, uid:28.*, devt:N, subt:N, on feed and ask too)
+     \arg cfeed uid:XXX dband:0.5 hbeat:300 (also dbpct:N, on feed and with selectors too)
     \sapi ldevs - Request a list of devices from the server. Can give it arguments such as protocol, type, etc, to narrow the list. Devices are sent back to the collector as reg commands.
+    \sapi snapshot - Request the current value of every device, as snap lines, ending with endsnap. Takes the same qualifiers as ldevs, plus glist, tags and scale.
+     \arg snapshot glist:kitchen scale:1
     \sapi lgrps - Request a list of groups from the server. Groups are sent back as regg commands.
     \sapi ask - Ask for a single upd on a device, or devices
     \sapi askf - Ask, but with full device details
@@ -88,6 +98,10 @@ extern argtable_t argtable[];
     \sapi setalarm - Set, or clear an alarm, or edit details of an alarm
     \sapi listenalarms - Listen to an alarm channel for new alarms
     \sapi dumpalarms - Dump all, or some of the alarms
+    \sapi alarmhist - Recent alarm changes, as alarmhist lines, ending with endalarmhist. Takes aluid, alsev, alchan and number (how many)
+     \arg alarmhist alchan:8 number:20
+    \sapi hist - Recent values of a device, as hist lines, ending with endhist. Takes uid (or hdl), since (time) and max (how many)
+     \arg hist uid:XXX since:1400000000 max:100
     \sapi getapiv - Ask for the API version from gnhastd
 */
 
@@ -97,11 +111,13 @@ commands_t commands[] = {
     {"reg", cmd_register, 0}, /** \brief Register a device */
     {"regg", cmd_register_group, 0}, /** \brief Register a group */
     {"upd", cmd_update, 0}, /** \brief Update a device */
+    {"mupd", cmd_multi_update, 0}, /** \brief Update many devices */
     {"mod", cmd_modify, 0}, /** \brief Modify a device */
     {"feed", cmd_feed, 0}, /** \brief Start a feed for a device */
     {"cfeed", cmd_cfeed, 0}, /** \brief Start a change-only feed */
     {"ldevs", cmd_list_devices, 0}, /** \brief list devices */
     {"lgrps", cmd_list_groups, 0}, /** \brief list groups */
+    {"snapshot", cmd_snapshot, 0}, /** \brief values of many devices */
     {"ask", cmd_ask_device, 0}, /** \brief ask about a device */
     {"askf", cmd_ask_full_device, 0}, /** \brief ask for full details */
     {"cactiask", cmd_cactiask_device, 0}, /** \brief ask in cacti format */
@@ -112,6 +128,8 @@ commands_t commands[] = {
     {"setalarm", cmd_setalarm, 0}, /** \brief set or clear alarm details */
     {"listenalarms", cmd_listen_alarms, 0}, /** \brief listen to an alarm channel */
     {"dumpalarms", cmd_dump_alarms, 0}, /** \brief dump all alarms */
+    {"alarmhist", cmd_alarm_history, 0}, /** \brief recent alarm changes */
+    {"hist", cmd_history, 0}, /** \brief recent values of a device */
     {"getapiv", cmd_get_apiv, 0}, /** \brief get server api version */
 };
 
@@ -161,6 +179,339 @@ int parsed_command(char *command, pargs_t *args, void *arg)
 /* ================================ */
 /* Handlers */
 
+/**
+   \brief Find the device a uid: or hdl: argument names
+   \param arg the argument
+   \return device_t * if found, NULL if not
+*/
+
+static device_t *find_device_byarg(pargs_t *arg)
+{
+    if (arg->cword == SC_HANDLE)
+	return find_device_byhandle(arg->arg.u);
+    return find_device_byuid(arg->arg.c);
+}
+
+/**
+   \brief Pick the deadband arguments out of a feed or cfeed
+   \param args The list of arguments
+   \param db deadband to fill in, turned on if any were given
+*/
+
+void parse_deadband(pargs_t *args, deadband_t *db)
+{
+    int i;
+
+    for (i=0; args[i].cword != -1; i++)
+	switch (args[i].cword) {
+	case SC_DEADBAND:
+	    db->absband = args[i].arg.d;
+	    db->on = 1;
+	    break;
+	case SC_DBPCT:
+	    db->pctband = args[i].arg.d;
+	    db->on = 1;
+	    break;
+	case SC_HEARTBEAT:
+	    db->heartbeat = (args[i].arg.i > 0) ? args[i].arg.i : 0;
+	    db->on = 1;
+	    break;
+	}
+}
+
+/**
+   \brief Log an update for a device we do not know about
+   \param arg the uid: or hdl: argument naming it
+*/
+
+static void log_unknown_device(pargs_t *arg)
+{
+    if (arg->cword == SC_HANDLE)
+	LOG(LOG_ERROR, "Handle %u doesn't exist", arg->arg.u);
+    else
+	LOG(LOG_ERROR, "UID:%s doesn't exist", arg->arg.c);
+}
+
+/**
+   \brief Store the data arguments of an update into a device
+   \param dev device being updated
+   \param args arguments to store
+   \param nrofargs number of arguments in args to look at
+   \param client client that sent the update
+*/
+
+static void update_device_data(device_t *dev, pargs_t *args, int nrofargs,
+			       client_t *client)
+{
+    int i;
+    int hadnodata = 0;
+
+    /* check if the device was unknown at the time */
+    if (QUERY_FLAG(dev->flags, DEVFLAG_NODATA))
+	hadnodata = 1;
+
+    /* Ok, we got one, now lets update it's data */
+
+    for (i=0; i < nrofargs && args[i].cword != -1; i++)
+	if (arg_is_data(args[i].cword))
+	    store_data_dev(dev, DATALOC_DATA, &args[i].arg);
+    (void)time(&dev->last_upd);
+    client->updates++;
+
+    /* Always run handler on first update */
+    if (dev->handler != NULL && (device_watermark(dev) != 0 || hadnodata))
+	run_handler_dev(dev);
+    rules_eval(dev);
+}
+
+/** \brief update lines rendered for watchers */
+uint32_t fanout_renders = 0;
+/** \brief update lines sent to watchers, renders shared via reference */
+uint32_t fanout_sends = 0;
+/** \brief output backlog, in bytes, past which watcher updates coalesce */
+size_t client_hiwat = 0;
+
+/**
+   \brief Render a device update once, so it can be shared by watchers
+   \param dev device to render
+   \param what GNC_UPD_* bits describing what to send
+   \return evbuffer holding the line, NULL if it could not be built
+*/
+
+static struct evbuffer *render_update(device_t *dev, int what)
+{
+    struct evbuffer *line;
+
+    line = evbuffer_new();
+    if (gn_build_update(dev, what, line) != 0) {
+	evbuffer_free(line);
+	return NULL;
+    }
+    fanout_renders++;
+    return line;
+}
+
+/**
+   \brief How much output is waiting to go to a client
+   \param client client to check
+   \return bytes queued, including any batched for an I/O thread
+*/
+
+size_t client_backlog(client_t *client)
+{
+    size_t len = evbuffer_get_length(bufferevent_get_output(client->ev));
+
+    if (client->outbox != NULL)
+	len += evbuffer_get_length(client->outbox);
+    return len;
+}
+
+/**
+   \brief Hold back an update from a watcher that is backed up
+   \param dwatch the watcher's entry on the device
+   \return 1 if the update was deferred, 0 if it should be sent now
+   \note Once a watcher is past client_hiwat, the device is put on its
+   pending list, and the latest value goes out when the backlog drains.
+   Further updates to a pending device are folded into it.
+*/
+
+static int defer_update(wrap_client_t *dwatch)
+{
+    client_t *client = dwatch->client;
+
+    if (dwatch->pending) {
+	client->coalesced++;
+	return 1;
+    }
+    if (client_hiwat == 0 || client_backlog(client) < client_hiwat)
+	return 0;
+    if (TAILQ_EMPTY(&client->pending))
+	TAILQ_INIT(&client->pending);
+    TAILQ_INSERT_TAIL(&client->pending, dwatch, next_pending);
+    dwatch->pending = 1;
+    if (client->thr != NULL)
+	flush_pending_updates(client); /* arms the drain notification */
+    return 1;
+}
+
+/**
+   \brief Queue a rendered update on a client, without copying it
+   \param client client to send to
+   \param line rendered line from render_update()
+*/
+
+static void send_rendered(client_t *client, struct evbuffer *line)
+{
+    struct evbuffer *out;
+
+    if (client->thr != NULL) {
+	/* copied, a reference would share line's chains between threads */
+	evbuffer_add(netthread_outbox(client), evbuffer_pullup(line, -1),
+		     evbuffer_get_length(line));
+    } else {
+	out = bufferevent_get_output(client->ev);
+	if (evbuffer_add_buffer_reference(out, line) != 0)
+	    evbuffer_add(out, evbuffer_pullup(line, -1),
+			 evbuffer_get_length(line));
+    }
+    fanout_sends++;
+    client->sentdata++;
+}
+
+/**
+   \brief Is a client watching a device directly, through a plain cfeed?
+   \param client client to look for
+   \param dev device to look on
+   \return bool
+*/
+
+static int client_watches(client_t *client, device_t *dev)
+{
+    wrap_client_t *dwatch;
+
+    TAILQ_FOREACH(dwatch, &dev->watchers, next)
+	if (dwatch->client == client)
+	    return 1;
+    return 0;
+}
+
+/**
+   \brief Send an update to every client with a cfeed selector matching it
+   \param dev device that updated
+   \param line the rendered update, rendered here if still NULL
+   \note Each client gets the device once, however many of its selectors
+   match, and not at all if it also watches the device directly.  A
+   backed up client does not get a pending entry per device; instead it
+   is marked for a resync, and gets every selected device once it drains.
+*/
+
+static void notify_selectors(device_t *dev, struct evbuffer **line)
+{
+    client_t *client, **sclients;
+    int i, n;
+
+    if (nrofselectors == 0)
+	return;
+    n = selecting_clients(dev, &sclients);
+    for (i=0; i < n; i++) {
+	client = sclients[i];
+	if (client_watches(client, dev))
+	    continue;
+	if (client->resync) {
+	    client->coalesced++;
+	    continue;
+	}
+	if (client_hiwat > 0 && client_backlog(client) >= client_hiwat) {
+	    client->resync = 1;
+	    client->coalesced++;
+	    if (client->thr != NULL)
+		flush_pending_updates(client); /* arms the drain notification */
+	    continue;
+	}
+	if (!client_selector_deadband(client, dev))
+	    continue;
+	if (*line == NULL && (*line = render_update(dev, GNC_UPD_RRDNAME)) == NULL)
+	    return;
+	send_rendered(client, *line);
+    }
+}
+
+/**
+   \brief Send a client the current value of every device it selects
+   \param client client to send to
+*/
+
+static void resync_selectors(client_t *client)
+{
+    device_t *dev;
+    struct evbuffer *send;
+
+    send = gn_reply_begin(client->ev);
+    TAILQ_FOREACH(dev, &alldevs, next_all)
+	if (client_selects(client, dev) && !client_watches(client, dev) &&
+	    gn_build_update(dev, GNC_UPD_RRDNAME, send) == 0)
+	    client->sentdata++;
+    gn_reply_end(client->ev);
+}
+
+/**
+   \brief Send a backed up client the latest value of its pending devices
+   \param client client whose output has drained
+   \note A client on an I/O thread is drained by that thread, so if
+   anything is left pending we ask to be told when it drains again.  The
+   I/O thread may beat us to it, so look again after asking.
+*/
+
+void flush_pending_updates(client_t *client)
+{
+    struct evbuffer *out = bufferevent_get_output(client->ev);
+    wrap_client_t *dwatch;
+
+    /* anything batched is older than what we are about to send */
+    if (client->thr != NULL)
+	netthread_flush(client);
+    for (;;) {
+	while ((dwatch = TAILQ_FIRST(&client->pending)) != NULL &&
+	       evbuffer_get_length(out) < client_hiwat) {
+	    TAILQ_REMOVE(&client->pending, dwatch, next_pending);
+	    dwatch->pending = 0;
+	    gn_update_device(dwatch->dev, GNC_UPD_RRDNAME, client->ev);
+	    client->sentdata++;
+	}
+	if (TAILQ_EMPTY(&client->pending) && client->resync &&
+	    evbuffer_get_length(out) < client_hiwat) {
+	    client->resync = 0;
+	    resync_selectors(client);
+	}
+	if ((TAILQ_EMPTY(&client->pending) && !client->resync) ||
+	    client->thr == NULL)
+	    return;
+	netthread_want_drain(client);
+	if (evbuffer_get_length(out) >= client_hiwat)
+	    return;
+    }
+}
+
+/**
+   \brief Tell everyone watching a device about its new value
+   \param dev device that was updated
+*/
+
+void notify_watchers(device_t *dev)
+{
+    wrap_client_t *dwatch;
+    struct evbuffer *line;
+
+    /* look for clients watching us, and update them */
+    line = NULL;
+    TAILQ_FOREACH(dwatch, &dev->watchers, next) {
+	if (!deadband_check(dev, &dwatch->db) || defer_update(dwatch))
+	    continue;
+	if (line == NULL && (line = render_update(dev, GNC_UPD_RRDNAME)) == NULL)
+	    break;
+	send_rendered(dwatch->client, line);
+    }
+    notify_selectors(dev, &line);
+    if (line != NULL)
+	evbuffer_free(line);
+}
+
+/**
+   \brief A timer device counted down to zero
+   \param dev timer device
+   \note Watchers get the zero, and the handler runs, as if a collector
+   had sent it.
+*/
+
+void timerdev_done(device_t *dev)
+{
+    (void)time(&dev->last_upd);
+    if (dev->handler != NULL)
+	run_handler_dev(dev);
+    rules_eval(dev);
+    notify_watchers(dev);
+}
+
 /**
    \brief Handle a update device command
    \param args The list of arguments
@@ -170,93 +521,105 @@ int parsed_command(char *command, pargs_t *args, void *arg)
 int cmd_update(pargs_t *args, void *arg)
 {
     int i;
-    int hadnodata = 0;
     device_t *dev;
-    char *uid=NULL;
+    pargs_t *devarg=NULL;
     client_t *client = (client_t *)arg;
-    wrap_client_t *dwatch;
 
-    /* loop through the args and find the UID */
+    /* loop through the args and find the UID or handle */
     for (i=0; args[i].cword != -1; i++) {
 	switch (args[i].cword) {
 	case SC_UID:
-	    uid = args[i].arg.c;
+	case SC_HANDLE:
+	    devarg = &args[i];
 	    break;
 	}
     }
-    if (!uid) {
+    if (!devarg) {
 	LOG(LOG_ERROR, "update without UID");
 	return(-1);
     }
-    dev = find_device_byuid(uid);
+    dev = find_device_byarg(devarg);
     if (!dev) {
-	LOG(LOG_ERROR, "UID:%s doesn't exist", uid);
+	log_unknown_device(devarg);
 	return(-1);
     }
 
-    /* check if the device was unknown at the time */
-    if (QUERY_FLAG(dev->flags, DEVFLAG_NODATA))
-	hadnodata = 1;
+    update_device_data(dev, args, i, client);
+    notify_watchers(dev);
 
-    /* Ok, we got one, now lets update it's data */
+    return(0);
+}
 
-    for (i=0; args[i].cword != -1; i++) {
-	switch (args[i].cword) {
-	case SC_SWITCH:
-	case SC_WEATHER:
-	case SC_ALARMSTATUS:
-	case SC_THMODE:
-	case SC_THSTATE:
-	case SC_SMNUMBER:
-	case SC_COLLECTOR:
-	case SC_BLIND:
-	case SC_DAYLIGHT:
-	case SC_TRISTATE:
-	    store_data_dev(dev, DATALOC_DATA, &args[i].arg.i);
-	    break;
-	case SC_LUX:
-	case SC_HUMID:
-	case SC_TEMP:
-	case SC_DIMMER:
-	case SC_PRESSURE:
-	case SC_SPEED:
-	case SC_DIR:
-	case SC_PH:
-	case SC_WETNESS:
-	case SC_VOLTAGE:
-	case SC_WATT:
-	case SC_AMPS:
-	case SC_PERCENTAGE:
-	case SC_FLOWRATE:
-	case SC_DISTANCE:
-	case SC_VOLUME:
-	case SC_ORP:
-	case SC_SALINITY:
-	case SC_MOONPH:
-	    store_data_dev(dev, DATALOC_DATA, &args[i].arg.d);
-	    break;
-	case SC_COUNT:
-	case SC_TIMER:
-	case SC_TRIGGER:
-	    store_data_dev(dev, DATALOC_DATA, &args[i].arg.u);
-	    break;
-	case SC_WATTSEC:
-	case SC_NUMBER:
-	    store_data_dev(dev, DATALOC_DATA, &args[i].arg.ll);
-	    break;
-	}
+/** \brief devices touched by the current mupd */
+static device_t **mupd_devs;
+/** \brief allocated size of mupd_devs */
+static int mupd_size;
+
+/**
+   \brief Make sure the mupd scratch array can hold n entries
+   \param n number of entries needed
+*/
+
+static void mupd_grow(int n)
+{
+    if (n <= mupd_size)
+	return;
+    while (mupd_size < n)
+	mupd_size = (mupd_size) ? mupd_size * 2 : GN_MUPD_MAX;
+    mupd_devs = realloc(mupd_devs, sizeof(device_t *) * mupd_size);
+    if (mupd_devs == NULL)
+	bailout();
+}
+
+/**
+   \brief Handle a multiple device update command
+   \param args The list of arguments
+   \param arg void pointer to client_t of provider
+   \note Each uid: (or hdl:) argument starts a new device, and the
+   arguments that follow it, up to the next uid: or hdl:, are that
+   device's data.  All the data is stored first, then each device in the
+   batch is sent to its watchers once, with its final value, however many
+   times the batch named it.
+*/
+
+int cmd_multi_update(pargs_t *args, void *arg)
+{
+    int i, j, start, ndevs;
+    device_t *dev;
+    client_t *client = (client_t *)arg;
+
+    ndevs = 0;
+    for (i=0; args[i].cword != -1 && args[i].cword != SC_UID &&
+	     args[i].cword != SC_HANDLE; i++)
+	;
+    if (args[i].cword == -1) {
+	LOG(LOG_ERROR, "mupd without UID");
+	return(-1);
     }
-    (void)time(&dev->last_upd);
-    client->updates++;
 
-    /* Always run handler on first update */
-    if (dev->handler != NULL && (device_watermark(dev) != 0 || hadnodata))
-	run_handler_dev(dev);
+    while (args[i].cword == SC_UID || args[i].cword == SC_HANDLE) {
+	start = i++;
+	while (args[i].cword != -1 && args[i].cword != SC_UID &&
+	       args[i].cword != SC_HANDLE)
+	    i++;
+	dev = find_device_byarg(&args[start]);
+	if (!dev) {
+	    log_unknown_device(&args[start]);
+	    continue;
+	}
+	update_device_data(dev, &args[start+1], i - start - 1, client);
 
-    /* look for clients watching us, and update them */
-    TAILQ_FOREACH(dwatch, &dev->watchers, next) {
-	gn_update_device(dev, GNC_UPD_RRDNAME, dwatch->client->ev);
-	dwatch->client->sentdata++;
+	/* remember each device once, it is marked until the batch is sent */
+	if (dev->onq & DEVONQ_MUPD)
+	    continue;
+	dev->onq |= DEVONQ_MUPD;
+	mupd_grow(ndevs + 1);
+	mupd_devs[ndevs++] = dev;
+    }
+
+    for (j=0; j < ndevs; j++) {
+	mupd_devs[j]->onq &= ~DEVONQ_MUPD;
+	notify_watchers(mupd_devs[j]);
     }
 
     return(0);
@@ -293,8 +656,13 @@ int cmd_change(pargs_t *args, void *arg)
 	LOG(LOG_ERROR, "UID:%s doesn't exist", uid);
 	return(-1);
     }
+    if (dev->collector == NULL) {
+	LOG(LOG_ERROR, "Got chg for uid:%s, but no collector",
+	    dev->uid);
+	return(-1);
+    }
 
-    send = evbuffer_new();
+    send = gn_reply_begin(dev->collector->ev);
     /* The command to change is "chg" */
     evbuffer_add_printf(send, "chg ");
 
@@ -302,72 +670,53 @@ int cmd_change(pargs_t *args, void *arg)
     evbuffer_add_printf(send, "%s:%s", ARGNM(SC_UID), dev->uid);
 
     for (i=0; args[i].cword != -1; i++) {
-	switch (args[i].cword) {
-	case SC_WEATHER:
-	case SC_SWITCH:
-	case SC_ALARMSTATUS:
-	case SC_THMODE:
-	case SC_THSTATE:
-	case SC_SMNUMBER:
-	case SC_COLLECTOR:
-	case SC_BLIND:
-	case SC_DAYLIGHT:
-	case SC_TRISTATE:
+	if (!arg_is_data(args[i].cword))
+	    continue;
+	switch (args[i].type) {
+	case PTINT:
 	    evbuffer_add_printf(send, " %s:%d",
 				ARGNM(args[i].cword),
 				args[i].arg.i);
 	    break;
-	case SC_LUX:
-	case SC_HUMID:
-	case SC_TEMP:
-	case SC_DIMMER:
-	case SC_PRESSURE:
-	case SC_SPEED:
-	case SC_DIR:
-	case SC_PH:
-	case SC_WETNESS:
-	case SC_VOLTAGE:
-	case SC_WATT:
-	case SC_AMPS:
-	case SC_PERCENTAGE:
-	case SC_FLOWRATE:
-	case SC_DISTANCE:
-	case SC_VOLUME:
-	case SC_ORP:
-	case SC_SALINITY:
-	case SC_MOONPH:
+	case PTDOUBLE:
 	    evbuffer_add_printf(send, " %s:%f",
 				ARGNM(args[i].cword),
 				args[i].arg.d);
 	    store_data_dev(dev, DATALOC_DATA, &args[i].arg.d);
 	    break;
-	case SC_COUNT:
-	case SC_TIMER:
-	case SC_TRIGGER:
-	    evbuffer_add_printf(send, " %s:%d",
+	case PTUINT:
+	    evbuffer_add_printf(send, " %s:%u",
 				ARGNM(args[i].cword),
 				args[i].arg.u);
 	    break;
-	case SC_WATTSEC:
-	case SC_NUMBER:
+	case PTLL:
 	    evbuffer_add_printf(send, " %s:%jd",
 				ARGNM(args[i].cword),
 				args[i].arg.ll);
 	    break;
 	}
     }
-    if (dev->collector == NULL) {
-	LOG(LOG_ERROR, "Got chg for uid:%s, but no collector",
-	    dev->uid);
-	return(-1);
-    }
     /* and send it on it's way */
     evbuffer_add_printf(send, "\n");
-    bufferevent_write_buffer(dev->collector->ev, send);
+    gn_reply_end(dev->collector->ev);
 
     return(0);
 }
 
+/**
+   \brief Do two strings differ?
+   \param a string, or NULL
+   \param b string, or NULL
+   \return bool
+*/
+
+static int strdiff(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+	return a != b;
+    return strcmp(a, b) != 0;
+}
+
 /**
    \brief Handle a register device command
    \param args The list of arguments
@@ -376,22 +725,26 @@ int cmd_change(pargs_t *args, void *arg)
 
 int cmd_register(pargs_t *args, void *arg)
 {
-    int i, new=0;
+    int i, new=0, wanthandle=0;
     uint8_t devtype=0, proto=0, subtype=0, scale=0;
     char *uid=NULL, *name=NULL, *rrdname=NULL;
     device_t *dev;
     client_t *client = (client_t *)arg;
+    struct evbuffer *send;
 
     for (i=0; args[i].cword != -1; i++) {
 	switch (args[i].cword) {
 	case SC_UID:
-	    uid = strdup(args[i].arg.c);
+	    uid = args[i].arg.c;
 	    break;
 	case SC_NAME:
-	    name = strdup(args[i].arg.c);
+	    name = args[i].arg.c;
 	    break;
 	case SC_RRDNAME:
-	    rrdname = strndup(args[i].arg.c, 19);
+	    /* the args are ours to scribble on, rrdnames are 19 max */
+	    rrdname = args[i].arg.c;
+	    if (strlen(rrdname) > 19)
+		rrdname[19] = '\0';
 	    break;
 	case SC_DEVTYPE:
 	    devtype = (uint8_t)args[i].arg.i;
@@ -405,6 +758,9 @@ int cmd_register(pargs_t *args, void *arg)
 	case SC_SCALE:
 	    scale = (uint8_t)args[i].arg.i;
 	    break;
+	case SC_HANDLE:
+	    wanthandle = 1;
+	    break;
 	}
     }
 
@@ -427,15 +783,30 @@ int cmd_register(pargs_t *args, void *arg)
 		"without full specifications");
 	    return(-1);
 	}
-	if (rrdname == NULL)
-	    rrdname = mk_rrdname(name);
 	dev = smalloc(device_t);
-	dev->uid = uid;
+	dev->uid = strdup(uid);
+	if (rrdname == NULL)
+	    rrdname = dev->rrdname = mk_rrdname(name);
 	new = 1;
     } else
 	LOG(LOG_DEBUG, "Updating existing device uid:%s", uid);
-    dev->name = name;
-    dev->rrdname = rrdname;
+
+    /* collectors re-register on every connect, only note real changes */
+    if (new || dev->type != devtype || dev->proto != proto ||
+	dev->subtype != subtype || dev->scale != scale ||
+	strdiff(dev->name, name) || strdiff(dev->rrdname, rrdname)) {
+	SET_FLAG(dev->flags, DEVFLAG_DIRTY);
+	if (!new)
+	    selectors_changed(); /* type or subtype may have moved */
+    }
+    if (strdiff(dev->name, name)) {
+	free(dev->name);
+	dev->name = (name) ? strdup(name) : NULL;
+    }
+    if (strdiff(dev->rrdname, rrdname)) {
+	free(dev->rrdname);
+	dev->rrdname = (rrdname) ? strdup(rrdname) : NULL;
+    }
     dev->type = devtype;
     dev->proto = proto;
     dev->subtype = subtype;
@@ -463,6 +834,14 @@ int cmd_register(pargs_t *args, void *arg)
     if (new)
 	insert_device(dev);
 
+    /* the collector can use this instead of the uid from now on */
+    if (wanthandle) {
+	send = gn_reply_begin(client->ev);
+	evbuffer_add_printf(send, "hdl %s:%s %s:%u\n", ARGNM(SC_UID),
+			    dev->uid, ARGNM(SC_HANDLE), dev->handle);
+	gn_reply_end(client->ev);
+    }
+
     return(0);
 }
 
@@ -486,16 +865,16 @@ int cmd_register_group(pargs_t *args, void *arg)
     for (i=0; args[i].cword != -1; i++) {
 	switch (args[i].cword) {
 	case SC_UID:
-	    uid = strdup(args[i].arg.c);
+	    uid = args[i].arg.c;
 	    break;
 	case SC_NAME:
-	    name = strdup(args[i].arg.c);
+	    name = args[i].arg.c;
 	    break;
 	case SC_GROUPLIST:
-	    grouplist = strdup(args[i].arg.c);
+	    grouplist = args[i].arg.c;
 	    break;
 	case SC_DEVLIST:
-	    devlist = strdup(args[i].arg.c);
+	    devlist = args[i].arg.c;
 	    break;
 	}
     }
@@ -521,11 +900,14 @@ int cmd_register_group(pargs_t *args, void *arg)
     } else
 	LOG(LOG_DEBUG, "Updating existing device group uid:%s", uid);
 
-    if (name != NULL)
-	devgrp->name = name;
+    if (name != NULL && strdiff(devgrp->name, name)) {
+	free(devgrp->name);
+	devgrp->name = strdup(name);
+    }
 
+    /* strtok eats the lists, so walk a scratch copy, refilled each pass */
     if (grouplist != NULL) {
-	tmpbuf = strdup(grouplist);
+	tmpbuf = netparse_strdup(grouplist);
 	for (p = strtok(tmpbuf, ","); p; p = strtok(NULL, ",")) {
 	    cgrp = find_devgroup_byuid(p);
 	    if (cgrp == NULL)
@@ -538,12 +920,11 @@ int cmd_register_group(pargs_t *args, void *arg)
 		    "group %s", cgrp->uid, uid);
 	    }
 	}
-	free(tmpbuf);
 	/* Now look for groups that no longer belong */
 	TAILQ_FOREACH(wrapg, &devgrp->children, nextg) {
 	    LOG(LOG_DEBUG, "Working on: %s", wrapg->group->uid);
 	    found = 0;
-	    tmpbuf = strdup(grouplist);
+	    strcpy(tmpbuf, grouplist);
 	    for (p = strtok(tmpbuf, ","); p;
 		 p = strtok(NULL, ",")) {
 		if (strcmp(p, wrapg->group->uid) == 0) {
@@ -556,13 +937,11 @@ int cmd_register_group(pargs_t *args, void *arg)
 		    "%s", wrapg->group->uid, devgrp->uid);
 		remove_group_group(wrapg->group, devgrp);
 	    }
-	    free(tmpbuf);
 	}
-	free(grouplist);
     }
 
     if (devlist != NULL) {
-	tmpbuf = strdup(devlist);
+	tmpbuf = netparse_strdup(devlist);
 	for (p = strtok(tmpbuf, ","); p; p = strtok(NULL, ",")) {
 	    dev = find_device_byuid(p);
 	    if (dev == NULL)
@@ -575,10 +954,9 @@ int cmd_register_group(pargs_t *args, void *arg)
 		    "group %s", dev->uid, uid);
 	    }
 	}
-	free(tmpbuf);
 	TAILQ_FOREACH(wrap, &devgrp->members, next) {
 	    found = 0;
-	    tmpbuf = strdup(devlist);
+	    strcpy(tmpbuf, devlist);
 	    for (p = strtok(tmpbuf, ","); p;
 		 p = strtok(NULL, ",")) {
 		if ((strlen(p) == strlen(wrap->dev->uid)) &&
@@ -592,10 +970,10 @@ int cmd_register_group(pargs_t *args, void *arg)
 		    "%s", wrap->dev->uid, devgrp->uid);
 		remove_dev_group(wrap->dev, devgrp);
 	    }
-	    free(tmpbuf);
 	}
-	free(devlist);
     }
+    devgroups_dirty = 1;
+    selectors_changed();
 
     return(0);
 }
@@ -640,7 +1018,11 @@ int cmd_modify(pargs_t *args, void *arg)
 	return(-1);
     }
 
-    send = evbuffer_new();
+    /* the changes are made even if there is nobody to pass them on to */
+    if (dev->collector != NULL)
+	send = gn_reply_begin(dev->collector->ev);
+    else
+	send = evbuffer_new();
     /* The command to modify is "mod" */
     evbuffer_add_printf(send, "mod ");
 
@@ -715,6 +1097,7 @@ int cmd_modify(pargs_t *args, void *arg)
 	    break;
 	case SC_TAGS:
 	    parse_tags(dev, args[i].arg.c);
+	    selectors_changed();
 	    LOG(LOG_NOTICE, "Tags uid:%s changed to %s,"
 		" %d arguments", dev->uid, args[i].arg.c,
 		dev->nroftags);
@@ -743,47 +1126,23 @@ int cmd_modify(pargs_t *args, void *arg)
 	    break;
 	}
     }
-    /* force a device conf rewrite */
-    devconf_dump_cb(0, 0, 0);
     /* XXX send to wrapped devices? */
     if (dev->collector == NULL) {
 	LOG(LOG_WARNING, "Got mod for uid:%s, but no collector",
 	    dev->uid);
-	return(0);
+	evbuffer_free(send);
+    } else {
+	/* and send it on it's way */
+	evbuffer_add_printf(send, "\n");
+	gn_reply_end(dev->collector->ev);
     }
-    /* and send it on it's way */
-    evbuffer_add_printf(send, "\n");
-    bufferevent_write_buffer(dev->collector->ev, send);
+    /* force a device conf rewrite */
+    SET_FLAG(dev->flags, DEVFLAG_DIRTY);
+    devconf_dump(0);
 
     return(0);
 }
 
-/**
-   \brief Timer callback to update the feed request
-   \param nada used for file descriptor
-   \param what why did we fire?
-   \param arg void pointer to client_t of connection
-*/
-
-void feeddata_cb(int nada, short what, void *arg)
-{
-    client_t *client = (client_t *)arg;
-    wrap_device_t *wrap;
-    time_t now, diff;
-
-    (void)time(&now);
-    TAILQ_FOREACH(wrap, &client->wdevices, next) {
-	diff = now - wrap->last_fired;
-	if (diff / wrap->rate >= 1) { /* this dev is ready */
-	    gn_update_device(wrap->dev, GNC_UPD_RRDNAME |
-			     GNC_UPD_SCALE(wrap->scale),
-			     client->ev);
-	    wrap->last_fired = now;
-	    client->sentdata++;
-	}
-    }
-}
-
 /**
    \brief Handle a feed device command
    \param args The list of arguments
@@ -792,11 +1151,11 @@ void feeddata_cb(int nada, short what, void *arg)
 
 int cmd_feed(pargs_t *args, void *arg)
 {
-    int i, rate=60, lc, scale;
+    int i, rate=60, scale=-1;
     char *uid=NULL;
-    struct timeval secs = {0, 0};
     device_t *dev;
     wrap_device_t *wrap;
+    selector_t *sel;
     client_t *client = (client_t *)arg;
 
     for (i=0; args[i].cword != -1; i++) {
@@ -807,39 +1166,32 @@ int cmd_feed(pargs_t *args, void *arg)
 	case SC_RATE:
 	    rate = args[i].arg.i;
 	    break;
+	case SC_SCALE:
+	    scale = args[i].arg.i;
+	    break;
 	}
     }
-    secs.tv_sec = rate;
+
+    /* one feed for everything a selector matches, -1 is native scale */
+    if ((sel = new_selector(args, 1)) != NULL) {
+	wrap = add_wrapped_device(NULL, client, rate, scale);
+	wrap->sel = sel;
+	feed_schedule(wrap, client);
+	client->feeds++;
+	return 0;
+    }
+
     if (uid == NULL)
 	return -1;
     dev = find_device_byuid(uid);
     if (dev == NULL)
 	return -1;
+    if (scale < 0)
+	scale = dev->scale;
 
-    /* check for scale arg */
-    scale = dev->scale;
-    for (i=0; args[i].cword != -1; i++) {
-	switch (args[i].cword) {
-	case SC_SCALE:
-	    scale = args[i].arg.i;
-	    break;
-	}
-    }
-
-    add_wrapped_device(dev, client, rate, scale);
-    if (client->tev == NULL || !event_initialized(client->tev)) {
-	client->tev = event_new(base, -1, EV_PERSIST, feeddata_cb,
-				client);
-	event_add(client->tev, &secs);
-	client->timer_gcd = rate;
-    } else {
-	TAILQ_FOREACH(wrap, &client->wdevices, next) {
-	    lc = gcd(wrap->rate, client->timer_gcd);
-	    client->timer_gcd = lc;
-	}
-	secs.tv_sec = client->timer_gcd;
-	event_add(client->tev, &secs); /* update with new lcm */
-    }
+    wrap = add_wrapped_device(dev, client, rate, scale);
+    parse_deadband(args, &wrap->db);
+    feed_schedule(wrap, client);
     client->feeds++;
 
     return 0;
@@ -858,8 +1210,16 @@ int cmd_cfeed(pargs_t *args, void *arg)
     int i;
     char *uid=NULL;
     device_t *dev;
+    selector_t *sel;
+    wrap_client_t *dwatch;
     client_t *client = (client_t *)arg;
 
+    /* a selector is checked as devices update, even ones not here yet */
+    if ((sel = new_selector(args, 1)) != NULL) {
+	add_client_selector(client, sel);
+	return 0;
+    }
+
     for (i=0; args[i].cword != -1; i++) {
 	switch (args[i].cword) {
 	case SC_UID:
@@ -873,7 +1233,8 @@ int cmd_cfeed(pargs_t *args, void *arg)
     if (dev == NULL)
 	return -1;
 
-    add_wrapped_client(client, dev);
+    dwatch = add_wrapped_client(client, dev);
+    parse_deadband(args, &dwatch->db);
 
     return 0;
 }
@@ -990,10 +1351,77 @@ int cmd_list_devices(pargs_t *args, void *arg)
 	    continue;
 	gn_register_device(dev, client->ev);
     }
-    send = evbuffer_new();
+    send = gn_reply_begin(client->ev);
     evbuffer_add_printf(send, "endldevs\n");
-    bufferevent_write_buffer(client->ev, send);
-    evbuffer_free(send);
+    gn_reply_end(client->ev);
+
+    return 0;
+}
+
+/**
+   \brief Handle a snapshot command
+   \param args The list of arguments
+   \param arg void pointer to client_t of connection
+   \note Meant as the first thing a UI asks for, it replaces an ldevs
+   followed by an ask per device with one request.  The whole reply is
+   written into the client's output under one lock.
+*/
+
+int cmd_snapshot(pargs_t *args, void *arg)
+{
+    int i, devtype, proto, subtype, scale;
+    device_t *dev;
+    selector_t *sel;
+    char *uid = NULL;
+    client_t *client = (client_t *)arg;
+    struct evbuffer *send;
+
+    devtype = proto = subtype = 0;
+    scale = -1;
+
+    for (i=0; args[i].cword != -1; i++) {
+	switch (args[i].cword) {
+	case SC_UID:
+	    uid = args[i].arg.c;
+	    break;
+	case SC_DEVTYPE:
+	    devtype = args[i].arg.i;
+	    break;
+	case SC_PROTO:
+	    proto = args[i].arg.i;
+	    break;
+	case SC_SUBTYPE:
+	    subtype = args[i].arg.i;
+	    break;
+	case SC_SCALE:
+	    scale = args[i].arg.i;
+	    break;
+	}
+    }
+    /* glist, tags or a uid pattern narrow it down further */
+    sel = new_selector(args, 1);
+    if (sel != NULL)
+	uid = NULL;
+
+    send = gn_reply_begin(client->ev);
+    TAILQ_FOREACH(dev, &alldevs, next_all) {
+	if (uid && strcmp(uid, dev->uid) != 0)
+	    continue;
+	if (devtype && devtype != dev->type)
+	    continue;
+	if (proto && proto != dev->proto)
+	    continue;
+	if (subtype && subtype != dev->subtype)
+	    continue;
+	if (sel && !selector_match(sel, dev))
+	    continue;
+	if (gn_build_snap(dev, (scale < 0) ? dev->scale : scale, send) == 0)
+	    client->sentdata++;
+    }
+    evbuffer_add_printf(send, "endsnap\n");
+    gn_reply_end(client->ev);
+    if (sel)
+	free_selector(sel);
 
     return 0;
 }
@@ -1033,11 +1461,45 @@ int cmd_list_groups(pargs_t *args, void *arg)
 	    continue;
 	gn_register_devgroup(devgrp, client->ev);
     }
-    send = evbuffer_new();
+    send = gn_reply_begin(client->ev);
     evbuffer_add_printf(send, "endlgrps\n");
-    bufferevent_write_buffer(client->ev, send);
-    evbuffer_free(send);
+    gn_reply_end(client->ev);
+
+    return 0;
+}
+
+/**
+   \brief Build the upd line answering an ask, with rolling stats if wanted
+   \param dev device
+   \param what GNC_UPD_* bits describing what to send
+   \param window stats window asked for, -1 for no stats
+   \param send evbuffer to add the line to
+   \return 0 if a line was added
+   \note The stats are in the device's native scale.
+*/
+
+static int build_ask_reply(device_t *dev, int what, int window,
+			   struct evbuffer *send)
+{
+    struct evbuffer *line;
+    stats_t st;
 
+    if (window < 0 || stats_get(dev, window, &st) != 0)
+	return gn_build_update(dev, what, send);
+
+    line = evbuffer_new();
+    if (gn_build_update(dev, what, line) != 0) {
+	evbuffer_free(line);
+	return -1;
+    }
+    /* the stats go on the end of the line, before the newline */
+    evbuffer_remove_buffer(line, send, evbuffer_get_length(line) - 1);
+    evbuffer_free(line);
+    evbuffer_add_printf(send, " %s:%d %s:%u %s:%f %s:%f %s:%f %s:%f %s:%f\n",
+			ARGNM(SC_WINDOW), st.window, ARGNM(SC_WCOUNT), st.n,
+			ARGNM(SC_WMIN), st.min, ARGNM(SC_WMAX), st.max,
+			ARGNM(SC_WAVG), st.avg, ARGNM(SC_WSDEV), st.sdev,
+			ARGNM(SC_WRATE), st.rate);
     return 0;
 }
 
@@ -1049,31 +1511,21 @@ int cmd_list_groups(pargs_t *args, void *arg)
 
 int cmd_ask_device(pargs_t *args, void *arg)
 {
-    int i, scale, what;
+    int i, scale, what, window;
     device_t *dev;
-    char *uid = NULL;
+    selector_t *sel;
     client_t *client = (client_t *)arg;
+    struct evbuffer *send;
 
     what = GNC_UPD_NAME|GNC_UPD_RRDNAME;
 
-    /* first, find the device */
-    dev = NULL;
-    for (i=0; args[i].cword != -1; i++) {
-	if (args[i].cword == SC_UID) {
-	    uid = args[i].arg.c;
-	    dev = find_device_byuid(uid);
-	}
-    }
-    if (dev == NULL)
-	return 1;
-
-    /* preset the scale to the device's native scale */
-    scale = dev->scale;
-
-    /* check for scale/flag arguments */
+    /* check for scale/flag arguments, -1 is the device's native scale */
+    scale = -1;
+    window = -1;
     for (i=0; args[i].cword != -1; i++)
 	switch (args[i].cword) {
 	case SC_SCALE: scale = args[i].arg.i; break;
+	case SC_WINDOW: window = MAX(args[i].arg.i, 0); break;
 	case SC_HIWAT:
 	case SC_LOWAT: what |= GNC_UPD_WATER; break;
 	case SC_HANDLER: what |= GNC_UPD_HANDLER; break;
@@ -1081,8 +1533,39 @@ int cmd_ask_device(pargs_t *args, void *arg)
 	case SC_TAGS: what |= GNC_UPD_TAGS; break;
 	}
 
-    gn_update_device(dev, what|GNC_UPD_SCALE(scale), client->ev);
-    client->sentdata++;
+    /* a group or uid pattern gets every matching device */
+    if ((sel = new_selector(args, 0)) != NULL) {
+	send = gn_reply_begin(client->ev);
+	TAILQ_FOREACH(dev, &alldevs, next_all)
+	    if (selector_match(sel, dev) &&
+		build_ask_reply(dev, what|GNC_UPD_SCALE((scale < 0) ?
+		    dev->scale : scale), window, send) == 0)
+		client->sentdata++;
+	gn_reply_end(client->ev);
+	free_selector(sel);
+	return 0;
+    }
+
+    /* otherwise, find the device */
+    dev = NULL;
+    for (i=0; args[i].cword != -1; i++) {
+	if (args[i].cword == SC_UID || args[i].cword == SC_HANDLE)
+	    dev = find_device_byarg(&args[i]);
+    }
+    if (dev == NULL)
+	return 1;
+
+    if (window < 0) {
+	gn_update_device(dev, what|GNC_UPD_SCALE((scale < 0) ? dev->scale :
+						 scale), client->ev);
+	client->sentdata++;
+	return 0;
+    }
+    send = gn_reply_begin(client->ev);
+    if (build_ask_reply(dev, what|GNC_UPD_SCALE((scale < 0) ? dev->scale :
+						scale), window, send) == 0)
+	client->sentdata++;
+    gn_reply_end(client->ev);
 
     return 0;
 }
@@ -1160,8 +1643,9 @@ int cmd_disconnect(pargs_t *args, void *arg)
 	/* set close on empty, set watermark, then enable the write callback */
 	client->close_on_empty = 1;
 	bufferevent_setwatermark(client->ev, EV_WRITE, 0, 0);
-	bufferevent_setcb(client->ev, buf_read_cb, buf_write_cb,
-			  buf_error_cb, client);
+	if (client->thr == NULL)
+		bufferevent_setcb(client->ev, buf_read_cb, buf_write_cb,
+				  buf_error_cb, client);
 	bufferevent_enable(client->ev, EV_READ|EV_WRITE);
 	LOG(LOG_NOTICE, "Client %s from %s requested disconnect",
 	    client->name ? client->name : "generic",
@@ -1222,7 +1706,6 @@ int cmd_imalive(pargs_t *args, void *arg)
 int cmd_setalarm(pargs_t *args, void *arg)
 {
     client_t *client = (client_t *)arg;
-    client_t *tell;
     alarm_t *alarm;
     char *aluid = NULL;
     char *altext = NULL;
@@ -1246,24 +1729,7 @@ int cmd_setalarm(pargs_t *args, void *arg)
     }
 
     alarm = update_alarm(aluid, altext, alsev, alchan);
-
-    if (alarm == NULL) { /* the alarm has been unset, tell everyone */
-	TAILQ_FOREACH(tell, &clients, next) {
-	    if (tell->alarmwatch > 0) {
-		/* send a clearing message */
-		gn_setalarm(tell->ev, aluid, "", 0,
-			    ALL_FLAGS_SET);
-	    }
-	}
-    } else {
-	TAILQ_FOREACH(tell, &clients, next)
-	    if (tell->alarmwatch <= alarm->alsev &&
-		tell->alarmwatch != 0 &&
-		CHECK_MASK(tell->alchan, alarm->alchan))
-		gn_setalarm(tell->ev, alarm->aluid,
-			    alarm->altext, alarm->alsev,
-			    alarm->alchan);
-    }
+    alarm_tell(alarm, aluid);
 
     return 0;
 }
@@ -1293,8 +1759,7 @@ int cmd_listen_alarms(pargs_t *args, void *arg)
 	client->name ? client->name : "generic",
 	client->addr ? client->addr : "unknown", alsev);
 
-    client->alarmwatch = alsev;
-    client->alchan = alchan;
+    alarm_listen(client, alsev, alchan);
 
     return 0;
 }
@@ -1334,16 +1799,166 @@ int cmd_dump_alarms(pargs_t *args, void *arg)
 			    alarm->alchan);
 	}
     } else {
-	TAILQ_FOREACH(alarm, &alarms, next) {
-	    if (alarm->alsev >= alsev &&
-		strcmp(alarm->aluid, aluid) == 0 &&
-		CHECK_MASK(alarm->alchan, alchan)) {
-		gn_setalarm(client->ev, alarm->aluid,
-			    alarm->altext, alarm->alsev,
-			    alarm->alchan);
-	    }
+	alarm = find_alarm_by_aluid(aluid);
+	if (alarm != NULL && alarm->alsev >= alsev &&
+	    CHECK_MASK(alarm->alchan, alchan))
+	    gn_setalarm(client->ev, alarm->aluid,
+			alarm->altext, alarm->alsev,
+			alarm->alchan);
+    }
+
+    return 0;
+}
+
+/**
+   \brief Does an alarm history entry match what was asked for?
+   \param hist history entry
+   \param aluid alarm uid, NULL for any
+   \param alsev lowest severity, clears always match
+   \param alchan channel mask
+   \return bool
+*/
+
+static int alarm_hist_match(alarm_hist_t *hist, char *aluid, int alsev,
+			    uint32_t alchan)
+{
+    if (aluid != NULL && strcmp(hist->aluid, aluid) != 0)
+	return 0;
+    if (hist->alsev != 0 && hist->alsev < alsev)
+	return 0;
+    return CHECK_MASK(hist->alchan, alchan) ? 1 : 0;
+}
+
+/**
+   \brief Got a request for the alarm history
+   \param args The list of arguments
+   \param arg void pointer to client_t of connection
+   \note Replies with the most recent changes, oldest first, as alarmhist
+   lines, then endalarmhist.
+*/
+
+int cmd_alarm_history(pargs_t *args, void *arg)
+{
+    client_t *client = (client_t *)arg;
+    struct evbuffer *send;
+    alarm_hist_t *hist;
+    int alsev = 0; /* assume 0 if no arg, clears too */
+    uint32_t alchan = ALL_FLAGS_SET; /* assume if no arg */
+    char *aluid = NULL;
+    int64_t num = -1;
+    int i, n, found;
+
+    for (i=0; args[i].cword != -1; i++)
+	switch (args[i].cword) {
+	case SC_ALSEV: alsev = args[i].arg.i; break;
+	case SC_ALUID: aluid = args[i].arg.c; break;
+	case SC_ALCHAN: alchan = args[i].arg.u; break;
+	case SC_NUMBER: num = args[i].arg.ll; break;
+	}
+
+    /* find how far back to start, then send them in order */
+    n = 0;
+    for (i=0, found=0; (hist = alarm_history(i)) != NULL &&
+	     (num < 0 || found < num); i++)
+	if (alarm_hist_match(hist, aluid, alsev, alchan)) {
+	    found++;
+	    n = i + 1;
+	}
+    send = gn_reply_begin(client->ev);
+    for (i = n - 1; i >= 0; i--) {
+	hist = alarm_history(i);
+	if (!alarm_hist_match(hist, aluid, alsev, alchan))
+	    continue;
+	evbuffer_add_printf(send, "alarmhist %s:%s %s:\"%s\" %s:%d %s:%u "
+			    "%s:%jd\n", ARGNM(SC_ALUID), hist->aluid,
+			    ARGNM(SC_ALTEXT),
+			    hist->altext ? hist->altext : "",
+			    ARGNM(SC_ALSEV), hist->alsev,
+			    ARGNM(SC_ALCHAN), hist->alchan,
+			    ARGNM(SC_LASTUPD), (intmax_t)hist->when);
+    }
+    evbuffer_add_printf(send, "endalarmhist\n");
+    gn_reply_end(client->ev);
+
+    return 0;
+}
+
+/**
+   \brief Add a hist line for one recent value of a device
+   \param dev device
+   \param hist the sample
+   \param send evbuffer to add the line to
+*/
+
+static void add_hist_line(device_t *dev, hist_sample_t *hist,
+			  struct evbuffer *send)
+{
+    double d;
+    uint32_t u;
+    int64_t ll;
+
+    evbuffer_add_printf(send, "hist %s:%s %s:", ARGNM(SC_UID), dev->uid,
+			ARGDEV(dev));
+    switch (datatype_dev(dev)) {
+    case DATATYPE_UINT:
+	get_data_store(dev, &hist->val, &u);
+	evbuffer_add_printf(send, "%u", u);
+	break;
+    case DATATYPE_LL:
+	get_data_store(dev, &hist->val, &ll);
+	evbuffer_add_printf(send, "%jd", (intmax_t)ll);
+	break;
+    case DATATYPE_DOUBLE:
+    default:
+	get_data_store(dev, &hist->val, &d);
+	evbuffer_add_printf(send, "%f", d);
+	break;
+    }
+    evbuffer_add_printf(send, " %s:%jd\n", ARGNM(SC_LASTUPD),
+			(intmax_t)hist->when);
+}
+
+/**
+   \brief Handle a hist command
+   \param args The list of arguments
+   \param arg void pointer to client_t of provider
+*/
+
+int cmd_history(pargs_t *args, void *arg)
+{
+    client_t *client = (client_t *)arg;
+    struct evbuffer *send;
+    hist_sample_t *hist;
+    device_t *dev = NULL;
+    pargs_t *devarg = NULL;
+    int64_t since = 0, max = -1;
+    int i, n;
+
+    for (i=0; args[i].cword != -1; i++)
+	switch (args[i].cword) {
+	case SC_UID:
+	case SC_HANDLE:
+	    devarg = &args[i];
+	    dev = find_device_byarg(devarg);
+	    break;
+	case SC_SINCE: since = args[i].arg.ll; break;
+	case SC_MAX: max = args[i].arg.ll; break;
 	}
+    if (dev == NULL && devarg != NULL)
+	log_unknown_device(devarg);
+
+    send = gn_reply_begin(client->ev);
+    if (dev != NULL) {
+	/* the newest come first, find the oldest one wanted */
+	for (n=0; (max < 0 || n < max) &&
+		 (hist = history_sample(dev, n)) != NULL &&
+		 hist->when >= since; n++)
+	    ;
+	for (i = n - 1; i >= 0; i--)
+	    add_hist_line(dev, history_sample(dev, i), send);
     }
+    evbuffer_add_printf(send, "endhist\n");
+    gn_reply_end(client->ev);
 
     return 0;
 }
@@ -1359,8 +1974,7 @@ int cmd_get_apiv(pargs_t *args, void *arg)
     client_t *client = (client_t *)arg;
     struct evbuffer *send;
 
-    send = evbuffer_new();
+    send = gn_reply_begin(client->ev);
     evbuffer_add_printf(send, "apiv number:%d\n", GNHASTD_PROTO_VERS);
-    bufferevent_write_buffer(client->ev, send);
-    evbuffer_free(send);
+    gn_reply_end(client->ev);
 }
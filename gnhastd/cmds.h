@@ -4,12 +4,14 @@
 int cmd_register(pargs_t *args, void *arg);
 int cmd_register_group(pargs_t *args, void *arg);
 int cmd_update(pargs_t *args, void *arg);
+int cmd_multi_update(pargs_t *args, void *arg);
 int cmd_change(pargs_t *args, void *arg);
 int cmd_modify(pargs_t *args, void *arg);
 int cmd_feed(pargs_t *args, void *arg);
 int cmd_cfeed(pargs_t *args, void *arg);
 int cmd_client(pargs_t *args, void *arg);
 int cmd_list_devices(pargs_t *args, void *arg);
+int cmd_snapshot(pargs_t *args, void *arg);
 int cmd_list_groups(pargs_t *args, void *arg);
 int cmd_cactiask_device(pargs_t *args, void *arg);
 int cmd_ask_device(pargs_t *args, void *arg);
@@ -20,6 +22,8 @@ int cmd_imalive(pargs_t *args, void *arg);
 int cmd_setalarm(pargs_t *args, void *arg);
 int cmd_listen_alarms(pargs_t *args, void *arg);
 int cmd_dump_alarms(pargs_t *args, void *arg);
+int cmd_alarm_history(pargs_t *args, void *arg);
+int cmd_history(pargs_t *args, void *arg);
 int cmd_get_apiv(pargs_t *args, void *arg);
 
 int parsed_command(char *command, pargs_t *args, void *arg);
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file feedsched.c
+   \brief Scheduler for timed device feeds
+   \author Tim Rightnour
+
+   Every feed (a wrap_device_t hung off a client by the feed command) sits
+   in a single min-heap keyed on the time it next needs to fire.  One timer
+   event is armed for the head of the heap, so a tick only touches the
+   feeds that are actually due, no matter how many feeds a client has.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "gnhast.h"
+#include "gnhastd.h"
+#include "common.h"
+#include "gncoll.h"
+
+extern struct event_base *base;
+extern size_t client_hiwat;
+
+/** \brief the heap, 1-based, heap[1] fires next */
+static wrap_device_t **feedheap;
+/** \brief number of feeds in the heap */
+static int nroffeeds;
+/** \brief allocated size of the heap */
+static int feedheap_size;
+/** \brief the one timer event, armed for heap[1] */
+static struct event *feed_ev;
+/** \brief rotates the start phase of new feeds */
+static unsigned int feed_phase;
+
+/**
+   \brief Place a feed at a heap position and record where it lives
+   \param i heap position
+   \param wrap feed to place
+*/
+
+static void feedheap_set(int i, wrap_device_t *wrap)
+{
+	feedheap[i] = wrap;
+	wrap->heapidx = i;
+}
+
+/**
+   \brief Move a feed toward the top of the heap until it is in order
+   \param i heap position of the feed
+*/
+
+static void feedheap_up(int i)
+{
+	wrap_device_t *wrap = feedheap[i];
+
+	while (i > 1 && feedheap[i/2]->next_fire > wrap->next_fire) {
+		feedheap_set(i, feedheap[i/2]);
+		i /= 2;
+	}
+	feedheap_set(i, wrap);
+}
+
+/**
+   \brief Move a feed toward the bottom of the heap until it is in order
+   \param i heap position of the feed
+*/
+
+static void feedheap_down(int i)
+{
+	wrap_device_t *wrap = feedheap[i];
+	int child;
+
+	while ((child = i * 2) <= nroffeeds) {
+		if (child < nroffeeds &&
+		    feedheap[child+1]->next_fire < feedheap[child]->next_fire)
+			child++;
+		if (feedheap[child]->next_fire >= wrap->next_fire)
+			break;
+		feedheap_set(i, feedheap[child]);
+		i = child;
+	}
+	feedheap_set(i, wrap);
+}
+
+/**
+   \brief Arm the timer for whatever feed is due next
+*/
+
+static void feed_rearm(void)
+{
+	struct timeval secs = { 0, 0 };
+	time_t now;
+
+	if (nroffeeds == 0) {
+		event_del(feed_ev);
+		return;
+	}
+	now = time(NULL);
+	if (feedheap[1]->next_fire > now)
+		secs.tv_sec = feedheap[1]->next_fire - now;
+	event_add(feed_ev, &secs);
+}
+
+/**
+   \brief Send one tick of a selector feed, every device it matches
+   \param wrap the feed
+*/
+
+static void feed_send_selected(wrap_device_t *wrap)
+{
+	device_t *dev, **devs;
+	struct evbuffer *send;
+	int i, n, scale;
+
+	send = evbuffer_new();
+	n = selector_devices(wrap->sel, &devs);
+	for (i=0; i < n; i++) {
+		dev = devs[i];
+		if (!selector_deadband(wrap->sel, dev))
+			continue;
+		scale = (wrap->scale < 0) ? dev->scale : wrap->scale;
+		if (gn_build_update(dev, GNC_UPD_RRDNAME|GNC_UPD_SCALE(scale),
+				    send) == 0)
+			wrap->client->sentdata++;
+	}
+	bufferevent_write_buffer(wrap->client->ev, send);
+	evbuffer_free(send);
+}
+
+/**
+   \brief Timer callback, send every feed that is due
+   \param nada used for file descriptor
+   \param what why did we fire?
+   \param arg unused
+*/
+
+static void feed_timer_cb(int nada, short what, void *arg)
+{
+	wrap_device_t *wrap;
+	time_t now;
+
+	now = time(NULL);
+	while (nroffeeds > 0 && feedheap[1]->next_fire <= now) {
+		wrap = feedheap[1];
+		/* a backed up client just misses this one, the next is newer */
+		if (client_hiwat > 0 &&
+		    client_backlog(wrap->client) >= client_hiwat)
+			wrap->client->dropped++;
+		else if (wrap->sel != NULL)
+			feed_send_selected(wrap);
+		else if (deadband_check(wrap->dev, &wrap->db)) {
+			gn_update_device(wrap->dev, GNC_UPD_RRDNAME |
+					 GNC_UPD_SCALE(wrap->scale),
+					 wrap->client->ev);
+			wrap->client->sentdata++;
+		}
+		wrap->last_fired = now;
+
+		/* keep the phase, unless we fell a whole period behind */
+		wrap->next_fire += wrap->rate;
+		if (wrap->next_fire <= now)
+			wrap->next_fire = now + wrap->rate;
+		feedheap_down(1);
+	}
+	feed_rearm();
+}
+
+/**
+   \brief Start sending a feed on its schedule
+   \param wrap the feed, with dev, rate and scale filled in
+   \param client client the feed is sent to
+   \note The first update goes out somewhere within one period, staggered
+   so that a client asking for hundreds of feeds at once does not get
+   them all in the same second.
+*/
+
+void feed_schedule(wrap_device_t *wrap, client_t *client)
+{
+	if (wrap->rate < 1)
+		wrap->rate = 1;
+	wrap->client = client;
+	wrap->next_fire = time(NULL) + 1 + (feed_phase++ % wrap->rate);
+
+	if (feed_ev == NULL)
+		feed_ev = evtimer_new(base, feed_timer_cb, NULL);
+	if (nroffeeds + 1 >= feedheap_size) {
+		feedheap_size = (feedheap_size) ? feedheap_size * 2 : 64;
+		feedheap = realloc(feedheap,
+		    sizeof(wrap_device_t *) * feedheap_size);
+		if (feedheap == NULL)
+			bailout();
+	}
+	nroffeeds++;
+	feedheap_set(nroffeeds, wrap);
+	feedheap_up(nroffeeds);
+	if (wrap->heapidx == 1)
+		feed_rearm();
+}
+
+/**
+   \brief Stop sending a feed
+   \param wrap the feed to remove
+*/
+
+void feed_unschedule(wrap_device_t *wrap)
+{
+	wrap_device_t *last;
+	int i = wrap->heapidx;
+
+	if (i == 0)
+		return;
+	wrap->heapidx = 0;
+	if (i != nroffeeds) {
+		last = feedheap[nroffeeds];
+		nroffeeds--;
+		feedheap_set(i, last);
+		feedheap_up(i);
+		feedheap_down(last->heapidx);
+	} else
+		nroffeeds--;
+	if (i == 1)
+		feed_rearm();
+}
@@ -35,7 +35,9 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/queue.h>
+#include <sys/wait.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 
 #include "confuse.h"
 #include "config.h"
@@ -60,6 +62,9 @@ struct event_base *base;	/**< The primary event base */
 extern TAILQ_HEAD(, _device_t) alldevs;
 extern TAILQ_HEAD(, _client_t) clients;
 extern TAILQ_HEAD(, _device_group_t) allgroups;
+extern uint32_t fanout_renders, fanout_sends;
+extern uint32_t rules_fired;
+extern size_t client_hiwat;
 /* Satisfy libgnhast */
 char *conffile;
 int need_rereg;
@@ -67,14 +72,35 @@ struct evdns_base *dns_base;
 connection_t *gnhastd_conn;
 char *conntype[1];
 
+/** \brief A conf file that is written out by a child process */
+typedef struct _confwriter_t {
+	pid_t pid;	/**< \brief child writing it, 0 if none */
+	int unsaved;	/**< \brief cfg holds changes the file does not */
+} confwriter_t;
+
+static confwriter_t devconf_writer;
+static confwriter_t devgroupconf_writer;
+/** \brief a group was registered since the last devgroups.conf dump */
+int devgroups_dirty = 0;
+
 /* debugging */
 /*_malloc_options = "AJ";*/
 
 /* Configuration options for the server */
 
 extern cfg_opt_t device_opts[];
+extern name_map_t devsubtype_map[];
 extern cfg_opt_t device_group_opts[];
 
+cfg_opt_t rule_opts[] = {
+	CFG_STR_LIST("if", "{}", CFGF_NONE),
+	CFG_STR_LIST("then", "{}", CFGF_NONE),
+	CFG_STR_LIST("else", "{}", CFGF_NONE),
+	CFG_FLOAT("hysteresis", 0.0, CFGF_NONE),
+	CFG_INT("interval", 0, CFGF_NONE),
+	CFG_END(),
+};
+
 cfg_opt_t network_opts[] = {
 	CFG_STR("listen", "127.0.0.1", CFGF_NONE),
 	CFG_INT("sslport", 2921, CFGF_NONE),
@@ -90,13 +116,27 @@ cfg_opt_t options[] = {
 	CFG_SEC("network", network_opts, CFGF_NONE),
 	CFG_SEC("device", device_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_SEC("devgroup", device_group_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_SEC("rule", rule_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_STR("devconf", GNHASTD_DEVICE_FILE, CFGF_NONE),
 	CFG_STR("devgroupconf", GNHASTD_DEVGROUP_FILE, CFGF_NONE),
 	CFG_INT("devconf_update", 300, CFGF_NONE),
+	CFG_STR("journal", "", CFGF_NONE),
+	CFG_INT("journal_sync", 30, CFGF_NONE),
+	CFG_INT("journal_compact", 4194304, CFGF_NONE),
+	CFG_INT("alarm_history", 256, CFGF_NONE),
+	CFG_INT("history_size", 0, CFGF_NONE),
+	CFG_STR_LIST("history_subtypes", "{}", CFGF_NONE),
+	CFG_INT_LIST("stats_windows", "{}", CFGF_NONE),
+	CFG_STR_LIST("stats_subtypes", "{}", CFGF_NONE),
+	CFG_STR_LIST("stats_devices", "{}", CFGF_NONE),
 	CFG_INT("infodump", 600, CFGF_NONE),
+	CFG_INT("client_hiwat", 1048576, CFGF_NONE),
+	CFG_INT("workers", 0, CFGF_NONE),
+	CFG_INT_CB("confcache", 0, CFGF_NONE, conf_parse_bool),
 	CFG_FUNC("include", cfg_include),
 	CFG_STR("logfile", GNHASTD_LOG_FILE, CFGF_NONE),
 	CFG_STR("pidfile", GNHASTD_PID_FILE, CFGF_NONE),
+	CFG_STR_LIST("persistent_handlers", "{}", CFGF_NONE),
 	CFG_END(),
 };
 
@@ -139,17 +179,62 @@ void health_update_clients_cb(int nada, short what, void *arg)
 }
 
 /**
-   \brief Timer callback to update the device conf file
-   \param nada used for file descriptor
-   \param what why did we fire?
-   \param arg unused
+   \brief Write a conf file out, in the background unless told to wait
+   \param w writer state of the file
+   \param flags CONF_DUMP_* flags
+   \param file path to write
+   \param wait write it before returning, after any child is done
+   \note The child writes from its copy of cfg as it was at the fork, so
+   formatting and syncing the file stays off the event loop.  Only one
+   child per file runs at a time.  If the last one is still busy, this
+   round is skipped and its changes go out with the next.
 */
 
-void devconf_dump_cb(int nada, short what, void *arg)
+static void conf_write(confwriter_t *w, int flags, char *file, int wait)
+{
+	int status = 0;
+	pid_t pid;
+
+	if (w->pid != 0) {
+		pid = waitpid(w->pid, &status, wait ? 0 : WNOHANG);
+		if (pid == 0)
+			return;
+		/* if it failed, the file is still behind */
+		if (pid == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			w->unsaved = 1;
+		w->pid = 0;
+	}
+	if (!w->unsaved)
+		return;
+	w->unsaved = 0;
+	LOG(LOG_DEBUG, "Writing conf file %s", file);
+
+	if (!wait) {
+		pid = fork();
+		if (pid == 0)
+			_exit(dump_conf(cfg, flags, file) == NULL);
+		if (pid > 0) {
+			w->pid = pid;
+			return;
+		}
+		LOG(LOG_WARNING, "Fork failed: %s, writing %s directly",
+		    strerror(errno), file);
+	}
+	if (dump_conf(cfg, flags, file) == NULL)
+		w->unsaved = 1;
+}
+
+/**
+   \brief Update the device conf file, if any device changed
+   \param wait write it before returning
+   \note Only devices marked DEVFLAG_DIRTY have their entries rebuilt.
+*/
+
+void devconf_dump(int wait)
 {
-	device_t *dev;
-	cfg_t *dc;
 	char *p, *buf;
+	size_t len;
 	int madebuf=0;
 	int flag=0;
 
@@ -166,34 +251,44 @@ void devconf_dump_cb(int nada, short what, void *arg)
 	/* ok, not an absolute/relative path, set it up */
 
 	if (buf == NULL) {
-		buf = safer_malloc(64 + strlen(p));
-		sprintf(buf, "%s/%s", SYSCONFDIR, cfg_getstr(cfg, "devconf"));
+		len = strlen(SYSCONFDIR) + strlen(p) + 2;
+		buf = safer_malloc(len);
+		snprintf(buf, len, "%s/%s", SYSCONFDIR, p);
 		madebuf++;
 	}
 
-	TAILQ_FOREACH(dev, &alldevs, next_all) {
-		dc = new_conf_from_dev(cfg, dev);
-	}
-	LOG(LOG_DEBUG, "Writing device conf file %s", buf);
+	if (conf_update_dirty(cfg) > 0)
+		devconf_writer.unsaved = 1;
 	SET_FLAG(flag, CONF_DUMP_DEVONLY);
 	SET_FLAG(flag, CONF_DUMP_NOCOLLECTOR);
-	dump_conf(cfg, flag, buf);
+	conf_write(&devconf_writer, flag, buf, wait);
 	if (madebuf)
 		free(buf);
 }
 
 /**
-   \brief Timer callback to update the device group conf file
+   \brief Timer callback to update the device conf file
    \param nada used for file descriptor
    \param what why did we fire?
    \param arg unused
 */
 
-void devgroupconf_dump_cb(int nada, short what, void *arg)
+void devconf_dump_cb(int nada, short what, void *arg)
+{
+	devconf_dump(0);
+}
+
+/**
+   \brief Update the device group conf file, if any group changed
+   \param wait write it before returning
+*/
+
+void devgroupconf_dump(int wait)
 {
 	device_group_t *devgrp;
 	cfg_t *dc;
 	char *p, *buf;
+	size_t len;
 	int madebuf=0;
 
 	p = cfg_getstr(cfg, "devgroupconf");
@@ -209,21 +304,66 @@ void devgroupconf_dump_cb(int nada, short what, void *arg)
 	/* ok, not an absolute/relative path, set it up */
 
 	if (buf == NULL) {
-		buf = safer_malloc(64 + strlen(p));
-		sprintf(buf, "%s/%s", SYSCONFDIR,
-			cfg_getstr(cfg, "devgroupconf"));
+		len = strlen(SYSCONFDIR) + strlen(p) + 2;
+		buf = safer_malloc(len);
+		snprintf(buf, len, "%s/%s", SYSCONFDIR, p);
 		madebuf++;
 	}
 
-	TAILQ_FOREACH(devgrp, &allgroups, next_all) {
-		dc = new_conf_from_devgrp(cfg, devgrp);
+	if (devgroups_dirty) {
+		TAILQ_FOREACH(devgrp, &allgroups, next_all) {
+			dc = new_conf_from_devgrp(cfg, devgrp);
+		}
+		devgroups_dirty = 0;
+		devgroupconf_writer.unsaved = 1;
 	}
-	LOG(LOG_DEBUG, "Writing device group conf file %s", buf);
-	dump_conf(cfg, CONV_FLAG(CONF_DUMP_GROUPONLY), buf);
+	conf_write(&devgroupconf_writer, CONV_FLAG(CONF_DUMP_GROUPONLY), buf,
+		   wait);
 	if (madebuf)
 		free(buf);
 }
 
+/**
+   \brief Timer callback to update the device group conf file
+   \param nada used for file descriptor
+   \param what why did we fire?
+   \param arg unused
+*/
+
+void devgroupconf_dump_cb(int nada, short what, void *arg)
+{
+	devgroupconf_dump(0);
+}
+
+/**
+   \brief Get gnhastd's local data for a device, creating it if needed
+   \param dev device
+   \return devlocal_t
+*/
+
+devlocal_t *dev_localdata(device_t *dev)
+{
+	if (dev->localdata == NULL)
+		dev->localdata = smalloc(devlocal_t);
+	return (devlocal_t *)dev->localdata;
+}
+
+/**
+   \brief Look up a subtype by the name devices.conf uses
+   \param name name
+   \return subtype, or -1
+*/
+
+int find_subtype_byname(const char *name)
+{
+	int i;
+
+	for (i=0; i < NROF_SUBTYPES; i++)
+		if (strcmp(name, devsubtype_map[i].name) == 0)
+			return devsubtype_map[i].id;
+	return -1;
+}
+
 /**
    \brief SIGTERM handler
    \param fd unused
@@ -251,6 +391,8 @@ void cb_siginfo(int fd, short what, void *arg)
 	wrap_device_t *wrap;
 	device_t *dev;
 	int i, w, d;
+	static uint64_t last_allocs, last_lines;
+	uint64_t allocs;
 
 	i = 0;
 	TAILQ_FOREACH(client, &clients, next)
@@ -265,17 +407,33 @@ void cb_siginfo(int fd, short what, void *arg)
 		TAILQ_FOREACH(wrap, &client->wdevices, next)
 			w++;
 		LOG(LOG_NOTICE, "Client %s %s %s devices:%d wrapdevs:%d "
-		    "updates:%d lastupd (seconds):%d",
+		    "updates:%u lastupd (seconds):%d",
 		    client->provider ? "provider" : "reciever",
 		    client->name ? client->name : "generic",
 		    client->addr ? client->addr : "unknown",
 		    d, w, client->updates,
 		    (int)(time(NULL) - client->lastupd));
+		if (client->coalesced || client->dropped)
+			LOG(LOG_NOTICE, "Client %s backed up, coalesced:%u "
+			    "dropped:%u",
+			    client->addr ? client->addr : "unknown",
+			    client->coalesced, client->dropped);
 	}
 	i = 0;
 	TAILQ_FOREACH(dev, &alldevs, next_all)
 		i++;
 	LOG(LOG_NOTICE, "Total number of devices: %d", i);
+	LOG(LOG_NOTICE, "Watcher updates sent:%u rendered:%u reused:%u",
+	    fanout_sends, fanout_renders, fanout_sends - fanout_renders);
+	LOG(LOG_NOTICE, "Rules fired: %u", rules_fired);
+	allocs = __atomic_load_n(&nrof_allocs, __ATOMIC_RELAXED);
+	LOG(LOG_NOTICE, "Allocations:%ju lines:%ju, since last time "
+	    "allocations:%ju lines:%ju", (uintmax_t)allocs,
+	    (uintmax_t)netparse_lines, (uintmax_t)(allocs - last_allocs),
+	    (uintmax_t)(netparse_lines - last_lines));
+	last_allocs = allocs;
+	last_lines = netparse_lines;
+	handler_worker_stats();
 	LOG(LOG_NOTICE, "End statistics");
 }
 
@@ -292,6 +450,9 @@ int main(int argc, char **argv)
 	struct event *ev;
 	pid_t pid;
 
+	/* count what libevent allocates too, before it allocates anything */
+	count_event_allocs();
+
 	while ((ch = getopt(argc, argv, "?c:d")) != -1)
 		switch (ch) {
 		case 'c':	/* Set configfile */
@@ -325,7 +486,15 @@ int main(int argc, char **argv)
 
 	LOG(LOG_NOTICE, "Starting gnhastd version %s", VERSION);
 
-	/* Initialize the event loop */
+	/* Initialize the event loop, I/O threads need locking set up first */
+#ifdef HAVE_NETTHREADS
+	if (cfg_getint(cfg, "workers") > 0)
+		evthread_use_pthreads();
+#else
+	if (cfg_getint(cfg, "workers") > 0)
+		LOG(LOG_FATAL, "workers is set, but gnhastd was built without "
+		    "libevent_pthreads");
+#endif
 	base = event_base_new();
 
 	/* Setup the network loop */
@@ -339,6 +508,17 @@ int main(int argc, char **argv)
 	if (debugmode)
 		print_group_table(1);
 
+	/* put back the device values from before we went down */
+	init_journal();
+
+	init_alarm_history(cfg_getint(cfg, "alarm_history"));
+	init_history();
+	init_stats();
+	init_rules();
+
+	init_handler_workers();
+	client_hiwat = cfg_getint(cfg, "client_hiwat");
+
 	/* schedule periodic rewrites of devices.conf */
 	if (cfg_getint(cfg, "devconf_update") > 0) {
 		secs.tv_sec = cfg_getint(cfg, "devconf_update");
@@ -358,9 +538,8 @@ int main(int argc, char **argv)
 	}
 
 	/* update timer devices */
-	secs.tv_sec = 1;
-	ev = event_new(base, -1, EV_PERSIST, cb_timerdev_update, NULL);
-	event_add(ev, &secs);
+	timerdev_expired = timerdev_done;
+	init_timerdevs(base);
 
 	/* setup ping for all collectors */
 	secs.tv_sec = HEALTH_CHECK_RATE;
@@ -397,8 +576,9 @@ int main(int argc, char **argv)
 	event_base_dispatch(base);
 
 	/* Close it all down */
-	devconf_dump_cb(0, 0, 0);
-	devgroupconf_dump_cb(0, 0, 0);
+	journal_shutdown();
+	devconf_dump(1);
+	devgroupconf_dump(1);
 	cfg_free(cfg);
 	closelog();
 	return 0;
@@ -7,11 +7,141 @@
 #define GNHASTD_DEVICE_FILE	"devices.conf"
 #define GNHASTD_DEVGROUP_FILE	"devgroups.conf"
 
+/** \brief Every device matching a set of qualifiers, for cfeed/feed/ask */
+typedef struct _selector_t {
+    char *uidpat;	/**< \brief uid pattern (fnmatch), NULL for any */
+    char **groups;	/**< \brief group uids, device must be in one */
+    int nrofgroups;	/**< \brief number of groups */
+    char **tags;	/**< \brief tag patterns, device must carry one */
+    int nroftags;	/**< \brief number of tags */
+    uint32_t devtmask;	/**< \brief bit per allowed device type, 0 for any */
+    uint64_t subtmask;	/**< \brief bit per allowed subtype, 0 for any */
+    device_t **devs;	/**< \brief devices matched, see selector_devices() */
+    int nrofdevs;	/**< \brief number of devs */
+    int devsize;	/**< \brief allocated entries in devs */
+    uint32_t devgen;	/**< \brief selector_gen devs was built at */
+    device_t *lastseen;	/**< \brief last device in alldevs devs has checked */
+    deadband_t db;	/**< \brief deadband settings, applied per device */
+    deadband_t *dbs;	/**< \brief per device deadband state, by handle */
+    uint32_t dbsize;	/**< \brief allocated entries in dbs */
+    TAILQ_ENTRY(_selector_t) next; /**< \brief next selector of the client */
+} selector_t;
+
+typedef struct _devhist_t devhist_t;
+typedef struct _devstats_t devstats_t;
+typedef struct _rule_t rule_t;
+
+/** \brief What gnhastd keeps in dev->localdata */
+typedef struct _devlocal_t {
+    devhist_t *hist;	/**< \brief recent values, see history.c */
+    devstats_t *stats;	/**< \brief rolling aggregates, see stats.c */
+    int nostats;	/**< \brief looked, and this device keeps no stats */
+    rule_t **rules;	/**< \brief rules that test this device, see rules.c */
+    int nrofrules;	/**< \brief number of rules */
+    int ruleschecked;	/**< \brief rules has been filled in */
+    client_t **selclients; /**< \brief clients with a selector matching us */
+    int nrofselclients;	/**< \brief number of selclients */
+    int selclientsize;	/**< \brief allocated size of selclients */
+    uint32_t selgen;	/**< \brief selector_gen selclients was built at */
+} devlocal_t;
+
+/** \brief Rolling aggregates of a device over one window */
+typedef struct _stats_t {
+    int window;		/**< \brief length of the window, seconds */
+    uint32_t n;		/**< \brief values in the window */
+    double min;		/**< \brief lowest value */
+    double max;		/**< \brief highest value */
+    double avg;		/**< \brief mean */
+    double sdev;	/**< \brief standard deviation */
+    double rate;	/**< \brief change per second, first to last value */
+} stats_t;
+
+/** \brief One recent value of a device */
+typedef struct _hist_sample_t {
+    time_t when;	/**< \brief time the value was stored */
+    data_t val;		/**< \brief the value */
+} hist_sample_t;
+
 void init_netloop(void);
 void buf_read_cb(struct bufferevent *in, void *arg);
 void buf_write_cb(struct bufferevent *in, void *arg);
 void buf_error_cb(struct bufferevent *ev, short what, void *arg);
 void network_shutdown(void);
+void devconf_dump(int wait);
 void devconf_dump_cb(int nada, short what, void *arg);
+void devgroupconf_dump(int wait);
+devlocal_t *dev_localdata(device_t *dev);
+int find_subtype_byname(const char *name);
+
+/* cmdhandler.c */
+struct _pargs_t;
+void parse_deadband(struct _pargs_t *args, deadband_t *db);
+size_t client_backlog(client_t *client);
+void flush_pending_updates(client_t *client);
+void notify_watchers(device_t *dev);
+void timerdev_done(device_t *dev);
+
+/* script_handler.c */
+void init_handler_workers(void);
+void handler_closed(client_t *client);
+void handler_worker_stats(void);
+
+/* netthread.c */
+#ifdef HAVE_NETTHREADS
+void init_netthreads(int n);
+int netthread_attach(client_t *client, int sock);
+void netthread_want_drain(client_t *client);
+struct evbuffer *netthread_outbox(client_t *client);
+void netthread_flush(client_t *client);
+void netthread_forget(client_t *client);
+void netthread_shutdown(void);
+#else
+/* built without libevent_pthreads, every client stays on the main loop */
+#define init_netthreads(n)
+#define netthread_attach(client, sock)	(-1)
+#define netthread_want_drain(client)
+#define netthread_outbox(client)	((struct evbuffer *)NULL)
+#define netthread_flush(client)
+#define netthread_forget(client)
+#define netthread_shutdown()
+#endif
+
+/* selector.c */
+selector_t *new_selector(struct _pargs_t *args, int bytags);
+void free_selector(selector_t *sel);
+int selector_match(selector_t *sel, device_t *dev);
+void add_client_selector(client_t *client, selector_t *sel);
+void remove_client_selectors(client_t *client);
+int client_selects(client_t *client, device_t *dev);
+void selectors_changed(void);
+int selecting_clients(device_t *dev, client_t ***out);
+int selector_devices(selector_t *sel, device_t ***out);
+int selector_deadband(selector_t *sel, device_t *dev);
+int client_selector_deadband(client_t *client, device_t *dev);
+
+/* journal.c */
+void init_journal(void);
+void journal_shutdown(void);
+
+/* alarmlisten.c */
+void alarm_listen(client_t *client, int alsev, uint32_t alchan);
+void alarm_unlisten(client_t *client);
+void alarm_tell(alarm_t *alarm, char *aluid);
+
+/* feedsched.c */
+void feed_schedule(wrap_device_t *wrap, client_t *client);
+void feed_unschedule(wrap_device_t *wrap);
+
+/* history.c */
+void init_history(void);
+hist_sample_t *history_sample(device_t *dev, int n);
+
+/* stats.c */
+void init_stats(void);
+int stats_get(device_t *dev, int window, stats_t *st);
+
+/* rules.c */
+void init_rules(void);
+void rules_eval(device_t *dev);
 
 #endif /*_GNHASTD_H_*/
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file history.c
+   \brief Recent values of each device, for the hist command
+   \author Tim Rightnour
+
+   Each device whose subtype has a history size keeps a ring of its last
+   values, as (time, value) pairs in one allocation hung off the device's
+   devlocal_t.  The ring is allocated the first time the device gets
+   a value, so devices that never report cost nothing.  Nothing is kept
+   on disk; after a restart the history starts over.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "gnhast.h"
+#include "gnhastd.h"
+#include "common.h"
+
+extern cfg_t *cfg;
+
+/** \brief A ring of recent values of one device */
+struct _devhist_t {
+	uint32_t size;		/**< \brief number of samples in s */
+	uint64_t next;		/**< \brief samples stored, next % size is next */
+	hist_sample_t s[];	/**< \brief the samples */
+};
+
+/** \brief how many samples to keep, by subtype */
+static int hist_size[NROF_SUBTYPES];
+/** \brief whoever had dev_data_stored before us */
+static void (*hist_next_cb)(device_t *dev);
+
+/**
+   \brief Record a device's new value
+   \param dev device
+*/
+
+static void history_store_cb(device_t *dev)
+{
+	devlocal_t *local = (devlocal_t *)dev->localdata;
+	devhist_t *hist = (local != NULL) ? local->hist : NULL;
+	hist_sample_t *s;
+	int size;
+
+	if (hist == NULL && dev->subtype < NROF_SUBTYPES &&
+	    (size = hist_size[dev->subtype]) > 0) {
+		hist = safer_malloc(sizeof(devhist_t) +
+				    size * sizeof(hist_sample_t));
+		hist->size = size;
+		dev_localdata(dev)->hist = hist;
+	}
+	if (hist != NULL) {
+		s = &hist->s[hist->next % hist->size];
+		s->when = time(NULL);
+		s->val = dev->data;
+		hist->next++;
+	}
+
+	if (hist_next_cb != NULL)
+		hist_next_cb(dev);
+}
+
+/**
+   \brief Read the history sizes, and start recording values
+   \note Call after init_journal(), so replayed values are not recorded.
+*/
+
+void init_history(void)
+{
+	char *p, *name;
+	int i, st, size, any;
+
+	size = cfg_getint(cfg, "history_size");
+	for (i=0; i < NROF_SUBTYPES; i++)
+		hist_size[i] = size;
+	for (i=0; i < cfg_size(cfg, "history_subtypes"); i++) {
+		name = strdup(cfg_getnstr(cfg, "history_subtypes", i));
+		p = strchr(name, ':');
+		if (p != NULL)
+			*p++ = '\0';
+		st = find_subtype_byname(name);
+		if (p == NULL || st < 0)
+			LOG(LOG_ERROR, "Bad history_subtypes entry: %s",
+			    cfg_getnstr(cfg, "history_subtypes", i));
+		else
+			hist_size[st] = atoi(p);
+		free(name);
+	}
+
+	for (i=0, any=0; i < NROF_SUBTYPES; i++)
+		if (hist_size[i] > 0)
+			any++;
+	if (!any)
+		return;
+	hist_next_cb = dev_data_stored;
+	dev_data_stored = history_store_cb;
+}
+
+/**
+   \brief Get one of a device's recent values
+   \param dev device
+   \param n how far back, 0 is the newest
+   \return the sample, or NULL if there are not that many
+*/
+
+hist_sample_t *history_sample(device_t *dev, int n)
+{
+	devhist_t *hist;
+
+	if (dev->localdata == NULL)
+		return NULL;
+	hist = ((devlocal_t *)dev->localdata)->hist;
+	if (hist == NULL || n < 0 || (uint32_t)n >= hist->size ||
+	    (uint64_t)n >= hist->next)
+		return NULL;
+	return &hist->s[(hist->next - 1 - n) % hist->size];
+}
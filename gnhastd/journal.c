@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file journal.c
+   \brief Journal of device values, for a warm restart
+   \author Tim Rightnour
+
+   devices.conf records what a device is, but not its value.  Every store
+   to a device's current data is appended to the journal as a
+   "uid time value" line, and the journal is written and fsynced in one
+   batch every journal_sync seconds.  At startup it is replayed over the
+   devices loaded from the config, so gnhastd answers with the last known
+   values before any collector has reconnected.  Once it grows past
+   journal_compact bytes it is rewritten with one line per device.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include "gnhast.h"
+#include "gnhastd.h"
+#include "common.h"
+
+extern TAILQ_HEAD(, _device_t) alldevs;
+extern struct event_base *base;
+extern cfg_t *cfg;
+
+/** \brief path of the journal */
+static char *journal_path;
+/** \brief journal, open for append, -1 if not journaling */
+static int journal_fd = -1;
+/** \brief lines waiting for the next sync */
+static struct evbuffer *journal_buf;
+/** \brief bytes in the journal file */
+static off_t journal_size;
+/** \brief compact once the journal is bigger than this */
+static off_t journal_compact_size;
+
+/**
+   \brief Add a journal line for a device's current value
+   \param dev device
+   \param when time the value was stored
+   \param buf evbuffer to add the line to
+*/
+
+static void journal_add(device_t *dev, time_t when, struct evbuffer *buf)
+{
+	double d=0.0;
+	uint32_t u=0;
+	int64_t ll=0;
+
+	switch (datatype_dev(dev)) {
+	case DATATYPE_UINT:
+		get_data_dev(dev, DATALOC_DATA, &u);
+		evbuffer_add_printf(buf, "%s %jd %u\n", dev->uid,
+				    (intmax_t)when, u);
+		break;
+	case DATATYPE_LL:
+		get_data_dev(dev, DATALOC_DATA, &ll);
+		evbuffer_add_printf(buf, "%s %jd %jd\n", dev->uid,
+				    (intmax_t)when, ll);
+		break;
+	case DATATYPE_DOUBLE:
+	default:
+		get_data_dev(dev, DATALOC_DATA, &d);
+		evbuffer_add_printf(buf, "%s %jd %.17g\n", dev->uid,
+				    (intmax_t)when, d);
+		break;
+	}
+}
+
+/**
+   \brief Called by store_data_dev() whenever a device gets a new value
+   \param dev device
+*/
+
+static void journal_store_cb(device_t *dev)
+{
+	journal_add(dev, time(NULL), journal_buf);
+}
+
+/**
+   \brief Write all of an evbuffer to a file
+   \param fd file to write to
+   \param buf evbuffer, drained
+   \return 0 on success, -1 on error
+*/
+
+static int journal_write(int fd, struct evbuffer *buf)
+{
+	while (evbuffer_get_length(buf) > 0)
+		if (evbuffer_write(buf, fd) == -1 && errno != EINTR)
+			return -1;
+	return 0;
+}
+
+/**
+   \brief Rewrite the journal with just the current value of each device
+   \return 0 on success, -1 if the old journal was left in place
+   \note Written to a temporary file that is renamed over the journal, so
+   a crash part way through leaves the old journal in place.
+*/
+
+static int journal_compact(void)
+{
+	struct evbuffer *buf;
+	device_t *dev;
+	char *tmp;
+	off_t len;
+	int fd;
+
+	tmp = safer_malloc(strlen(journal_path) + 5);
+	sprintf(tmp, "%s.tmp", journal_path);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		LOG(LOG_ERROR, "Cannot open %s: %s", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	buf = evbuffer_new();
+	TAILQ_FOREACH(dev, &alldevs, next_all)
+		if (!QUERY_FLAG(dev->flags, DEVFLAG_NODATA))
+			journal_add(dev, dev->last_upd, buf);
+	len = evbuffer_get_length(buf);
+	if (journal_write(fd, buf) == -1 || fsync(fd) == -1) {
+		LOG(LOG_ERROR, "Cannot write %s: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		evbuffer_free(buf);
+		free(tmp);
+		return -1;
+	}
+	close(fd);
+	evbuffer_free(buf);
+	if (rename(tmp, journal_path) == -1) {
+		LOG(LOG_ERROR, "Cannot rename %s to %s: %s", tmp,
+		    journal_path, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	/* everything pending is in the new journal already */
+	evbuffer_drain(journal_buf, evbuffer_get_length(journal_buf));
+	if (journal_fd != -1)
+		close(journal_fd);
+	journal_fd = open(journal_path, O_WRONLY|O_APPEND);
+	if (journal_fd == -1)
+		LOG(LOG_ERROR, "Cannot reopen journal %s: %s", journal_path,
+		    strerror(errno));
+	journal_size = len;
+	LOG(LOG_DEBUG, "Compacted journal %s to %jd bytes", journal_path,
+	    (intmax_t)len);
+	return 0;
+}
+
+/**
+   \brief Write out and fsync everything journaled since the last sync
+*/
+
+static void journal_flush(void)
+{
+	size_t len;
+
+	len = evbuffer_get_length(journal_buf);
+	if (len == 0 || journal_fd == -1)
+		return;
+	if (journal_write(journal_fd, journal_buf) == -1 ||
+	    fsync(journal_fd) == -1) {
+		LOG(LOG_ERROR, "Cannot write journal %s: %s", journal_path,
+		    strerror(errno));
+		/* lose the tail, and rewrite the lot at the next sync */
+		evbuffer_drain(journal_buf, evbuffer_get_length(journal_buf));
+		journal_size = journal_compact_size;
+		return;
+	}
+	journal_size += len;
+}
+
+/**
+   \brief Timer callback to sync the journal
+   \param nada used for file descriptor
+   \param what why did we fire?
+   \param arg unused
+*/
+
+static void journal_sync_cb(int nada, short what, void *arg)
+{
+	if (journal_size + evbuffer_get_length(journal_buf) >=
+	    journal_compact_size && journal_compact() == 0)
+		return;
+	journal_flush();
+}
+
+/**
+   \brief Replay the journal over the devices we have
+   \note A device the journal names that we no longer know is skipped, as
+   is a last line cut short by a crash.
+*/
+
+static void journal_replay(void)
+{
+	FILE *f;
+	device_t *dev;
+	char line[1024], *uid, *when, *val, *last;
+	double d;
+	uint32_t u;
+	int64_t ll;
+	int n = 0, skipped = 0;
+
+	f = fopen(journal_path, "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strchr(line, '\n') == NULL ||
+		    (uid = strtok_r(line, " \n", &last)) == NULL ||
+		    (when = strtok_r(NULL, " \n", &last)) == NULL ||
+		    (val = strtok_r(NULL, " \n", &last)) == NULL ||
+		    (dev = find_device_byuid(uid)) == NULL) {
+			skipped++;
+			continue;
+		}
+		switch (datatype_dev(dev)) {
+		case DATATYPE_UINT:
+			u = strtoul(val, NULL, 10);
+			store_data_dev(dev, DATALOC_DATA, &u);
+			break;
+		case DATATYPE_LL:
+			ll = strtoll(val, NULL, 10);
+			store_data_dev(dev, DATALOC_DATA, &ll);
+			break;
+		case DATATYPE_DOUBLE:
+		default:
+			d = strtod(val, NULL);
+			store_data_dev(dev, DATALOC_DATA, &d);
+			break;
+		}
+		dev->last_upd = (time_t)strtoll(when, NULL, 10);
+		n++;
+	}
+	fclose(f);
+	LOG(LOG_NOTICE, "Replayed %d journal entries from %s, skipped %d",
+	    n, journal_path, skipped);
+}
+
+/**
+   \brief Replay the journal, and start journaling device values
+   \note Must be called after the devices are loaded from the config.
+*/
+
+void init_journal(void)
+{
+	struct timeval secs = { 0, 0 };
+	struct event *ev;
+	size_t len;
+	char *p;
+
+	p = cfg_getstr(cfg, "journal");
+	if (p == NULL || *p == '\0')
+		return;
+	/* a bare file name lives next to devices.conf */
+	if (p[0] == '/' || (p[0] == '.' && p[1] == '/'))
+		journal_path = strdup(p);
+	else {
+		len = strlen(SYSCONFDIR) + strlen(p) + 2;
+		journal_path = safer_malloc(len);
+		snprintf(journal_path, len, "%s/%s", SYSCONFDIR, p);
+	}
+
+	journal_replay();
+
+	journal_buf = evbuffer_new();
+	journal_compact_size = cfg_getint(cfg, "journal_compact");
+	/* start from one line per device */
+	if (journal_compact() == -1 || journal_fd == -1) {
+		LOG(LOG_ERROR, "Journaling disabled");
+		evbuffer_free(journal_buf);
+		return;
+	}
+	dev_data_stored = journal_store_cb;
+
+	secs.tv_sec = cfg_getint(cfg, "journal_sync");
+	if (secs.tv_sec < 1)
+		secs.tv_sec = 1;
+	ev = event_new(base, -1, EV_PERSIST, journal_sync_cb, NULL);
+	event_add(ev, &secs);
+}
+
+/**
+   \brief Sync and close the journal on the way out
+*/
+
+void journal_shutdown(void)
+{
+	if (journal_fd == -1)
+		return;
+	dev_data_stored = NULL;
+	journal_flush();
+	close(journal_fd);
+	journal_fd = -1;
+}
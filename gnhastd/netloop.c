@@ -101,49 +101,34 @@ static int setnonblock(int fd)
 void buf_read_cb(struct bufferevent *in, void *arg)
 {
 	client_t *client = (client_t *)arg;
-	char *data;
-	char **words, *cmdword;
-	int numwords, i, ret;
-	pargs_t *args=NULL;
+	char *data, *cmdword;
+	int ret;
+	pargs_t *args;
 	struct evbuffer *evbuf;
 	size_t len;
 
 
 	/* we got data, so mark the client structure */
 	client->lastupd = time(NULL);
+	if (client->np == NULL)
+		client->np = smalloc(netparse_t);
+	evbuf = bufferevent_get_input(in);
 
 	/* loop as long as we have data to read */
-	while (1) {
-		evbuf = bufferevent_get_input(in);
-		data = evbuffer_readln(evbuf, &len, EVBUFFER_EOL_CRLF);
-
-		if (data == NULL || len < 1)
-			return;
+	while ((data = netparse_readln(client->np, evbuf, &len)) != NULL) {
+		if (len < 1)
+			continue;
 
 		LOG(LOG_DEBUG, "Got data %s", data);
 
-		words = parse_netcommand(data, &numwords);
-
-		if (words == NULL || words[0] == NULL) {
-			free(data);
-			return;
-		}
+		args = parse_netline(client->np, data, &cmdword);
+		if (args == NULL)
+			continue;
 
-		cmdword = strdup(words[0]);
-		args = parse_command(words, numwords);
 		ret = parsed_command(cmdword, args, arg);
 		if (ret != 0)
 			LOG(LOG_DEBUG, "Command failed or invalid: %s",
 			    cmdword);
-		free(cmdword);
-		free(data);
-		if (args) {
-			for (i=0; args[i].cword != -1; i++)
-				if (args[i].type == PTCHAR)
-					free(args[i].arg.c);
-			free(args);
-			args=NULL;
-		}
 	}
 }
 
@@ -151,7 +136,9 @@ void buf_read_cb(struct bufferevent *in, void *arg)
    \brief Write callback
    \param out bufferevent to write out to
    \param arg pointer to client_t
-   \note Only enabled during shutdown
+   \note Installed on every client.  Once the output drains, it flushes
+   the updates that were coalesced while the client was backed up, and
+   during shutdown it closes the connection.
 */
 
 void buf_write_cb(struct bufferevent *out, void *arg)
@@ -164,7 +151,8 @@ void buf_write_cb(struct bufferevent *out, void *arg)
 		len = evbuffer_get_length(output);
 		if (len == 0)
 			buf_error_cb(client->ev, 0, arg);
-	}
+	} else if (!TAILQ_EMPTY(&client->pending) || client->resync)
+		flush_pending_updates(client);
 }
 
 /**
@@ -177,10 +165,9 @@ void buf_write_cb(struct bufferevent *out, void *arg)
 void buf_error_cb(struct bufferevent *ev, short what, void *arg)
 {
 	client_t *client = (client_t *)arg;
-	wrap_client_t *watch, *nextc;
 	device_t *dev;
 	wrap_device_t *wrap;
-	int error, status, i;
+	int error, i;
 
 	if (what & BEV_EVENT_ERROR) {
 		error = bufferevent_get_openssl_error(ev);
@@ -198,39 +185,23 @@ void buf_error_cb(struct bufferevent *ev, short what, void *arg)
 		store_data_dev(client->coll_dev, DATALOC_DATA, &i);
 	}
 
-	if (client->pid > 0) {
-		waitpid(client->pid, &status, 0); /* WNOHANG ??? */
-		if (WIFEXITED(status)) {
-			if (WEXITSTATUS(status))
-				LOG(LOG_WARNING, "Handler exited with status"
-				    " %d", WEXITSTATUS(status));
-		} else if (WIFSIGNALED(status))
-			LOG(LOG_WARNING, "Handler got signal %d",
-			    WTERMSIG(status));
-	}
+	if (client->pid > 0)
+		handler_closed(client);
 
 	bufferevent_disable(client->ev, EV_READ|EV_WRITE);
+	netthread_forget(client);
 	bufferevent_free(client->ev);
-	if (client->tev)
-		event_free(client->tev);
 	if (client->name)
 		free(client->name);
 	if (client->addr)
 		free(client->addr);
-	close(client->fd);
-
-	/* find all devices I'm watching, and undo.  This is nasty */
-	TAILQ_FOREACH(dev, &alldevs, next_all) {
-		TAILQ_FOREACH_SAFE(watch, &dev->watchers, next, nextc) {
-			if (watch->client == client) {
-				TAILQ_REMOVE(&dev->watchers, watch, next);
-				LOG(LOG_DEBUG, "Unwatching device %s",
-				    dev->uid);
-				free(watch);
-				client->watched--;
-			}
-		}
-	}
+	netparse_free(client->np);
+	/* the bufferevent owns and closes the fd (BEV_OPT_CLOSE_ON_FREE) */
+
+	/* find all devices I'm watching, and undo */
+	remove_wrapped_client(client);
+	remove_client_selectors(client);
+	alarm_unlisten(client);
 	if (client->watched > 0)
 		LOG(LOG_ERROR, "Client is still being watched by %d devices",
 		    client->watched);
@@ -245,6 +216,9 @@ void buf_error_cb(struct bufferevent *ev, short what, void *arg)
 	while (wrap = TAILQ_FIRST(&client->wdevices)) {
 		TAILQ_REMOVE(&client->wdevices, wrap, next);
 		wrap->onq &= ~(DEVONQ_CLIENT);
+		feed_unschedule(wrap);
+		if (wrap->sel != NULL)
+			free_selector(wrap->sel);
 		free(wrap);
 	}
 	TAILQ_REMOVE(&clients, client, next);
@@ -270,8 +244,13 @@ void accept_cb(struct evconnlistener *serv, int sock, struct sockaddr *sa,
 	client = smalloc(client_t);
 	client->fd = sock;
 
-	client->ev = bufferevent_socket_new(base, sock,
-            BEV_OPT_CLOSE_ON_FREE);
+	/* an I/O thread takes it if we have any, otherwise we keep it */
+	if (netthread_attach(client, sock) != 0) {
+		client->ev = bufferevent_socket_new(base, sock,
+		    BEV_OPT_CLOSE_ON_FREE);
+		bufferevent_setcb(client->ev, buf_read_cb, buf_write_cb,
+				  buf_error_cb, client);
+	}
 
 	sprintf(buf, "%s:%d", inet_ntoa(client_addr->sin_addr),
 		ntohs(client_addr->sin_port));
@@ -283,9 +262,9 @@ void accept_cb(struct evconnlistener *serv, int sock, struct sockaddr *sa,
 
 	TAILQ_INIT(&client->devices);
 	TAILQ_INIT(&client->wdevices);
+	TAILQ_INIT(&client->watching);
+	TAILQ_INIT(&client->pending);
 
-	bufferevent_setcb(client->ev, buf_read_cb, NULL,
-			  buf_error_cb, client);
 	bufferevent_enable(client->ev, EV_READ|EV_PERSIST);
 	TAILQ_INSERT_TAIL(&clients, client, next);
 }
@@ -315,6 +294,8 @@ void sslaccept_cb(struct evconnlistener *serv, int sock, struct sockaddr *sa,
 
 	TAILQ_INIT(&client->devices);
 	TAILQ_INIT(&client->wdevices);
+	TAILQ_INIT(&client->watching);
+	TAILQ_INIT(&client->pending);
 
 	client->ev = bufferevent_openssl_socket_new(base, sock,
 	    client->cli_ctx, BUFFEREVENT_SSL_ACCEPTING,
@@ -329,7 +310,7 @@ void sslaccept_cb(struct evconnlistener *serv, int sock, struct sockaddr *sa,
 	LOG(LOG_NOTICE, "Connection on secure port from %s",
 	    inet_ntoa(client_addr->sin_addr));
 
-	bufferevent_setcb(client->ev, buf_read_cb, NULL,
+	bufferevent_setcb(client->ev, buf_read_cb, buf_write_cb,
 			  buf_error_cb, client);
 	bufferevent_enable(client->ev, EV_READ|EV_PERSIST);
 	TAILQ_INSERT_TAIL(&clients, client, next);
@@ -399,6 +380,8 @@ void init_netloop(void)
 			LOG(LOG_FATAL, "Error reading config file");
 	}
 
+	init_netthreads(cfg_getint(cfg, "workers"));
+
 	if (cfg_getint(network, "usessl")) {
 		ctx = evssl_init();
 		if (ctx == NULL)
@@ -455,6 +438,7 @@ void network_shutdown(void)
 
 	LOG(LOG_NOTICE, "Commencing network shutdown, disconnecting all "
 	    "clients");
+	netthread_shutdown();
 	while (client = TAILQ_FIRST(&clients)) {
 		/* directly call the error callback */
 		buf_error_cb(client->ev, 0, client);
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file netthread.c
+   \brief Optional I/O threads for client connections
+   \author Tim Rightnour
+
+   With workers set in gnhastd.conf, accepted connections are handed out
+   round-robin to that many I/O threads, each running its own event base.
+   An I/O thread only moves bytes: it reads complete lines off the socket
+   and posts them to the main thread, which owns the device table and runs
+   every command, exactly as in the single threaded case.  Messages travel
+   over a lock-free multi-producer, single-consumer queue.
+
+   Going the other way, the main thread writes into the client's
+   bufferevent, which is created thread-safe for this.  Watcher updates are
+   the bulk of that traffic, so they are collected in a per-client outbox
+   and handed over with one locked append per client, at the end of each
+   pass over the inbox and before the client's own commands are run.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "gnhast.h"
+#include "gnhastd.h"
+#include "common.h"
+#include "commands.h"
+#include "cmds.h"
+
+extern struct event_base *base;
+
+/** \brief a chunk of lines read off a client */
+#define NETMSG_LINES	1
+/** \brief the client's output drained while it had pending updates */
+#define NETMSG_DRAINED	2
+/** \brief the connection is gone, tear the client down */
+#define NETMSG_CLOSE	3
+
+/** \brief A message from an I/O thread to the main thread */
+typedef struct _netmsg_t {
+	struct _netmsg_t *next;	/**< \brief next message in the inbox */
+	client_t *client;	/**< \brief client this is about */
+	int type;		/**< \brief one of NETMSG_* */
+	short what;		/**< \brief bufferevent error flags, for CLOSE */
+	size_t len;		/**< \brief length of data */
+	char data[1];		/**< \brief the lines, for NETMSG_LINES */
+} netmsg_t;
+
+/** \brief An I/O thread */
+typedef struct _netthread_t {
+	pthread_t tid;		/**< \brief thread id */
+	struct event_base *base; /**< \brief the thread's event base */
+} netthread_t;
+
+static netthread_t *netthreads;
+static int nrofnetthreads;
+/** \brief next thread to hand a connection to */
+static int netthread_next;
+
+/* The inbox, a Vyukov style intrusive MPSC queue.  Producers swap
+   themselves in at the head, the main thread eats from the tail. */
+static netmsg_t inbox_stub;
+static netmsg_t *inbox_head = &inbox_stub;
+static netmsg_t *inbox_tail = &inbox_stub;
+/** \brief set once a producer has woken the main thread */
+static int inbox_signalled;
+/** \brief event on the main base that drains the inbox */
+static struct event *inbox_ev;
+/** \brief parser state for lines handled by the main thread */
+static netparse_t inbox_np;
+/** \brief clients with watcher updates waiting in their outbox */
+static TAILQ_HEAD(, _client_t) outboxes = TAILQ_HEAD_INITIALIZER(outboxes);
+
+/**
+   \brief Put a message on the inbox, any thread
+   \param msg message to queue
+*/
+
+static void inbox_push(netmsg_t *msg)
+{
+	netmsg_t *prev;
+
+	__atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&inbox_head, msg, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/**
+   \brief Take the oldest message off the inbox, main thread only
+   \return the message, or NULL if there is nothing ready
+   \note A producer caught half way through a push makes this return
+   NULL early, it wakes the main thread again once it is done.
+*/
+
+static netmsg_t *inbox_pop(void)
+{
+	netmsg_t *tail = inbox_tail;
+	netmsg_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &inbox_stub) {
+		if (next == NULL)
+			return NULL;
+		inbox_tail = tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != NULL) {
+		inbox_tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&inbox_head, __ATOMIC_ACQUIRE))
+		return NULL;
+	inbox_push(&inbox_stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		inbox_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/**
+   \brief Queue a message for the main thread and wake it up
+   \param client client the message is about
+   \param type NETMSG_* type
+   \param what error flags for NETMSG_CLOSE
+   \param data lines for NETMSG_LINES, or NULL
+   \param len length of data
+*/
+
+static void netmsg_post(client_t *client, int type, short what,
+			const char *data, size_t len)
+{
+	netmsg_t *msg;
+
+	msg = _safer_malloc(sizeof(netmsg_t) + len, __FILE__, __LINE__);
+	msg->client = client;
+	msg->type = type;
+	msg->what = what;
+	msg->len = len;
+	if (len > 0)
+		memcpy(msg->data, data, len);
+	msg->data[len] = '\0';
+	inbox_push(msg);
+
+	/* one wakeup covers everything queued until the main thread looks */
+	if (__atomic_exchange_n(&inbox_signalled, 1, __ATOMIC_ACQ_REL) == 0)
+		event_active(inbox_ev, EV_READ, 0);
+}
+
+/**
+   \brief Get the buffer to queue watcher updates for a client in
+   \param client client on an I/O thread
+   \return the client's outbox, main thread only
+*/
+
+struct evbuffer *netthread_outbox(client_t *client)
+{
+	if (client->outbox == NULL)
+		client->outbox = evbuffer_new();
+	if (!client->onoutbox) {
+		TAILQ_INSERT_TAIL(&outboxes, client, next_outbox);
+		client->onoutbox = 1;
+	}
+	return client->outbox;
+}
+
+/**
+   \brief Hand a client's outbox over to its bufferevent
+   \param client client to flush
+*/
+
+void netthread_flush(client_t *client)
+{
+	if (!client->onoutbox)
+		return;
+	TAILQ_REMOVE(&outboxes, client, next_outbox);
+	client->onoutbox = 0;
+	bufferevent_write_buffer(client->ev, client->outbox);
+}
+
+/**
+   \brief Drop a client's outbox, it is being closed
+   \param client client being torn down
+*/
+
+void netthread_forget(client_t *client)
+{
+	if (client->onoutbox) {
+		TAILQ_REMOVE(&outboxes, client, next_outbox);
+		client->onoutbox = 0;
+	}
+	if (client->outbox != NULL)
+		evbuffer_free(client->outbox);
+	client->outbox = NULL;
+}
+
+/**
+   \brief Run every complete line in a message as a command
+   \param client client the lines came from
+   \param data NUL terminated lines, each ending in \\n or \\r\\n
+*/
+
+static void run_lines(client_t *client, char *data)
+{
+	char *line, *eol, *cmdword;
+	pargs_t *args;
+
+	client->lastupd = time(NULL);
+	for (line = data; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+		*eol = '\0';
+		if (eol > line && *(eol - 1) == '\r')
+			*(eol - 1) = '\0';
+		if (*line == '\0')
+			continue;
+
+		LOG(LOG_DEBUG, "Got data %s", line);
+
+		args = parse_netline(&inbox_np, line, &cmdword);
+		if (args == NULL)
+			continue;
+		if (parsed_command(cmdword, args, client) != 0)
+			LOG(LOG_DEBUG, "Command failed or invalid: %s",
+			    cmdword);
+	}
+}
+
+/**
+   \brief Main thread callback, handle everything the I/O threads sent
+   \param nada used for file descriptor
+   \param what why did we fire?
+   \param arg unused
+*/
+
+static void inbox_cb(int nada, short what, void *arg)
+{
+	netmsg_t *msg;
+	client_t *client;
+
+	__atomic_store_n(&inbox_signalled, 0, __ATOMIC_SEQ_CST);
+	while ((msg = inbox_pop()) != NULL) {
+		switch (msg->type) {
+		case NETMSG_LINES:
+			/* updates it was owed go out ahead of any replies */
+			netthread_flush(msg->client);
+			run_lines(msg->client, msg->data);
+			break;
+		case NETMSG_DRAINED:
+			if (!TAILQ_EMPTY(&msg->client->pending) ||
+			    msg->client->resync)
+				flush_pending_updates(msg->client);
+			break;
+		case NETMSG_CLOSE:
+			buf_error_cb(msg->client->ev, msg->what, msg->client);
+			break;
+		}
+		free(msg);
+	}
+	while ((client = TAILQ_FIRST(&outboxes)) != NULL)
+		netthread_flush(client);
+}
+
+/**
+   \brief Stop talking to a client, and have the main thread close it
+   \param client client to close
+   \param what bufferevent error flags
+*/
+
+static void io_close(client_t *client, short what)
+{
+	if (client->closing)
+		return;
+	client->closing = 1;
+	bufferevent_disable(client->ev, EV_READ|EV_WRITE);
+	netmsg_post(client, NETMSG_CLOSE, what, NULL, 0);
+}
+
+/**
+   \brief I/O thread read callback, pass complete lines to the main thread
+   \param in bufferevent with input
+   \param arg pointer to client_t
+*/
+
+static void io_read_cb(struct bufferevent *in, void *arg)
+{
+	client_t *client = (client_t *)arg;
+	struct evbuffer *input = bufferevent_get_input(in);
+	size_t len;
+	char *data, *eol;
+
+	if (client->closing)
+		return;
+	len = evbuffer_get_length(input);
+	if (len == 0)
+		return;
+	data = (char *)evbuffer_pullup(input, len);
+	for (eol = data + len - 1; eol >= data && *eol != '\n'; eol--)
+		;
+	if (eol < data)
+		return; /* no complete line yet */
+	len = eol - data + 1;
+	netmsg_post(client, NETMSG_LINES, 0, data, len);
+	evbuffer_drain(input, len);
+}
+
+/**
+   \brief I/O thread write callback, the output buffer drained
+   \param out bufferevent that drained
+   \param arg pointer to client_t
+*/
+
+static void io_write_cb(struct bufferevent *out, void *arg)
+{
+	client_t *client = (client_t *)arg;
+
+	if (client->closing)
+		return;
+	if (client->close_on_empty &&
+	    evbuffer_get_length(bufferevent_get_output(out)) == 0) {
+		io_close(client, 0);
+		return;
+	}
+	if (__atomic_exchange_n(&client->drain_wanted, 0, __ATOMIC_ACQ_REL))
+		netmsg_post(client, NETMSG_DRAINED, 0, NULL, 0);
+}
+
+/**
+   \brief I/O thread event callback
+   \param ev bufferevent that had an event
+   \param what what kind of event
+   \param arg pointer to client_t
+*/
+
+static void io_event_cb(struct bufferevent *ev, short what, void *arg)
+{
+	io_close((client_t *)arg, what);
+}
+
+/**
+   \brief I/O thread main loop
+   \param arg pointer to netthread_t
+   \return NULL
+*/
+
+static void *netthread_main(void *arg)
+{
+	netthread_t *thr = (netthread_t *)arg;
+
+	event_base_loop(thr->base, EVLOOP_NO_EXIT_ON_EMPTY);
+	return NULL;
+}
+
+/**
+   \brief Ask for a NETMSG_DRAINED once a client's output empties
+   \param client client with pending updates
+*/
+
+void netthread_want_drain(client_t *client)
+{
+	__atomic_store_n(&client->drain_wanted, 1, __ATOMIC_RELEASE);
+}
+
+/**
+   \brief Hand a new connection to the next I/O thread
+   \param client client being set up
+   \param sock the connection
+   \return 0 if the client now belongs to an I/O thread, -1 if threads
+   are not in use and the caller should run it on the main loop
+*/
+
+int netthread_attach(client_t *client, int sock)
+{
+	netthread_t *thr;
+
+	if (nrofnetthreads == 0)
+		return -1;
+	thr = &netthreads[netthread_next++ % nrofnetthreads];
+	client->thr = thr;
+	client->ev = bufferevent_socket_new(thr->base, sock,
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
+	bufferevent_setcb(client->ev, io_read_cb, io_write_cb,
+			  io_event_cb, client);
+	return 0;
+}
+
+/**
+   \brief Start the I/O threads
+   \param n number of threads
+   \note evthread_use_pthreads() must already have been called
+*/
+
+void init_netthreads(int n)
+{
+	int i;
+
+	if (n < 1)
+		return;
+	inbox_ev = event_new(base, -1, 0, inbox_cb, NULL);
+	netthreads = calloc(n, sizeof(netthread_t));
+	if (netthreads == NULL)
+		bailout();
+	for (i = 0; i < n; i++) {
+		netthreads[i].base = event_base_new();
+		if (netthreads[i].base == NULL)
+			LOG(LOG_FATAL, "Cannot create event base for thread");
+		if (pthread_create(&netthreads[i].tid, NULL, netthread_main,
+				   &netthreads[i]) != 0)
+			LOG(LOG_FATAL, "Cannot create I/O thread");
+	}
+	nrofnetthreads = n;
+	LOG(LOG_NOTICE, "Started %d I/O threads", n);
+}
+
+/**
+   \brief Stop the I/O threads
+   \note Anything still in the inbox is thrown away, the clients it refers
+   to are about to be closed anyway.
+*/
+
+void netthread_shutdown(void)
+{
+	netmsg_t *msg;
+	int i;
+
+	for (i = 0; i < nrofnetthreads; i++) {
+		event_base_loopbreak(netthreads[i].base);
+		pthread_join(netthreads[i].tid, NULL);
+	}
+	if (nrofnetthreads > 0)
+		while ((msg = inbox_pop()) != NULL)
+			free(msg);
+	nrofnetthreads = 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file rules.c
+   \brief Rules that change devices when others cross a threshold
+   \author Tim Rightnour
+
+   A rule section in gnhastd.conf says: when all of these conditions on
+   device values hold, send these chg lines, and when they stop holding,
+   send those.  Rules are parsed once at startup into conditions with
+   the threshold already converted, and actions with the chg line
+   already rendered, so running one needs no parsing, no fork and no
+   connection.  Each device keeps the list of rules that test it, found
+   the first time it is updated, and only those are looked at when it
+   changes.
+
+   A rule fires when its result changes.  Hysteresis widens the
+   thresholds while a rule is on, so a value wobbling across a threshold
+   does not flap it.  A change that comes sooner than interval seconds
+   after the last one is held back, and acted on by the first update
+   after that.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "gnhast.h"
+#include "gnhastd.h"
+#include "common.h"
+
+extern cfg_t *cfg;
+extern argtable_t argtable[];
+
+enum RULE_OPS {
+	RULEOP_LT,
+	RULEOP_LE,
+	RULEOP_GT,
+	RULEOP_GE,
+	RULEOP_EQ,
+	RULEOP_NE,
+	NROF_RULEOPS,
+};
+
+static const char *ruleops[NROF_RULEOPS] = {
+	"<",
+	"<=",
+	">",
+	">=",
+	"==",
+	"!=",
+};
+
+/** \brief One test of a device's value */
+typedef struct _rulecond_t {
+	char *uid;		/**< \brief device tested */
+	device_t *dev;		/**< \brief the device, once it exists */
+	int op;			/**< \brief RULEOP_* */
+	double val;		/**< \brief threshold, in the device's scale */
+} rulecond_t;
+
+/** \brief One chg sent when a rule fires */
+typedef struct _ruleact_t {
+	char *uid;		/**< \brief device changed */
+	device_t *dev;		/**< \brief the device, once it exists */
+	char *val;		/**< \brief value to set it to */
+	char *line;		/**< \brief the chg line, rendered once dev is */
+} ruleact_t;
+
+/** \brief A rule */
+struct _rule_t {
+	char *name;		/**< \brief title of the rule section */
+	rulecond_t *cond;	/**< \brief conditions, all must hold */
+	int nrofconds;		/**< \brief number of conditions */
+	ruleact_t *on;		/**< \brief sent when the conditions start to hold */
+	int nrofon;		/**< \brief number of on actions */
+	ruleact_t *off;		/**< \brief sent when they stop holding */
+	int nrofoff;		/**< \brief number of off actions */
+	double hyst;		/**< \brief hysteresis, added to thresholds */
+	int interval;		/**< \brief minimum seconds between firings */
+	int state;		/**< \brief -1 not known yet, 0 off, 1 on */
+	time_t fired;		/**< \brief last time it fired */
+};
+
+static rule_t *rules;
+static int nrofrules;
+/** \brief rules fired, for the infodump */
+uint32_t rules_fired = 0;
+
+/**
+   \brief Test a condition
+   \param c condition
+   \param hyst hysteresis to widen the threshold by, 0 for none
+   \return 1 if it holds, 0 if not, -1 if the device has no value yet
+*/
+
+static int rule_test(rulecond_t *c, double hyst)
+{
+	double v;
+
+	if (c->dev == NULL && (c->dev = find_device_byuid(c->uid)) == NULL)
+		return -1;
+	if (QUERY_FLAG(c->dev->flags, DEVFLAG_NODATA))
+		return -1;
+	v = get_double_store(c->dev, &c->dev->data);
+
+	switch (c->op) {
+	case RULEOP_LT: return v < c->val + hyst;
+	case RULEOP_LE: return v <= c->val + hyst;
+	case RULEOP_GT: return v > c->val - hyst;
+	case RULEOP_GE: return v >= c->val - hyst;
+	case RULEOP_EQ: return v == c->val;
+	case RULEOP_NE: return v != c->val;
+	}
+	return 0;
+}
+
+/**
+   \brief Send a rule's chg lines
+   \param rule rule
+   \param act actions
+   \param n number of actions
+*/
+
+static void rule_act(rule_t *rule, ruleact_t *act, int n)
+{
+	char line[512];
+	int i;
+
+	for (i=0; i < n; i++) {
+		if (act[i].line == NULL) {
+			if (act[i].dev == NULL &&
+			    (act[i].dev = find_device_byuid(act[i].uid)) == NULL) {
+				LOG(LOG_ERROR, "Rule %s: no device %s",
+				    rule->name, act[i].uid);
+				continue;
+			}
+			snprintf(line, sizeof(line), "chg %s:%s %s:%s\n",
+				 ARGNM(SC_UID), act[i].dev->uid,
+				 ARGDEV(act[i].dev), act[i].val);
+			act[i].line = strdup(line);
+		}
+		if (act[i].dev->collector == NULL) {
+			LOG(LOG_ERROR, "Rule %s: chg for uid:%s, but no "
+			    "collector", rule->name, act[i].dev->uid);
+			continue;
+		}
+		bufferevent_write(act[i].dev->collector->ev, act[i].line,
+				  strlen(act[i].line));
+	}
+}
+
+/**
+   \brief Run a rule against the current device values
+   \param rule rule
+   \param now current time
+*/
+
+static void rule_run(rule_t *rule, time_t now)
+{
+	double hyst = (rule->state == 1) ? rule->hyst : 0.0;
+	int i, res, on = 1;
+
+	for (i=0; i < rule->nrofconds; i++) {
+		res = rule_test(&rule->cond[i], hyst);
+		if (res < 0)
+			return;
+		on &= res;
+	}
+	if (on == rule->state)
+		return;
+	if (rule->state != -1 && now - rule->fired < rule->interval)
+		return;
+
+	rule->state = on;
+	rule->fired = now;
+	rules_fired++;
+	LOG(LOG_DEBUG, "Rule %s fired %s", rule->name, on ? "on" : "off");
+	if (on)
+		rule_act(rule, rule->on, rule->nrofon);
+	else
+		rule_act(rule, rule->off, rule->nrofoff);
+}
+
+/**
+   \brief Find the rules that test a device
+   \param dev device
+   \param local its local data
+*/
+
+static void rules_setup(device_t *dev, devlocal_t *local)
+{
+	int i, j, n;
+
+	local->ruleschecked = 1;
+	for (i=0, n=0; i < nrofrules; i++)
+		for (j=0; j < rules[i].nrofconds; j++)
+			if (strcmp(rules[i].cond[j].uid, dev->uid) == 0) {
+				rules[i].cond[j].dev = dev;
+				n++;
+			}
+	if (n == 0)
+		return;
+	local->rules = safer_malloc(n * sizeof(rule_t *));
+	for (i=0; i < nrofrules; i++)
+		for (j=0; j < rules[i].nrofconds; j++)
+			if (rules[i].cond[j].dev == dev) {
+				local->rules[local->nrofrules++] = &rules[i];
+				break;
+			}
+}
+
+/**
+   \brief Run the rules that test a device, after it was updated
+   \param dev device
+*/
+
+void rules_eval(device_t *dev)
+{
+	devlocal_t *local;
+	time_t now;
+	int i;
+
+	if (nrofrules == 0)
+		return;
+	local = dev_localdata(dev);
+	if (!local->ruleschecked)
+		rules_setup(dev, local);
+	if (local->nrofrules == 0)
+		return;
+	now = time(NULL);
+	for (i=0; i < local->nrofrules; i++)
+		rule_run(local->rules[i], now);
+}
+
+/**
+   \brief Parse a condition, "uid op value"
+   \param entry the condition
+   \param c filled in
+   \return 0 if it was good
+*/
+
+static int rule_parse_cond(const char *entry, rulecond_t *c)
+{
+	char uid[256], op[4], val[64], *end;
+
+	if (sscanf(entry, "%255s %3s %63s", uid, op, val) != 3)
+		return -1;
+	for (c->op = 0; c->op < NROF_RULEOPS; c->op++)
+		if (strcmp(op, ruleops[c->op]) == 0)
+			break;
+	if (c->op == NROF_RULEOPS)
+		return -1;
+	c->val = strtod(val, &end);
+	if (*end != '\0')
+		return -1;
+	c->uid = strdup(uid);
+	c->dev = NULL;
+	return 0;
+}
+
+/**
+   \brief Parse an action, "uid value"
+   \param entry the action
+   \param a filled in
+   \return 0 if it was good
+*/
+
+static int rule_parse_act(const char *entry, ruleact_t *a)
+{
+	char uid[256], val[64], *end;
+
+	if (sscanf(entry, "%255s %63s", uid, val) != 2)
+		return -1;
+	(void)strtod(val, &end);
+	if (*end != '\0')
+		return -1;
+	a->uid = strdup(uid);
+	a->val = strdup(val);
+	a->dev = NULL;
+	a->line = NULL;
+	return 0;
+}
+
+/**
+   \brief Parse a list of actions of a rule section
+   \param sec the section
+   \param opt then or else
+   \param n filled in with the number of actions
+   \return the actions
+*/
+
+static ruleact_t *rule_parse_acts(cfg_t *sec, const char *opt, int *n)
+{
+	ruleact_t *act;
+	char *p;
+	int i;
+
+	*n = 0;
+	if (cfg_size(sec, opt) == 0)
+		return NULL;
+	act = safer_malloc(cfg_size(sec, opt) * sizeof(ruleact_t));
+	for (i=0; i < cfg_size(sec, opt); i++) {
+		p = cfg_getnstr(sec, opt, i);
+		if (rule_parse_act(p, &act[*n]) == 0)
+			(*n)++;
+		else
+			LOG(LOG_ERROR, "Rule %s: bad %s entry: %s",
+			    cfg_title(sec), opt, p);
+	}
+	return act;
+}
+
+/**
+   \brief Parse the rule sections of the config
+*/
+
+void init_rules(void)
+{
+	cfg_t *sec;
+	rule_t *rule;
+	char *p;
+	int i, j, bad;
+
+	if (cfg_size(cfg, "rule") == 0)
+		return;
+	rules = safer_malloc(cfg_size(cfg, "rule") * sizeof(rule_t));
+	for (i=0; i < cfg_size(cfg, "rule"); i++) {
+		sec = cfg_getnsec(cfg, "rule", i);
+		rule = &rules[nrofrules];
+		rule->name = strdup(cfg_title(sec));
+		rule->nrofconds = cfg_size(sec, "if");
+		bad = (rule->nrofconds == 0);
+		if (rule->nrofconds > 0)
+			rule->cond = safer_malloc(rule->nrofconds *
+						  sizeof(rulecond_t));
+		for (j=0; j < rule->nrofconds; j++) {
+			p = cfg_getnstr(sec, "if", j);
+			if (rule_parse_cond(p, &rule->cond[j]) != 0) {
+				LOG(LOG_ERROR, "Rule %s: bad if entry: %s",
+				    rule->name, p);
+				bad++;
+			}
+		}
+		if (bad) {
+			LOG(LOG_ERROR, "Rule %s: ignored", rule->name);
+			/* the next rule reuses this slot */
+			for (j=0; j < rule->nrofconds; j++)
+				if (rule->cond[j].uid != NULL)
+					free(rule->cond[j].uid);
+			if (rule->cond != NULL)
+				free(rule->cond);
+			free(rule->name);
+			memset(rule, 0, sizeof(rule_t));
+			continue;
+		}
+		rule->on = rule_parse_acts(sec, "then", &rule->nrofon);
+		rule->off = rule_parse_acts(sec, "else", &rule->nrofoff);
+		rule->hyst = cfg_getfloat(sec, "hysteresis");
+		rule->interval = cfg_getint(sec, "interval");
+		rule->state = -1;
+		nrofrules++;
+	}
+	LOG(LOG_NOTICE, "Loaded %d rules", nrofrules);
+}
@@ -31,14 +31,22 @@
    \file script_handler.c
    \brief Launches external handlers in response to events
    \author Tim Rightnour
+
+   Normally a handler is forked fresh every time its device trips.  Paths
+   listed in persistent_handlers instead get one long-lived worker, which
+   is sent an upd line per event over its socket and restarted if it dies.
 */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #include "gnhast.h"
 #include "gnhastd.h"
@@ -50,40 +58,132 @@
 extern TAILQ_HEAD(, _device_t) alldevs;
 extern TAILQ_HEAD(, _client_t) clients;
 extern struct event_base *base;
+extern cfg_t *cfg;
+
+/** \brief seconds a worker must run before its restart delay resets */
+#define WORKER_STABLE_TIME	10
+/** \brief longest we wait before restarting a dead worker */
+#define WORKER_MAX_DELAY	60
+/** \brief seconds between tries at reaping a handler that closed its socket */
+#define HANDLER_REAP_RATE	1
+
+/** \brief A persistent handler process */
+typedef struct _handler_worker_t {
+	char *path;		/**< \brief path to the handler */
+	client_t *client;	/**< \brief connection, NULL if not running */
+	struct evbuffer *backlog; /**< \brief events waiting for the worker */
+	struct event *restart_ev; /**< \brief delayed restart timer */
+	int delay;		/**< \brief current restart delay */
+	time_t started;		/**< \brief when the worker was spawned */
+	pid_t oldpid;		/**< \brief last process, until it is reaped */
+	uint32_t queued;	/**< \brief events not yet handed to the worker */
+	struct timeval oldest;	/**< \brief when the oldest queued event came in */
+	uint32_t events;	/**< \brief total events sent to the worker */
+	uint32_t lost;		/**< \brief events lost to a dead worker */
+	uint32_t restarts;	/**< \brief number of restarts */
+	uint32_t lat_max;	/**< \brief worst queue latency, in ms */
+	uint64_t lat_total;	/**< \brief sum of latency samples, in ms */
+	uint32_t lat_samples;	/**< \brief number of latency samples */
+	TAILQ_ENTRY(_handler_worker_t) next; /**< \brief next worker */
+} handler_worker_t;
+
+static TAILQ_HEAD(, _handler_worker_t) workers =
+	TAILQ_HEAD_INITIALIZER(workers);
+
+/** \brief handlers that closed their socket but had not exited yet */
+static pid_t *unreaped;
+static int nrofunreaped;
+static int unreapedsize;
+static struct event *reap_ev;
 
 /**
-   \brief Given a device, launch it's handler
-   \param dev device to run handler for
+   \brief Reap a handler, if it has exited
+   \param pid process to check on
+   \return 1 if it is gone, 0 if it is still running
 */
 
-void run_handler_dev(device_t *dev)
+static int handler_reap(pid_t pid)
 {
-	int sv[2], i;
-	pid_t child;
-	char **cmd;
-	client_t *client;
+	int status;
+	pid_t ret;
 
-	/* sanity checks */
-
-	if (dev->handler == NULL) {
-		LOG(LOG_ERROR, "Attempt to call handler for device w/o handler");
-		return;
-	}
-	if (access(dev->handler, X_OK)) {
-		LOG(LOG_ERROR, "Handler %s does not exist or is not"
-		    " executable", dev->handler);
-		return;
+	ret = waitpid(pid, &status, WNOHANG);
+	if (ret == 0)
+		return 0;
+	if (ret == pid) {
+		if (WIFEXITED(status)) {
+			if (WEXITSTATUS(status))
+				LOG(LOG_WARNING, "Handler exited with status"
+				    " %d", WEXITSTATUS(status));
+		} else if (WIFSIGNALED(status))
+			LOG(LOG_WARNING, "Handler got signal %d",
+			    WTERMSIG(status));
 	}
+	return 1;
+}
+
+/**
+   \brief Is a handler still waiting to be reaped?
+   \param pid process
+   \return bool
+*/
+
+static int handler_unreaped(pid_t pid)
+{
+	int i;
+
+	for (i=0; i < nrofunreaped; i++)
+		if (unreaped[i] == pid)
+			return 1;
+	return 0;
+}
+
+/**
+   \brief Timer callback to reap handlers that outlived their socket
+   \param nada used for file descriptor
+   \param what why did we fire?
+   \param arg unused
+*/
+
+static void handler_reap_cb(int nada, short what, void *arg)
+{
+	struct timeval secs = { HANDLER_REAP_RATE, 0 };
+	int i;
+
+	for (i=0; i < nrofunreaped; )
+		if (handler_reap(unreaped[i]))
+			unreaped[i] = unreaped[--nrofunreaped];
+		else
+			i++;
+	if (nrofunreaped > 0)
+		evtimer_add(reap_ev, &secs);
+}
+
+/**
+   \brief Fork a handler and hook it up, just like it was a tcp connection
+   \param cmd argument vector for the handler, cmd[0] is the path
+   \return the new client, or NULL if the fork failed
+*/
+
+static client_t *spawn_handler(char **cmd)
+{
+	int sv[2];
+	pid_t child;
+	client_t *client;
 
-	if (socketpair(PF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK, 0, sv) != 0)
+	/* only our end is non-blocking, the handler reads its end normally */
+	if (socketpair(PF_LOCAL, SOCK_STREAM, 0, sv) != 0)
 		LOG(LOG_FATAL, "Socketpair Failed: %s", strerror(errno));
+	evutil_make_socket_nonblocking(sv[0]);
 
 	child = fork();
 
 	switch (child) {
 	case -1:
 		LOG(LOG_ERROR, "Fork failed: %s", strerror(errno));
-		return;
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
 		break;
 	case 0:	/* we are the child */
 		/* setup the ones we want */
@@ -96,40 +196,325 @@ void run_handler_dev(device_t *dev)
 		/* close the other end */
 		if (close(sv[0]) != 0)
 			bailout();
-
-		/* Now setup args for the handler */
-		cmd = calloc(3 + dev->nrofhargs, sizeof(char *));
-		cmd[0] = strdup(dev->handler);
-		cmd[1] = strdup(dev->uid);
-		for (i = 0; i < dev->nrofhargs; i++)
-			cmd[2 + i] = strdup(dev->hargs[i]);
-		cmd[2+i] = (char *)0;
-		execvp(dev->handler, cmd);
+		execvp(cmd[0], cmd);
 		bailout(); /* if we got here, execvp failed */
 	} /* end switch, now we are back in parent */
 	if (close(sv[1]) != 0)
 		LOG(LOG_ERROR, "close of pair failed: %s", strerror(errno));
 
-	/* now we hook it up, just like it was a tcp connection */
-
 	client = smalloc(client_t);
 	client->fd = sv[0];
 	client->name = strdup("handler");
-	client->addr = strdup(dev->handler);
+	client->addr = strdup(cmd[0]);
 	client->pid = child;
 
 	TAILQ_INIT(&client->devices);
 	TAILQ_INIT(&client->wdevices);
+	TAILQ_INIT(&client->watching);
+	TAILQ_INIT(&client->pending);
 
 	client->ev = bufferevent_socket_new(base, sv[0],
             BEV_OPT_CLOSE_ON_FREE);
 
-	LOG(LOG_NOTICE, "Running handler \"%s %s\"", dev->handler, dev->uid);
-
-	bufferevent_setcb(client->ev, buf_read_cb, NULL,
+	bufferevent_setcb(client->ev, buf_read_cb, buf_write_cb,
 			  buf_error_cb, client);
 	bufferevent_enable(client->ev, EV_READ|EV_PERSIST);
 	TAILQ_INSERT_TAIL(&clients, client, next);
+	return client;
+}
+
+/**
+   \brief Find the worker that owns a client connection
+   \param client client to look for
+   \return the worker, or NULL if this is not a worker
+*/
+
+static handler_worker_t *find_worker_byclient(client_t *client)
+{
+	handler_worker_t *worker;
+
+	TAILQ_FOREACH(worker, &workers, next)
+		if (worker->client == client)
+			return worker;
+	return NULL;
+}
+
+/**
+   \brief Throw away everything queued for a worker
+   \param worker worker to drop events for
+*/
+
+static void worker_drop(handler_worker_t *worker)
+{
+	evbuffer_drain(worker->backlog, evbuffer_get_length(worker->backlog));
+	worker->lost += worker->queued;
+	worker->queued = 0;
+}
+
+/**
+   \brief Write callback for a worker, the worker has everything we sent
+   \param out bufferevent that drained
+   \param arg pointer to client_t of the worker
+*/
+
+static void worker_write_cb(struct bufferevent *out, void *arg)
+{
+	handler_worker_t *worker;
+	struct timeval now;
+	uint32_t ms;
+
+	worker = find_worker_byclient((client_t *)arg);
+	if (worker != NULL && worker->queued > 0) {
+		gettimeofday(&now, NULL);
+		ms = (now.tv_sec - worker->oldest.tv_sec) * 1000 +
+			(now.tv_usec - worker->oldest.tv_usec) / 1000;
+		if (ms > worker->lat_max)
+			worker->lat_max = ms;
+		worker->lat_total += ms;
+		worker->lat_samples++;
+		worker->queued = 0;
+	}
+	buf_write_cb(out, arg);
+}
+
+/**
+   \brief Start a persistent handler and hand it any waiting events
+   \param worker worker to start
+*/
+
+static void worker_start(handler_worker_t *worker)
+{
+	char *cmd[2];
+
+	if (access(worker->path, X_OK)) {
+		LOG(LOG_ERROR, "Handler %s does not exist or is not"
+		    " executable", worker->path);
+		worker_drop(worker);
+		return;
+	}
+	cmd[0] = worker->path;
+	cmd[1] = (char *)0;
+	worker->client = spawn_handler(cmd);
+	if (worker->client == NULL) {
+		worker_drop(worker);
+		return;
+	}
+	worker->started = time(NULL);
+	bufferevent_setcb(worker->client->ev, buf_read_cb, worker_write_cb,
+			  buf_error_cb, worker->client);
+	LOG(LOG_NOTICE, "Started persistent handler %s pid %d",
+	    worker->path, worker->client->pid);
+	if (evbuffer_get_length(worker->backlog) > 0)
+		bufferevent_write_buffer(worker->client->ev, worker->backlog);
+}
+
+/**
+   \brief Timer callback to restart a dead worker
+   \param nada used for file descriptor
+   \param what why did we fire?
+   \param arg pointer to handler_worker_t
+*/
+
+static void worker_restart_cb(int nada, short what, void *arg)
+{
+	handler_worker_t *worker = (handler_worker_t *)arg;
+	struct timeval secs = { HANDLER_REAP_RATE, 0 };
+
+	/* don't run two copies, if the old one hung on, end it first */
+	if (worker->oldpid > 0 && handler_unreaped(worker->oldpid)) {
+		LOG(LOG_WARNING, "Persistent handler %s pid %d closed its "
+		    "socket but is still running, terminating it",
+		    worker->path, worker->oldpid);
+		kill(worker->oldpid, SIGTERM);
+		evtimer_add(worker->restart_ev, &secs);
+		return;
+	}
+	worker->oldpid = 0;
+	worker->restarts++;
+	worker_start(worker);
+}
+
+/**
+   \brief Hand an event to a persistent handler
+   \param worker worker to send to
+   \param dev device that tripped
+*/
+
+static void worker_send(handler_worker_t *worker, device_t *dev)
+{
+	struct evbuffer *send;
+
+	send = evbuffer_new();
+	if (gn_build_update(dev, GNC_UPD_NAME|GNC_UPD_RRDNAME|GNC_UPD_HARGS,
+			    send) != 0) {
+		evbuffer_free(send);
+		return;
+	}
+	evbuffer_add_buffer(worker->backlog, send);
+	evbuffer_free(send);
+
+	if (worker->queued++ == 0)
+		gettimeofday(&worker->oldest, NULL);
+	worker->events++;
+
+	if (worker->client != NULL)
+		bufferevent_write_buffer(worker->client->ev, worker->backlog);
+	else if (!evtimer_pending(worker->restart_ev, NULL))
+		worker_start(worker);
+	/* otherwise it waits in the backlog for the restart */
+}
+
+/**
+   \brief A client went away, if it was a worker, schedule a restart
+   \param client client that is being closed
+*/
+
+static void handler_worker_lost(client_t *client)
+{
+	handler_worker_t *worker;
+	struct timeval secs = { 0, 0 };
+
+	worker = find_worker_byclient(client);
+	if (worker == NULL)
+		return;
+	worker->client = NULL;
+	worker->oldpid = client->pid;
+	/* whatever was in the socket went down with it */
+	worker->lost += worker->queued;
+	worker->queued = 0;
+
+	/* back off if it keeps dying right away */
+	if (time(NULL) - worker->started >= WORKER_STABLE_TIME)
+		worker->delay = 1;
+	else if (worker->delay * 2 <= WORKER_MAX_DELAY)
+		worker->delay *= 2;
+	else
+		worker->delay = WORKER_MAX_DELAY;
+
+	LOG(LOG_WARNING, "Persistent handler %s died, restarting in %d "
+	    "seconds", worker->path, worker->delay);
+	secs.tv_sec = worker->delay;
+	evtimer_add(worker->restart_ev, &secs);
+}
+
+/**
+   \brief A handler's connection is closing, reap it and restart workers
+   \param client client of the handler
+   \note Never waits on the process.  One that has not exited yet is
+   reaped later from a timer, and a worker is only restarted once its
+   old process is gone.
+*/
+
+void handler_closed(client_t *client)
+{
+	struct timeval secs = { HANDLER_REAP_RATE, 0 };
+
+	if (!handler_reap(client->pid)) {
+		if (nrofunreaped == unreapedsize) {
+			unreapedsize = (unreapedsize) ? unreapedsize * 2 : 4;
+			unreaped = realloc(unreaped,
+					   sizeof(pid_t) * unreapedsize);
+			if (unreaped == NULL)
+				bailout();
+		}
+		unreaped[nrofunreaped++] = client->pid;
+		if (reap_ev == NULL)
+			reap_ev = evtimer_new(base, handler_reap_cb, NULL);
+		if (!evtimer_pending(reap_ev, NULL))
+			evtimer_add(reap_ev, &secs);
+	}
+	handler_worker_lost(client);
+}
+
+/**
+   \brief Log statistics for the persistent handlers
+*/
+
+void handler_worker_stats(void)
+{
+	handler_worker_t *worker;
+
+	TAILQ_FOREACH(worker, &workers, next)
+		LOG(LOG_NOTICE, "Handler %s pid:%d events:%d queued:%d "
+		    "lost:%d restarts:%d latency avg:%dms max:%dms",
+		    worker->path,
+		    worker->client ? worker->client->pid : 0,
+		    worker->events, worker->queued, worker->lost,
+		    worker->restarts,
+		    worker->lat_samples ?
+		    (int)(worker->lat_total / worker->lat_samples) : 0,
+		    worker->lat_max);
+}
+
+/**
+   \brief Set up a worker for each configured persistent handler
+   \note workers are started when their first event arrives
+*/
+
+void init_handler_workers(void)
+{
+	handler_worker_t *worker;
+	int i;
+
+	for (i = 0; i < cfg_size(cfg, "persistent_handlers"); i++) {
+		worker = smalloc(handler_worker_t);
+		worker->path = strdup(cfg_getnstr(cfg, "persistent_handlers",
+						  i));
+		worker->backlog = evbuffer_new();
+		worker->restart_ev = evtimer_new(base, worker_restart_cb,
+						 worker);
+		worker->delay = 1;
+		TAILQ_INSERT_TAIL(&workers, worker, next);
+		LOG(LOG_DEBUG, "Handler %s will run persistently",
+		    worker->path);
+	}
+}
+
+/**
+   \brief Given a device, launch it's handler
+   \param dev device to run handler for
+*/
+
+void run_handler_dev(device_t *dev)
+{
+	int i;
+	char **cmd;
+	client_t *client;
+	handler_worker_t *worker;
+
+	/* sanity checks */
+
+	if (dev->handler == NULL) {
+		LOG(LOG_ERROR, "Attempt to call handler for device w/o handler");
+		return;
+	}
+
+	TAILQ_FOREACH(worker, &workers, next)
+		if (strcmp(worker->path, dev->handler) == 0) {
+			worker_send(worker, dev);
+			return;
+		}
+
+	if (access(dev->handler, X_OK)) {
+		LOG(LOG_ERROR, "Handler %s does not exist or is not"
+		    " executable", dev->handler);
+		return;
+	}
+
+	/* Now setup args for the handler */
+	cmd = calloc(3 + dev->nrofhargs, sizeof(char *));
+	cmd[0] = dev->handler;
+	cmd[1] = dev->uid;
+	for (i = 0; i < dev->nrofhargs; i++)
+		cmd[2 + i] = dev->hargs[i];
+	cmd[2+i] = (char *)0;
+	client = spawn_handler(cmd);
+	free(cmd);
+	if (client == NULL)
+		return;
+
+	LOG(LOG_NOTICE, "Running handler \"%s %s\"", dev->handler, dev->uid);
+
 	/* now, tell the client about the change */
 	gn_update_device(dev, GNC_UPD_NAME|GNC_UPD_RRDNAME, client->ev);
 }
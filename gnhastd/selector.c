@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file selector.c
+   \brief Device selectors for cfeed, feed and ask
+   \author Tim Rightnour
+
+   A selector names a set of devices by group (glist:), tag (tags:), uid
+   pattern (uid: containing *, ? or [) and optionally devt:/subt:.  The
+   qualifiers given must all match, and a comma separated glist or tags
+   matches if any one entry does.  Selectors are checked against the device
+   when it updates, so devices registered after the subscription are
+   picked up, and a subscription costs one selector however many devices
+   it covers.
+
+   Which clients select a device is cached in the device's local data,
+   so an update does not run every client's patterns.  The cache is
+   rebuilt on the next update after selector_gen moves, which happens
+   whenever a selector comes or goes, or a device changes something a
+   selector matches on.  A selector feed keeps the devices it matches the
+   same way, so a tick only visits those.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include <sys/queue.h>
+
+#include "gnhast.h"
+#include "common.h"
+#include "commands.h"
+#include "gnhastd.h"
+
+/** \brief how deep to follow child groups looking for a device */
+#define SELECTOR_MAX_DEPTH	16
+
+extern TAILQ_HEAD(, _client_t) clients;
+extern TAILQ_HEAD(, _device_t) alldevs;
+
+/** \brief number of cfeed selectors held by all clients */
+int nrofselectors = 0;
+/** \brief number of selectors with a deadband */
+static int nrofdbselectors = 0;
+
+/** \brief bumped to throw away every device's cached selecting clients */
+uint32_t selector_gen = 1;
+
+/**
+   \brief Split a comma separated list into an array of strings
+   \param list list to split
+   \param out filled in with the array
+   \return number of entries
+*/
+
+static int split_list(char *list, char ***out)
+{
+	char *hold, *p, *last;
+	int n = 0;
+
+	*out = NULL;
+	hold = strdup(list);
+	for (p = strtok_r(hold, ",", &last); p != NULL;
+	     p = strtok_r(NULL, ",", &last)) {
+		*out = realloc(*out, sizeof(char *) * (n + 1));
+		if (*out == NULL)
+			bailout();
+		(*out)[n++] = strdup(p);
+	}
+	free(hold);
+	return n;
+}
+
+/**
+   \brief Is a device in a group, or any of its child groups?
+   \param dev device to look for
+   \param grp group to look in
+   \param depth how many groups down we are already
+   \return bool
+*/
+
+static int dev_in_group_tree(device_t *dev, device_group_t *grp, int depth)
+{
+	wrap_group_t *child;
+
+	if (dev_in_group(dev, grp))
+		return 1;
+	if (depth >= SELECTOR_MAX_DEPTH)
+		return 0;
+	TAILQ_FOREACH(child, &grp->children, nextg)
+		if (dev_in_group_tree(dev, child->group, depth + 1))
+			return 1;
+	return 0;
+}
+
+/**
+   \brief Build a selector from the arguments of a cfeed, feed or ask
+   \param args The list of arguments
+   \param bytags if false, a tags: argument is not a qualifier (ask uses
+   it to ask for the tags to be sent)
+   \return the selector, NULL if the arguments name a single device
+   \note A uid is only taken as a pattern if it has glob characters in
+   it and no device has it as its actual uid.
+*/
+
+selector_t *new_selector(pargs_t *args, int bytags)
+{
+	selector_t *sel;
+	char *uid = NULL, *glist = NULL, *tags = NULL;
+	uint32_t devtmask = 0;
+	uint64_t subtmask = 0;
+	int i;
+
+	for (i=0; args[i].cword != -1; i++) {
+		switch (args[i].cword) {
+		case SC_UID:
+			uid = args[i].arg.c;
+			break;
+		case SC_GROUPLIST:
+			glist = args[i].arg.c;
+			break;
+		case SC_TAGS:
+			if (bytags)
+				tags = args[i].arg.c;
+			break;
+		case SC_DEVTYPE:
+			if (args[i].arg.i > 0 && args[i].arg.i < 32)
+				devtmask |= 1U << args[i].arg.i;
+			break;
+		case SC_SUBTYPE:
+			if (args[i].arg.i > 0 && args[i].arg.i < 64)
+				subtmask |= (uint64_t)1 << args[i].arg.i;
+			break;
+		}
+	}
+	if (uid != NULL && (strpbrk(uid, "*?[") == NULL ||
+			    find_device_byuid(uid) != NULL) &&
+	    glist == NULL && tags == NULL)
+		return NULL;
+	if (uid == NULL && glist == NULL && tags == NULL)
+		return NULL;
+
+	sel = smalloc(selector_t);
+	if (uid != NULL)
+		sel->uidpat = strdup(uid);
+	if (glist != NULL)
+		sel->nrofgroups = split_list(glist, &sel->groups);
+	if (tags != NULL)
+		sel->nroftags = split_list(tags, &sel->tags);
+	sel->devtmask = devtmask;
+	sel->subtmask = subtmask;
+	parse_deadband(args, &sel->db);
+	if (sel->db.on)
+		nrofdbselectors++;
+	return sel;
+}
+
+/**
+   \brief Free a selector
+   \param sel selector to free
+*/
+
+void free_selector(selector_t *sel)
+{
+	int i;
+
+	if (sel->uidpat != NULL)
+		free(sel->uidpat);
+	for (i=0; i < sel->nrofgroups; i++)
+		free(sel->groups[i]);
+	if (sel->groups != NULL)
+		free(sel->groups);
+	for (i=0; i < sel->nroftags; i++)
+		free(sel->tags[i]);
+	if (sel->tags != NULL)
+		free(sel->tags);
+	if (sel->devs != NULL)
+		free(sel->devs);
+	if (sel->dbs != NULL)
+		free(sel->dbs);
+	if (sel->db.on)
+		nrofdbselectors--;
+	free(sel);
+}
+
+/**
+   \brief Does a device match a selector?
+   \param sel selector to check
+   \param dev device to check
+   \return bool
+   \note Groups are looked up by uid each time, so a group registered
+   after the selector still counts.
+*/
+
+int selector_match(selector_t *sel, device_t *dev)
+{
+	device_group_t *grp;
+	int i, j;
+
+	if (sel->devtmask != 0 &&
+	    (dev->type >= 32 || !(sel->devtmask & (1U << dev->type))))
+		return 0;
+	if (sel->subtmask != 0 && (dev->subtype >= 64 ||
+	    !(sel->subtmask & ((uint64_t)1 << dev->subtype))))
+		return 0;
+	if (sel->uidpat != NULL && fnmatch(sel->uidpat, dev->uid, 0) != 0)
+		return 0;
+	if (sel->nrofgroups > 0) {
+		for (i=0; i < sel->nrofgroups; i++) {
+			grp = find_devgroup_byuid(sel->groups[i]);
+			if (grp != NULL && dev_in_group_tree(dev, grp, 0))
+				break;
+		}
+		if (i == sel->nrofgroups)
+			return 0;
+	}
+	if (sel->nroftags > 0) {
+		for (i=0; i < sel->nroftags; i++)
+			for (j=0; j < dev->nroftags; j++)
+				if (fnmatch(sel->tags[i], dev->tags[j], 0) == 0)
+					return 1;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+   \brief Give a client a cfeed selector
+   \param client client subscribing
+   \param sel selector from new_selector()
+*/
+
+void add_client_selector(client_t *client, selector_t *sel)
+{
+	if (TAILQ_EMPTY(&client->selectors))
+		TAILQ_INIT(&client->selectors);
+	TAILQ_INSERT_TAIL(&client->selectors, sel, next);
+	nrofselectors++;
+	selectors_changed();
+}
+
+/**
+   \brief Drop all of a client's cfeed selectors
+   \param client client going away
+*/
+
+void remove_client_selectors(client_t *client)
+{
+	selector_t *sel;
+
+	if (TAILQ_EMPTY(&client->selectors))
+		return;
+	while ((sel = TAILQ_FIRST(&client->selectors)) != NULL) {
+		TAILQ_REMOVE(&client->selectors, sel, next);
+		free_selector(sel);
+		nrofselectors--;
+	}
+	/* the caches may point at this client, drop them before it goes */
+	selectors_changed();
+}
+
+/**
+   \brief Does any of a client's cfeed selectors match a device?
+   \param client client to check
+   \param dev device to check
+   \return bool
+*/
+
+int client_selects(client_t *client, device_t *dev)
+{
+	selector_t *sel;
+
+	TAILQ_FOREACH(sel, &client->selectors, next)
+		if (selector_match(sel, dev))
+			return 1;
+	return 0;
+}
+
+/**
+   \brief Note that which devices the selectors match may have changed
+   \note Call this when a selector is added or removed, or when a device's
+   type, subtype, tags or groups change.
+*/
+
+void selectors_changed(void)
+{
+	if (++selector_gen == 0)
+		selector_gen = 1; /* 0 is what a fresh devlocal_t holds */
+}
+
+/**
+   \brief Get the clients with a cfeed selector matching a device
+   \param dev device to look up
+   \param out filled in with the array of clients
+   \return number of clients
+   \note The array is only good until the next selectors_changed().
+*/
+
+int selecting_clients(device_t *dev, client_t ***out)
+{
+	devlocal_t *local = dev_localdata(dev);
+	client_t *client;
+
+	if (local->selgen != selector_gen) {
+		local->nrofselclients = 0;
+		TAILQ_FOREACH(client, &clients, next) {
+			if (TAILQ_EMPTY(&client->selectors) ||
+			    !client_selects(client, dev))
+				continue;
+			if (local->nrofselclients == local->selclientsize) {
+				local->selclientsize = (local->selclientsize) ?
+				    local->selclientsize * 2 : 4;
+				local->selclients = realloc(local->selclients,
+				    sizeof(client_t *) * local->selclientsize);
+				if (local->selclients == NULL)
+					bailout();
+			}
+			local->selclients[local->nrofselclients++] = client;
+		}
+		local->selgen = selector_gen;
+	}
+	*out = local->selclients;
+	return local->nrofselclients;
+}
+
+/**
+   \brief Find every device a selector matches
+   \param sel selector to check
+   \param out filled in with an array of the devices
+   \return number of devices
+   \note The array is kept in the selector.  It is rebuilt after
+   selector_gen moves, and otherwise only devices added to the table since
+   the last call are checked, as devices are never removed and new ones go
+   on the end of alldevs.
+*/
+
+int selector_devices(selector_t *sel, device_t ***out)
+{
+	device_t *dev;
+
+	if (sel->devgen != selector_gen) {
+		sel->nrofdevs = 0;
+		sel->lastseen = NULL;
+		sel->devgen = selector_gen;
+	}
+	dev = (sel->lastseen) ? TAILQ_NEXT(sel->lastseen, next_all) :
+	    TAILQ_FIRST(&alldevs);
+	for (; dev != NULL; dev = TAILQ_NEXT(dev, next_all)) {
+		sel->lastseen = dev;
+		if (!selector_match(sel, dev))
+			continue;
+		if (sel->nrofdevs == sel->devsize) {
+			sel->devsize = (sel->devsize) ? sel->devsize * 2 : 16;
+			sel->devs = realloc(sel->devs,
+			    sizeof(device_t *) * sel->devsize);
+			if (sel->devs == NULL)
+				bailout();
+		}
+		sel->devs[sel->nrofdevs++] = dev;
+	}
+	*out = sel->devs;
+	return sel->nrofdevs;
+}
+
+/**
+   \brief Check a device against a selector's deadband
+   \param sel selector, with db filled in
+   \param dev device about to be sent
+   \return 1 if the value should be sent, see deadband_check()
+   \note Each device the selector matches keeps its own deadband state,
+   indexed by the device's handle, so one device moving does not hold
+   back another.
+*/
+
+int selector_deadband(selector_t *sel, device_t *dev)
+{
+	deadband_t *db;
+	uint32_t newsize;
+
+	if (!sel->db.on)
+		return 1;
+	if (dev->handle >= sel->dbsize) {
+		newsize = (sel->dbsize) ? sel->dbsize : 64;
+		while (newsize <= dev->handle)
+			newsize *= 2;
+		sel->dbs = realloc(sel->dbs, sizeof(deadband_t) * newsize);
+		if (sel->dbs == NULL)
+			bailout();
+		memset(sel->dbs + sel->dbsize, 0,
+		    sizeof(deadband_t) * (newsize - sel->dbsize));
+		sel->dbsize = newsize;
+	}
+	db = &sel->dbs[dev->handle];
+	if (!db->on)
+		*db = sel->db; /* the settings, not yet primed */
+	return deadband_check(dev, db);
+}
+
+/**
+   \brief Check a device against the deadband of the cfeed selector that
+   picked it for a client
+   \param client client selecting the device
+   \param dev device about to be sent
+   \return 1 if the value should be sent
+   \note The first of the client's selectors that matches decides.
+*/
+
+int client_selector_deadband(client_t *client, device_t *dev)
+{
+	selector_t *sel;
+
+	if (nrofdbselectors == 0)
+		return 1;
+	TAILQ_FOREACH(sel, &client->selectors, next)
+		if (selector_match(sel, dev))
+			return selector_deadband(sel, dev);
+	return 1;
+}
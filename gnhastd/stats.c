@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2013
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file stats.c
+   \brief Rolling min/max/avg/sdev/rate of devices over time windows
+   \author Tim Rightnour
+
+   Each window is cut into STATS_BUCKETS buckets of equal length.  A new
+   value is added to the current bucket and to the window's running
+   totals, so an update costs the same however many values the window
+   holds.  When time moves past the current bucket the oldest bucket is
+   emptied and reused, and the totals are summed up again from the
+   buckets, which also keeps rounding errors in the sums from building
+   up.  A window therefore covers between len - len/STATS_BUCKETS and len
+   seconds.
+
+   Devices of the subtypes in stats_subtypes keep stats, as does the
+   source of each stats_devices entry.  Those entries also make a virtual
+   device (proto calculated) that holds one aggregate of the source, is
+   updated whenever the source is, and can be fed or watched like any
+   other device.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "gnhast.h"
+#include "gnhastd.h"
+#include "common.h"
+
+extern cfg_t *cfg;
+
+/** \brief buckets per window */
+#define STATS_BUCKETS	30
+
+enum STAT_FUNCS {
+	STAT_MIN,
+	STAT_MAX,
+	STAT_AVG,
+	STAT_SDEV,
+	STAT_RATE,
+	NROF_STAT_FUNCS,
+};
+
+static const char *statfuncs[NROF_STAT_FUNCS] = {
+	"min",
+	"max",
+	"avg",
+	"sdev",
+	"rate",
+};
+
+/** \brief The values that arrived in one slice of a window */
+typedef struct _statbucket_t {
+	uint32_t n;		/**< \brief number of values */
+	double sum;		/**< \brief sum of the values */
+	double sumsq;		/**< \brief sum of their squares */
+	double min;		/**< \brief lowest */
+	double max;		/**< \brief highest */
+	double first;		/**< \brief first value */
+	double last;		/**< \brief last value */
+	time_t tfirst;		/**< \brief when the first arrived */
+	time_t tlast;		/**< \brief when the last arrived */
+} statbucket_t;
+
+/** \brief One window of a device */
+typedef struct _statwin_t {
+	time_t start;		/**< \brief start of the current bucket */
+	int cur;		/**< \brief current bucket */
+	statbucket_t tot;	/**< \brief totals of all the buckets */
+	statbucket_t b[STATS_BUCKETS]; /**< \brief the buckets */
+} statwin_t;
+
+/** \brief A virtual device holding one aggregate of another device */
+typedef struct _statvdev_t {
+	char *srcuid;		/**< \brief uid of the source device */
+	int func;		/**< \brief STAT_* */
+	int win;		/**< \brief which window */
+	int subtype;		/**< \brief subtype to give it, 0 for default */
+	device_t *dev;		/**< \brief the device, once made */
+} statvdev_t;
+
+/** \brief Stats of one device, a statwin_t per window */
+struct _devstats_t {
+	statvdev_t **vdevs;	/**< \brief virtual devices fed from us */
+	int nrofvdevs;		/**< \brief number of vdevs */
+	statwin_t w[];		/**< \brief the windows */
+};
+
+/** \brief window lengths, seconds */
+static int *windows;
+static int nrofwindows;
+/** \brief which subtypes keep stats */
+static int stat_subtype[NROF_SUBTYPES];
+static statvdev_t *vdevs;
+static int nrofvdevs;
+/** \brief whoever had dev_data_stored before us */
+static void (*stats_next_cb)(device_t *dev);
+
+/**
+   \brief Length of the buckets of a window
+   \param win which window
+   \return seconds
+*/
+
+static int stats_width(int win)
+{
+	return MAX(windows[win] / STATS_BUCKETS, 1);
+}
+
+/**
+   \brief Add a value to a bucket
+   \param b bucket
+   \param v value
+   \param now time of the value
+*/
+
+static void stats_bucket_add(statbucket_t *b, double v, time_t now)
+{
+	if (b->n == 0) {
+		b->min = b->max = b->first = v;
+		b->tfirst = now;
+	} else {
+		b->min = MIN(b->min, v);
+		b->max = MAX(b->max, v);
+	}
+	b->n++;
+	b->sum += v;
+	b->sumsq += v * v;
+	b->last = v;
+	b->tlast = now;
+}
+
+/**
+   \brief Sum a window's buckets up into its totals
+   \param w window
+*/
+
+static void stats_total(statwin_t *w)
+{
+	statbucket_t *b, *t = &w->tot;
+	int i;
+
+	memset(t, 0, sizeof(statbucket_t));
+	/* oldest first, so first and last come out right */
+	for (i = 1; i <= STATS_BUCKETS; i++) {
+		b = &w->b[(w->cur + i) % STATS_BUCKETS];
+		if (b->n == 0)
+			continue;
+		if (t->n == 0) {
+			t->min = b->min;
+			t->max = b->max;
+			t->first = b->first;
+			t->tfirst = b->tfirst;
+		} else {
+			t->min = MIN(t->min, b->min);
+			t->max = MAX(t->max, b->max);
+		}
+		t->n += b->n;
+		t->sum += b->sum;
+		t->sumsq += b->sumsq;
+		t->last = b->last;
+		t->tlast = b->tlast;
+	}
+}
+
+/**
+   \brief Move a window up to now, dropping buckets that have aged out
+   \param w window
+   \param width length of its buckets
+   \param now the time
+*/
+
+static void stats_advance(statwin_t *w, int width, time_t now)
+{
+	time_t steps;
+
+	steps = (now - w->start) / width;
+	if (steps <= 0)
+		return;
+	w->start += steps * width;
+	if (steps > STATS_BUCKETS)
+		steps = STATS_BUCKETS;
+	while (steps-- > 0) {
+		w->cur = (w->cur + 1) % STATS_BUCKETS;
+		memset(&w->b[w->cur], 0, sizeof(statbucket_t));
+	}
+	stats_total(w);
+}
+
+/**
+   \brief Fill in the aggregates of a window
+   \param ds device's stats
+   \param win which window
+   \param st filled in
+*/
+
+static void stats_fill(devstats_t *ds, int win, stats_t *st)
+{
+	statbucket_t *t = &ds->w[win].tot;
+	double var;
+
+	stats_advance(&ds->w[win], stats_width(win), time(NULL));
+	memset(st, 0, sizeof(stats_t));
+	st->window = windows[win];
+	st->n = t->n;
+	if (t->n == 0)
+		return;
+	st->min = t->min;
+	st->max = t->max;
+	st->avg = t->sum / t->n;
+	var = t->sumsq / t->n - st->avg * st->avg;
+	st->sdev = (var > 0.0) ? sqrt(var) : 0.0;
+	if (t->tlast > t->tfirst)
+		st->rate = (t->last - t->first) / (t->tlast - t->tfirst);
+}
+
+/**
+   \brief Find or make the virtual device of a stats_devices entry
+   \param sv the entry
+   \param src its source device
+   \return device
+*/
+
+static device_t *stats_vdev_device(statvdev_t *sv, device_t *src)
+{
+	device_t *dev;
+	char uid[256], name[256];
+
+	snprintf(uid, sizeof(uid), "%s-%s%d", src->uid, statfuncs[sv->func],
+		 windows[sv->win]);
+	dev = find_device_byuid(uid);
+	if (dev != NULL)
+		return dev;
+
+	LOG(LOG_NOTICE, "Creating stats device %s", uid);
+	dev = smalloc(device_t);
+	dev->uid = strdup(uid);
+	snprintf(name, sizeof(name), "%s %s %ds",
+		 (src->name != NULL) ? src->name : src->uid,
+		 statfuncs[sv->func], windows[sv->win]);
+	dev->name = strdup(name);
+	dev->rrdname = mk_rrdname(uid);
+	dev->type = DEVICE_SENSOR;
+	dev->proto = PROTO_CALCULATED;
+	if (sv->subtype)
+		dev->subtype = sv->subtype;
+	else if (sv->func == STAT_RATE && src->subtype == SUBTYPE_WATTSEC)
+		dev->subtype = SUBTYPE_WATT; /* wattseconds per second */
+	else
+		dev->subtype = src->subtype;
+	dev->scale = src->scale;
+	SET_FLAG(dev->flags, DEVFLAG_DIRTY);
+	TAILQ_INIT(&dev->watchers);
+	insert_device(dev);
+	return dev;
+}
+
+/**
+   \brief Store an aggregate into a virtual device, and tell its watchers
+   \param dev virtual device
+   \param v value
+*/
+
+static void stats_vdev_store(device_t *dev, double v)
+{
+	uint32_t u;
+	int64_t ll;
+
+	switch (datatype_dev(dev)) {
+	case DATATYPE_UINT:
+		u = (v > 0.0) ? (uint32_t)llround(v) : 0;
+		store_data_dev(dev, DATALOC_DATA, &u);
+		break;
+	case DATATYPE_LL:
+		ll = llround(v);
+		store_data_dev(dev, DATALOC_DATA, &ll);
+		break;
+	case DATATYPE_DOUBLE:
+	default:
+		store_data_dev(dev, DATALOC_DATA, &v);
+		break;
+	}
+	(void)time(&dev->last_upd);
+	notify_watchers(dev);
+	rules_eval(dev);
+}
+
+/**
+   \brief Decide whether a device keeps stats, and set them up if so
+   \param dev device
+   \param local its local data
+*/
+
+static void stats_setup(device_t *dev, devlocal_t *local)
+{
+	devstats_t *ds;
+	time_t now;
+	int i, n;
+
+	for (i=0, n=0; i < nrofvdevs; i++)
+		if (strcmp(vdevs[i].srcuid, dev->uid) == 0)
+			n++;
+	if (n == 0 && (dev->subtype >= NROF_SUBTYPES ||
+		       !stat_subtype[dev->subtype])) {
+		local->nostats = 1;
+		return;
+	}
+
+	ds = safer_malloc(sizeof(devstats_t) + nrofwindows * sizeof(statwin_t));
+	now = time(NULL);
+	for (i=0; i < nrofwindows; i++)
+		ds->w[i].start = now - now % stats_width(i);
+	if (n > 0) {
+		ds->vdevs = safer_malloc(n * sizeof(statvdev_t *));
+		for (i=0; i < nrofvdevs; i++)
+			if (strcmp(vdevs[i].srcuid, dev->uid) == 0) {
+				vdevs[i].dev = stats_vdev_device(&vdevs[i], dev);
+				ds->vdevs[ds->nrofvdevs++] = &vdevs[i];
+			}
+	}
+	local->stats = ds;
+}
+
+/**
+   \brief Add a device's new value to its stats
+   \param dev device
+*/
+
+static void stats_store_cb(device_t *dev)
+{
+	devlocal_t *local = dev_localdata(dev);
+	devstats_t *ds;
+	statvdev_t *sv;
+	stats_t st;
+	time_t now;
+	double v, agg[NROF_STAT_FUNCS];
+	int i;
+
+	if (local->stats == NULL && !local->nostats)
+		stats_setup(dev, local);
+	if ((ds = local->stats) != NULL) {
+		now = time(NULL);
+		v = get_double_store(dev, &dev->data);
+		for (i=0; i < nrofwindows; i++) {
+			stats_advance(&ds->w[i], stats_width(i), now);
+			stats_bucket_add(&ds->w[i].b[ds->w[i].cur], v, now);
+			stats_bucket_add(&ds->w[i].tot, v, now);
+		}
+		for (i=0; i < ds->nrofvdevs; i++) {
+			sv = ds->vdevs[i];
+			stats_fill(ds, sv->win, &st);
+			agg[STAT_MIN] = st.min;
+			agg[STAT_MAX] = st.max;
+			agg[STAT_AVG] = st.avg;
+			agg[STAT_SDEV] = st.sdev;
+			agg[STAT_RATE] = st.rate;
+			stats_vdev_store(sv->dev, agg[sv->func]);
+		}
+	}
+
+	if (stats_next_cb != NULL)
+		stats_next_cb(dev);
+}
+
+/**
+   \brief Parse a stats_devices entry, "uid func window [subtype]"
+   \param entry the entry
+   \param sv filled in
+   \return 0 if it was good
+*/
+
+static int stats_parse_vdev(const char *entry, statvdev_t *sv)
+{
+	char uid[256], func[16], subtype[64];
+	int window, i, n;
+
+	memset(sv, 0, sizeof(statvdev_t));
+	subtype[0] = '\0';
+	n = sscanf(entry, "%255s %15s %d %63s", uid, func, &window, subtype);
+	if (n < 3)
+		return -1;
+	for (sv->func = 0; sv->func < NROF_STAT_FUNCS; sv->func++)
+		if (strcmp(func, statfuncs[sv->func]) == 0)
+			break;
+	if (sv->func == NROF_STAT_FUNCS)
+		return -1;
+	for (i=0, sv->win = -1; i < nrofwindows; i++)
+		if (windows[i] == window)
+			sv->win = i;
+	if (sv->win < 0)
+		return -1;
+	if (n == 4 && (sv->subtype = find_subtype_byname(subtype)) < 0)
+		return -1;
+	sv->srcuid = strdup(uid);
+	return 0;
+}
+
+/**
+   \brief Read the stats windows and devices, and start keeping stats
+   \note Call after init_journal(), so replayed values are not counted.
+*/
+
+void init_stats(void)
+{
+	int i, st, n;
+	char *p;
+
+	nrofwindows = cfg_size(cfg, "stats_windows");
+	if (nrofwindows == 0)
+		return;
+	windows = safer_malloc(nrofwindows * sizeof(int));
+	for (i=0, n=0; i < nrofwindows; i++)
+		if (cfg_getnint(cfg, "stats_windows", i) > 0)
+			windows[n++] = cfg_getnint(cfg, "stats_windows", i);
+	nrofwindows = n;
+	if (nrofwindows == 0)
+		return;
+
+	for (i=0; i < cfg_size(cfg, "stats_subtypes"); i++) {
+		p = cfg_getnstr(cfg, "stats_subtypes", i);
+		if ((st = find_subtype_byname(p)) < 0)
+			LOG(LOG_ERROR, "Bad stats_subtypes entry: %s", p);
+		else
+			stat_subtype[st] = 1;
+	}
+
+	n = cfg_size(cfg, "stats_devices");
+	if (n > 0)
+		vdevs = safer_malloc(n * sizeof(statvdev_t));
+	for (i=0; i < n; i++) {
+		p = cfg_getnstr(cfg, "stats_devices", i);
+		if (stats_parse_vdev(p, &vdevs[nrofvdevs]) == 0)
+			nrofvdevs++;
+		else
+			LOG(LOG_ERROR, "Bad stats_devices entry: %s", p);
+	}
+
+	stats_next_cb = dev_data_stored;
+	dev_data_stored = stats_store_cb;
+}
+
+/**
+   \brief Get the rolling aggregates of a device
+   \param dev device
+   \param window length of the window wanted, the closest one is used,
+   0 for the first
+   \param st filled in
+   \return 0 on success, -1 if the device keeps no stats
+*/
+
+int stats_get(device_t *dev, int window, stats_t *st)
+{
+	devlocal_t *local = (devlocal_t *)dev->localdata;
+	int i, win;
+
+	if (local == NULL || local->stats == NULL)
+		return -1;
+	for (i=0, win=0; i < nrofwindows; i++)
+		if (abs(windows[i] - window) < abs(windows[win] - window))
+			win = i;
+	if (window <= 0)
+		win = 0;
+	stats_fill(local->stats, win, st);
+	return 0;
+}
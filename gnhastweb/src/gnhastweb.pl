@@ -442,10 +442,16 @@ foreach $key (keys(%groups)) {
     $devices{$dev}{'ischild'} = 1;
   }
 }
+# newer gnhastd can hand us every value in one snapshot, one more per
+# scaled subtype so those come back in the scale we display
+@apiv = &send_gn_cmd($sock, "getapiv", "\n");
+($junk, $apiv) = split(/:/, $apiv[0]);
+
 foreach $key (keys(%devices)) {
   if ($devices{$key}{'ischild'} eq undef) {
     push @uncatdevices, $key;
   }
+  next if ($apiv >= 0x16);
   if ($sthasscale[$devices{$key}{'subt'}] ne "") {
     local $sc = $scales{$sthasscale[$devices{$key}{'subt'}]};
     @ask = &send_gn_cmd($sock, "ask uid:$key scale:$sc", "\n");
@@ -454,6 +460,17 @@ foreach $key (keys(%devices)) {
   }
   push @newdata, @ask;
 }
+if ($apiv >= 0x16) {
+  @newdata = &send_gn_cmd($sock, "snapshot", "endsnap");
+  pop(@newdata);
+  for ($i=0; $i <= $#sthasscale; $i++) {
+    next if ($sthasscale[$i] eq "" || $scales{$sthasscale[$i]} eq "");
+    @snap = &send_gn_cmd($sock, "snapshot subt:$i scale:$scales{$sthasscale[$i]}",
+			 "endsnap");
+    pop(@snap);
+    push @newdata, @snap;
+  }
+}
 &parse_devdata(@newdata);
 
 # do we have fake groups?
@@ -1349,6 +1366,7 @@ sub parse_devdata {
     @data = quotewords(" ", 0, $line);
     shift @data if ($data[0] eq "reg"); # discard reg
     shift @data if ($data[0] eq "upd"); # discard upd
+    shift @data if ($data[0] eq "snap"); # discard snap
     ($junk, $uid) = split(/:/, $data[0]);
     foreach $kv (@data) {
       ($key, $value) = split(/:/, $kv);
@@ -783,7 +783,6 @@ int main(int argc, char **argv)
 	int ch, fd;
 	char *buf;
 	struct event *ev;
-	struct timeval secs = {0, 0};
 
 	/* process command line arguments */
 	while ((ch = getopt(argc, argv, "?c:dm:")) != -1)
@@ -876,9 +875,7 @@ int main(int argc, char **argv)
 	event_add(ev, NULL);
 
 	/* update timer devices */
-	secs.tv_sec = 1;
-	ev = event_new(base, -1, EV_PERSIST, cb_timerdev_update, NULL);
-	event_add(ev, &secs);
+	init_timerdevs(base);
 
 	/* go forth and destroy */
 	event_base_dispatch(base);
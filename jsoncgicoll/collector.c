@@ -93,6 +93,7 @@ connection_t *gnhastd_conn;
 int need_rereg = 0;
 extern int debugmode;
 extern int collector_instance;
+extern int gnhastd_apiv;
 
 /* Example options setup */
 
@@ -201,74 +202,105 @@ void coll_alarm_cb(alarm_t *alarm, char *aluid, void *arg)
 	fflush(stdout);
 }
 
+/**
+   \brief Which scale do we want a subtype in?
+   \param subtype subtype to look up
+   \return scale, 0 for native
+*/
+
+static int jsoncoll_scale(int subtype)
+{
+	switch (subtype) {
+	case SUBTYPE_TEMP:
+		return cfg_getint(jsoncgicoll_c, "tscale");
+	case SUBTYPE_PRESSURE:
+		return cfg_getint(jsoncgicoll_c, "baroscale");
+	case SUBTYPE_SPEED:
+		return cfg_getint(jsoncgicoll_c, "speedscale");
+	case SUBTYPE_RAINRATE:
+		return cfg_getint(jsoncgicoll_c, "lengthscale");
+	case SUBTYPE_LUX:
+		return cfg_getint(jsoncgicoll_c, "lightscale");
+	}
+	return 0;
+}
+
+/**
+   \brief Subscribe to a device, or to every device of a type/subtype
+   \param send evbuffer to add the feed and ask to
+   \param dev device to subscribe to
+   \param bykind if true, ask for every device with dev's type and subtype
+*/
+
+static void jsoncoll_subscribe(struct evbuffer *send, device_t *dev,
+			       int bykind)
+{
+	char sel[128];
+	int scale;
+
+	if (bykind)
+		snprintf(sel, sizeof(sel), "%s:* %s:%d %s:%d", ARGNM(SC_UID),
+			 ARGNM(SC_DEVTYPE), dev->type,
+			 ARGNM(SC_SUBTYPE), dev->subtype);
+	else
+		snprintf(sel, sizeof(sel), "%s:%s", ARGNM(SC_UID), dev->uid);
+
+	if ((dev->type == DEVICE_SWITCH || dev->type == DEVICE_DIMMER
+	     || dev->subtype == SUBTYPE_SWITCH) &&
+	    dev->subtype != SUBTYPE_COLLECTOR) {
+		/* do a cfeed instead */
+		evbuffer_add_printf(send, "cfeed %s\n", sel);
+		evbuffer_add_printf(send, "ask %s\n", sel);
+		return;
+	}
+	scale = jsoncoll_scale(dev->subtype);
+	if (scale) {
+		evbuffer_add_printf(send, "feed %s %s:%ld %s:%d\n", sel,
+				    ARGNM(SC_RATE),
+				    cfg_getint(jsoncgicoll_c, "update"),
+				    ARGNM(SC_SCALE), scale);
+		evbuffer_add_printf(send, "ask %s %s:%d\n", sel,
+				    ARGNM(SC_SCALE), scale);
+	} else {
+		evbuffer_add_printf(send, "feed %s %s:%ld\n", sel,
+				    ARGNM(SC_RATE),
+				    cfg_getint(jsoncgicoll_c, "update"));
+		evbuffer_add_printf(send, "ask %s\n", sel);
+	}
+}
+
 /**
    \brief Handle a endldevs device command
    \param args The list of arguments
    \param arg void pointer to client_t of provider
-   \note now we want to establish feeds for everything
+   \note now we want to establish feeds for everything.  A server that
+   understands selectors gets one feed per type/subtype pair we have seen,
+   which also covers devices of that kind registered later.
 */
 
 int cmd_endldevs(pargs_t *args, void *arg)
 {
         device_t *dev;
-	int update, scale;
 	struct evbuffer *send;
 	struct event *ev;
 	struct timeval secs = { 1, 0 };
+	uint64_t seen[NROF_TYPES];
 
-	update = cfg_getint(jsoncgicoll_c, "update");
-
+	memset(seen, 0, sizeof(seen));
+	send = evbuffer_new();
 	TAILQ_FOREACH(dev, &alldevs, next_all) {
-		scale = 0;
-		switch (dev->subtype) {
-		case SUBTYPE_TEMP:
-			scale = cfg_getint(jsoncgicoll_c, "tscale");
-			break;
-		case SUBTYPE_PRESSURE:
-			scale = cfg_getint(jsoncgicoll_c, "baroscale");
-			break;
-		case SUBTYPE_SPEED:
-			scale = cfg_getint(jsoncgicoll_c, "speedscale");
-			break;
-		case SUBTYPE_RAINRATE:
-			scale = cfg_getint(jsoncgicoll_c, "lengthscale");
-			break;
-		case SUBTYPE_LUX:
-			scale = cfg_getint(jsoncgicoll_c, "lightscale");
-			break;
-		}
 		/* schedule a feed with the server */
-		send = evbuffer_new();
-
-		if ((dev->type == DEVICE_SWITCH || dev->type == DEVICE_DIMMER
-		     || dev->subtype == SUBTYPE_SWITCH) &&
-		    dev->subtype != SUBTYPE_COLLECTOR) {
-			/* do a cfeed instead */
-			evbuffer_add_printf(send, "cfeed %s:%s\n",
-					    ARGNM(SC_UID), dev->uid);
-			evbuffer_add_printf(send, "ask %s:%s\n",
-					    ARGNM(SC_UID), dev->uid);
-		} else {
-			if (scale) {
-				evbuffer_add_printf(send,
-						    "feed %s:%s %s:%d %s:%d\n",
-						    ARGNM(SC_UID), dev->uid,
-						    ARGNM(SC_RATE), update,
-						    ARGNM(SC_SCALE), scale);
-				evbuffer_add_printf(send, "ask %s:%s %s:%d\n",
-						    ARGNM(SC_UID), dev->uid,
-						    ARGNM(SC_SCALE), scale);
-			} else {
-				evbuffer_add_printf(send, "feed %s:%s %s:%d\n",
-						    ARGNM(SC_UID), dev->uid,
-						    ARGNM(SC_RATE), update);
-				evbuffer_add_printf(send, "ask %s:%s\n",
-						    ARGNM(SC_UID), dev->uid);
-			}
-		}
-		bufferevent_write_buffer(gnhastd_conn->bev, send);
-		evbuffer_free(send);
+		if (gnhastd_apiv >= GNHASTD_SELECT_VERS &&
+		    dev->type < NROF_TYPES && dev->subtype < 64) {
+			if (seen[dev->type] & ((uint64_t)1 << dev->subtype))
+				continue;
+			seen[dev->type] |= (uint64_t)1 << dev->subtype;
+			jsoncoll_subscribe(send, dev, 1);
+		} else
+			jsoncoll_subscribe(send, dev, 0);
 	}
+	bufferevent_write_buffer(gnhastd_conn->bev, send);
+	evbuffer_free(send);
 	secs.tv_sec = 2; /* do one right away */
 	ev = evtimer_new(base, json_dump_all, NULL);
 	evtimer_add(ev, &secs);
@@ -290,6 +322,8 @@ void jsoncoll_establish_feeds(void)
 {
 	struct evbuffer *send;
 
+	/* the apiv answer arrives ahead of endldevs */
+	gn_get_apiv(gnhastd_conn->bev);
 	send = evbuffer_new();
 	evbuffer_add_printf(send, "ldevs\n");
 	evbuffer_add_printf(send, "listenalarms alsev:1 alchan:%u\n",
@@ -0,0 +1,23 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/**
+	\file bench.h
+	\author Tim Rightnour
+	\brief Shared bits for the benchmark programs
+*/
+
+#include "config.h"
+#include <stdio.h>
+#include <stdint.h>
+#include "confuse.h"
+
+/** \brief parse_conf() wants this set to the base of the options */
+extern cfg_opt_t options[];
+extern FILE *logfile;
+extern cfg_t *cfg;
+
+double bench_now(void);
+void bench_report(const char *what, uint64_t count, double secs);
+
+#endif /*_BENCH_H_*/
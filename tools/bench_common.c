@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2026
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote 
+ *    products derived from this software without specific prior written 
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file bench_common.c
+   \author Tim Rightnour
+   \brief Globals and helpers shared by the benchmark programs
+   \note libgnhast expects its program to provide these globals, the
+   benchmarks fill in a gnhastd-like set, so they exercise the same
+   config and device code the daemon does.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <time.h>
+#include <event2/dns.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "common.h"
+#include "confuse.h"
+#include "genconn.h"
+#include "gncoll.h"
+#include "confparser.h"
+#include "bench.h"
+
+FILE *logfile;		/**< \brief our logfile */
+char *conffile = NULL;
+char *dumpconf = NULL;
+cfg_t *cfg;
+struct event_base *base;
+struct evdns_base *dns_base;
+connection_t *gnhastd_conn;
+int need_rereg = 0;
+char *conntype[3] = {
+	"none",
+	"gnhastd",
+};
+
+extern cfg_opt_t device_opts[];
+extern cfg_opt_t device_group_opts[];
+
+/** \brief just enough of gnhastd's options to read its device files */
+cfg_opt_t options[] = {
+	CFG_SEC("device", device_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_SEC("devgroup", device_group_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_INT_CB("confcache", 0, CFGF_NONE, conf_parse_bool),
+	CFG_FUNC("include", cfg_include),
+	CFG_END(),
+};
+
+/**
+   \brief Read the monotonic clock
+   \return seconds, as a double
+*/
+
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+/**
+   \brief Print one line of benchmark results
+   \param what name of what was timed
+   \param count number of operations
+   \param secs how long they took
+*/
+
+void bench_report(const char *what, uint64_t count, double secs)
+{
+	printf("%-24s %8llu ops %10.3f ms %12.1f ns/op\n",
+	    what, (unsigned long long)count, secs * 1e3,
+	    (count) ? secs * 1e9 / count : 0.0);
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+
+# Write a synthetic gnhastd devices file, for startup_bench.
+# Devices are put in groups of 100, and all the groups in one top group.
+
+CACHE=""
+if [ "$1" = "-c" ]; then
+    CACHE=1
+    shift
+fi
+
+if [ -z "$1" ]; then
+    echo "Usage:"
+    echo "$0 [-c] NROFDEVICES > devices.conf"
+    echo "  -c turns on the config cache"
+    exit 1
+fi
+
+awk -v n="$1" -v cache="$CACHE" 'BEGIN {
+	if (cache)
+		print "confcache = true";
+	for (i = 0; i < n; i++) {
+		uid = sprintf("28.%012X", i);
+		printf("device \"%s\" {\n", uid);
+		printf("  name = \"Sensor %d\"\n", i);
+		printf("  rrdname = \"sensor%d\"\n", i);
+		print "  subtype = temp";
+		print "  type = sensor";
+		print "  proto = insteon-v1";
+		printf("  tags = {\"bench\", \"row%d\"}\n", i % 10);
+		print "}";
+	}
+	for (g = 0; g * 100 < n; g++) {
+		printf("devgroup \"grp%d\" {\n", g);
+		printf("  name = \"Group %d\"\n", g);
+		printf("  devices = {");
+		for (i = g * 100; i < n && i < (g + 1) * 100; i++)
+			printf("%s\"28.%012X\"", (i > g * 100) ? ", " : "", i);
+		print "}";
+		print "}";
+	}
+	print "devgroup \"all\" {";
+	print "  name = \"All groups\"";
+	printf("  devgroups = {");
+	for (i = 0; i < g; i++)
+		printf("%s\"grp%d\"", (i > 0) ? ", " : "", i);
+	print "}";
+	print "}";
+}'
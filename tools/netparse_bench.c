@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2026
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote 
+ *    products derived from this software without specific prior written 
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file netparse_bench.c
+   \author Tim Rightnour
+   \brief Time the network line parser, and count what it allocates
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#ifdef HAVE_BSD_STDLIB_H
+#include <bsd/stdlib.h>
+#endif
+
+#include "common.h"
+#include "commands.h"
+#include "bench.h"
+
+extern int debugmode;
+
+/** \brief a mix of what collectors and clients send to gnhastd */
+static const char *bench_lines[] = {
+	"upd uid:28.8A4C2B050000 temp:21.437500\n",
+	"upd uid:04.1A2B3C humid:48.200000\n",
+	"mupd uid:28.8A4C2B050000 temp:21.5 uid:28.8A4C2B050001 temp:19.25 "
+	"uid:28.8A4C2B050002 temp:22.0\n",
+	"reg uid:28.8A4C2B050000 name:\"Living Room Temp\" "
+	"rrdname:LivingRoomTemp devt:1 subt:2 proto:8\n",
+	"chg uid:13.AB.CD.01 switch:1\n",
+	"cfeed uid:28.8A4C2B050000 rate:60\n",
+	"ping\n",
+	"ask uid:28.8A4C2B050000 uid:28.8A4C2B050001\n",
+};
+#define NROF_BENCH_LINES	(sizeof(bench_lines) / sizeof(char *))
+
+/**
+   \brief Fill an evbuffer with count lines from bench_lines
+   \param evbuf buffer to fill
+   \param count number of lines
+*/
+
+static void fill_lines(struct evbuffer *evbuf, int count)
+{
+	int i;
+
+	for (i=0; i < count; i++)
+		evbuffer_add(evbuf, bench_lines[i % NROF_BENCH_LINES],
+		    strlen(bench_lines[i % NROF_BENCH_LINES]));
+}
+
+/**
+   \brief Read and parse every line waiting in an evbuffer
+   \param np parser state
+   \param evbuf buffer to read from
+   \return number of lines parsed
+*/
+
+static uint64_t parse_lines(netparse_t *np, struct evbuffer *evbuf)
+{
+	char *line, *cmdword;
+	pargs_t *args;
+	size_t len;
+	uint64_t n = 0;
+
+	while ((line = netparse_readln(np, evbuf, &len)) != NULL) {
+		args = parse_netline(np, line, &cmdword);
+		if (args != NULL)
+			n++;
+	}
+	return(n);
+}
+
+int main(int argc, char **argv)
+{
+	extern char *optarg;
+	int ch, i, batch = 1000, rounds = 1000;
+	struct evbuffer *evbuf;
+	netparse_t *np;
+	uint64_t lines = 0, allocs;
+	double start, secs = 0.0;
+
+	while ((ch = getopt(argc, argv, "?b:r:")) != -1)
+		switch (ch) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+		case '?':	/* you blew it */
+			(void)fprintf(stderr, "usage:\n%s [-b lines_per_batch]"
+			    " [-r rounds]\n", getprogname());
+			return(EXIT_FAILURE);
+			/*NOTREACHED*/
+			break;
+		}
+
+	count_event_allocs();
+	logfile = stderr;
+	debugmode = 0;
+	init_argcomm();
+	evbuf = evbuffer_new();
+	np = smalloc(netparse_t);
+
+	/* one pass to size the parser, as a connection would */
+	fill_lines(evbuf, NROF_BENCH_LINES);
+	parse_lines(np, evbuf);
+
+	allocs = 0;
+	for (i=0; i < rounds; i++) {
+		fill_lines(evbuf, batch);
+		allocs -= nrof_allocs;
+		start = bench_now();
+		lines += parse_lines(np, evbuf);
+		secs += bench_now() - start;
+		allocs += nrof_allocs;
+	}
+	bench_report("readln+parse_netline", lines, secs);
+	printf("counted allocations: %llu, %.3f per line\n",
+	    (unsigned long long)allocs, (lines) ? (double)allocs / lines : 0.0);
+	printf("parser buffers: line %zu bytes, args %d, arena %zu bytes\n",
+	    np->linesize, np->argsize, np->arenasize);
+
+	netparse_free(np);
+	evbuffer_free(evbuf);
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote 
+ *    products derived from this software without specific prior written 
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file startup_bench.c
+   \author Tim Rightnour
+   \brief Time the config and device table work gnhastd does at startup
+   \note Feed it a file from gen_devconf.sh.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_BSD_STDLIB_H
+#include <bsd/stdlib.h>
+#endif
+
+#include "common.h"
+#include "gnhast.h"
+#include "confuse.h"
+#include "confparser.h"
+#include "bench.h"
+
+extern TAILQ_HEAD(, _device_t) alldevs;
+
+/**
+   \brief Time one parse_conf() of a file
+   \param what name for the report
+   \param file config file to parse
+   \return the parsed config, exits if it did not parse
+*/
+
+static cfg_t *time_parse(const char *what, const char *file)
+{
+	cfg_t *newcfg;
+	double start;
+
+	start = bench_now();
+	newcfg = parse_conf(file);
+	if (newcfg == NULL) {
+		(void)fprintf(stderr, "%s did not parse\n", file);
+		exit(EXIT_FAILURE);
+	}
+	bench_report(what, 1, bench_now() - start);
+	return(newcfg);
+}
+
+int main(int argc, char **argv)
+{
+	device_t *dev;
+	cfg_t *again;
+	double start;
+	int n;
+
+	if (argc != 2) {
+		(void)fprintf(stderr, "usage:\n%s devices.conf\n",
+		    getprogname());
+		return(EXIT_FAILURE);
+	}
+
+	logfile = stderr;
+	init_argcomm();
+
+	printf("%s\n", argv[1]);
+	cfg = time_parse("parse_conf", argv[1]);
+	printf("%d devices, %d devgroups, confcache %s\n",
+	    cfg_size(cfg, "device"), cfg_size(cfg, "devgroup"),
+	    confcache_wanted(cfg) ? "on" : "off");
+
+	start = bench_now();
+	init_devtable(cfg, 1);
+	bench_report("init_devtable", cfg_size(cfg, "device"),
+	    bench_now() - start);
+
+	start = bench_now();
+	parse_devgroups(cfg);
+	bench_report("parse_devgroups", cfg_size(cfg, "devgroup"),
+	    bench_now() - start);
+
+	/* what a devconf dump does for every device */
+	n = 0;
+	start = bench_now();
+	TAILQ_FOREACH(dev, &alldevs, next_all) {
+		new_conf_from_dev(cfg, dev);
+		n++;
+	}
+	bench_report("new_conf_from_dev", n, bench_now() - start);
+
+	/* with confcache on, the first parse wrote the cache */
+	again = time_parse("parse_conf again", argv[1]);
+	cfg_free(again);
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2026
+ *      Tim Rightnour.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of Tim Rightnour may not be used to endorse or promote 
+ *    products derived from this software without specific prior written 
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY TIM RIGHTNOUR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL TIM RIGHTNOUR BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+   \file unwatch_bench.c
+   \author Tim Rightnour
+   \brief Time dropping a disconnected client's device watches
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_BSD_STDLIB_H
+#include <bsd/stdlib.h>
+#endif
+
+#include "common.h"
+#include "gnhast.h"
+#include "bench.h"
+
+extern TAILQ_HEAD(, _device_t) alldevs;
+
+/**
+   \brief Create ndevs sensors in the device table
+   \param ndevs number of devices
+*/
+
+static void make_devices(int ndevs)
+{
+	device_t *dev;
+	char uid[32];
+	int i;
+
+	for (i=0; i < ndevs; i++) {
+		dev = smalloc(device_t);
+		snprintf(uid, sizeof(uid), "28.%012X", i);
+		dev->uid = strdup(uid);
+		dev->type = DEVICE_SENSOR;
+		dev->subtype = SUBTYPE_TEMP;
+		TAILQ_INIT(&dev->watchers);
+		insert_device(dev);
+	}
+}
+
+/**
+   \brief Create clients, each watching a spread of devices
+   \param nclients number of clients
+   \param ndevs number of devices in the table
+   \param nwatch devices each client watches
+   \return array of clients
+*/
+
+static client_t **make_clients(int nclients, int ndevs, int nwatch)
+{
+	client_t **clients;
+	int i, j;
+
+	clients = safer_malloc(sizeof(client_t *) * nclients);
+	for (i=0; i < nclients; i++) {
+		clients[i] = smalloc(client_t);
+		TAILQ_INIT(&clients[i]->watching);
+		TAILQ_INIT(&clients[i]->pending);
+		for (j=0; j < nwatch; j++)
+			add_wrapped_client(clients[i], find_device_byhandle(
+			    1 + (i * 7 + j * 97) % ndevs));
+	}
+	return(clients);
+}
+
+/**
+   \brief Drop a client's watches the way gnhastd did before it kept
+   client->watching, by looking at every watcher of every device
+   \param client client to unwatch
+*/
+
+static void scan_unwatch(client_t *client)
+{
+	device_t *dev;
+	wrap_client_t *wrap, *next;
+
+	TAILQ_FOREACH(dev, &alldevs, next_all) {
+		for (wrap = TAILQ_FIRST(&dev->watchers); wrap; wrap = next) {
+			next = TAILQ_NEXT(wrap, next);
+			if (wrap->client != client)
+				continue;
+			TAILQ_REMOVE(&dev->watchers, wrap, next);
+			TAILQ_REMOVE(&client->watching, wrap, next_client);
+			free(wrap);
+			client->watched--;
+		}
+	}
+}
+
+/**
+   \brief Disconnect every client, and report how long it took
+   \param what name for the report
+   \param clients clients to disconnect
+   \param nclients number of clients
+   \param unwatch function that drops a client's watches
+*/
+
+static void disconnect_all(const char *what, client_t **clients,
+    int nclients, void (*unwatch)(client_t *))
+{
+	double start;
+	int i;
+
+	start = bench_now();
+	for (i=0; i < nclients; i++)
+		unwatch(clients[i]);
+	bench_report(what, nclients, bench_now() - start);
+	for (i=0; i < nclients; i++) {
+		if (clients[i]->watched != 0)
+			printf("client %d still watches %u devices\n", i,
+			    clients[i]->watched);
+		free(clients[i]);
+	}
+	free(clients);
+}
+
+int main(int argc, char **argv)
+{
+	extern char *optarg;
+	int ch, nclients = 1000, ndevs = 10000, nwatch = 100;
+
+	while ((ch = getopt(argc, argv, "?c:d:w:")) != -1)
+		switch (ch) {
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+		case 'd':
+			ndevs = atoi(optarg);
+			break;
+		case 'w':
+			nwatch = atoi(optarg);
+			break;
+		default:
+		case '?':	/* you blew it */
+			(void)fprintf(stderr, "usage:\n%s [-c clients] "
+			    "[-d devices] [-w watched_per_client]\n",
+			    getprogname());
+			return(EXIT_FAILURE);
+			/*NOTREACHED*/
+			break;
+		}
+	if (nclients < 1 || ndevs < 1 || nwatch < 0) {
+		(void)fprintf(stderr, "clients and devices must be > 0\n");
+		return(EXIT_FAILURE);
+	}
+
+	logfile = stderr;
+	make_devices(ndevs);
+	printf("%d clients, %d devices, %d watched per client\n",
+	    nclients, ndevs, nwatch);
+
+	disconnect_all("scan every device", make_clients(nclients, ndevs,
+	    nwatch), nclients, scan_unwatch);
+	disconnect_all("remove_wrapped_client", make_clients(nclients, ndevs,
+	    nwatch), nclients, remove_wrapped_client);
+	return(EXIT_SUCCESS);
+}
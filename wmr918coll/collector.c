@@ -84,12 +84,18 @@ int gotdata = 0;
 char *uidprefix = "wmr918";
 time_t wmr_lastupd;
 
+/** devices updated by the packet being handled, sent in one batch */
+#define WMR_MAX_PENDING	16
+device_t *pending[WMR_MAX_PENDING];
+int nrofpending = 0;
+
 /** Need the argtable in scope, so we can generate proper commands
     for the server */
 extern argtable_t argtable[];
 extern TAILQ_HEAD(, _device_t) alldevs;
 extern int collector_instance;
 extern struct bufferevent *gnhastd_bev;
+extern int gn_want_handles;
 
 /** The event base */
 struct event_base *base;
@@ -247,6 +253,31 @@ device_t *new_dev(int subtype, double val, char *suffix)
 	return dev;
 }
 
+/**
+   \brief Send all pending device updates to the server
+*/
+
+void flush_updates(void)
+{
+	if (nrofpending == 0)
+		return;
+	gn_update_devices(pending, nrofpending, GNC_NOSCALE,
+	    gnhastd_conn->bev);
+	nrofpending = 0;
+}
+
+/**
+   \brief Queue a device to be sent with the current batch
+   \param dev device to send
+*/
+
+void queue_update(device_t *dev)
+{
+	if (nrofpending == WMR_MAX_PENDING)
+		flush_updates();
+	pending[nrofpending++] = dev;
+}
+
 /**
    \brief Update a device
    \param val current reading
@@ -264,7 +295,7 @@ void update_dev(double val, char *suffix)
 		LOG(LOG_FATAL, "Cannot find dev %s", buf);
 	store_data_dev(dev, DATALOC_DATA, &val);
 	if (dev->name)
-		gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+		queue_update(dev);
 }
 
 /**
@@ -317,7 +348,7 @@ void update_int_dev(int val, char *suffix)
 		LOG(LOG_FATAL, "Cannot find dev %s", buf);
 	store_data_dev(dev, DATALOC_DATA, &val);
 	if (dev->name)
-		gn_update_device(dev, GNC_NOSCALE, gnhastd_conn->bev);
+		queue_update(dev);
 }
 
 
@@ -829,6 +860,7 @@ void wx2_buf_read_cb(struct bufferevent *in, void *arg)
 			evbuffer_drain(evbuf, GROUP_TIME_SIZE);
 			break;
 		}
+		flush_updates();
 		data = evbuffer_pullup(evbuf, 1);
 	}
 	wmr_lastupd = time(NULL);
@@ -1455,6 +1487,7 @@ void wmr_buf_read_cb(struct bufferevent *in, void *arg)
 			evbuffer_drain(evbuf, WMR_TYPE_EXTTHB_SIZE);
 			break;
 		}
+		flush_updates();
 		data = evbuffer_pullup(evbuf, 3);
 	}
 	wmr_lastupd = time(NULL);
@@ -1544,6 +1577,9 @@ void connect_server_cb(int nada, short what, void *arg)
 		LOG(LOG_NOTICE, "Attempting to connect to %s @ %s:%d",
 		    conntype[conn->type], conn->host, conn->port);
 		if (need_rereg) {
+			/* forget the old server's apiv before registering,
+			   cmd_apiv asks for handles once the answer is in */
+			gn_get_apiv(gnhastd_conn->bev);
 			TAILQ_FOREACH(dev, &alldevs, next_all)
 				if (dumpconf == NULL && dev->name != NULL)
 					gn_register_device(dev, conn->bev);
@@ -1762,11 +1798,14 @@ int main(int argc, char **argv)
 	gnhastd_conn->port = cfg_getint(gnhastd_c, "port");
 	gnhastd_conn->type = CONN_TYPE_GNHASTD;
 	gnhastd_conn->host = cfg_getstr(gnhastd_c, "hostname");
+	/* we update often, let the server skip the uid lookups */
+	gn_want_handles = 1;
 	/* cheat, and directly call the timer callback
 	   This sets up a connection to the server. */
 	connect_server_cb(0, 0, gnhastd_conn);
 	collector_instance = cfg_getint(wmr918_c, "instance");
 	gn_client_name(gnhastd_conn->bev, COLLECTOR_NAME);
+	gn_get_apiv(gnhastd_conn->bev);
 
 	switch (cfg_getint(wmr918_c, "conntype")) {
 	case CONN_TYPE_WX200D: